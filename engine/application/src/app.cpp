@@ -30,11 +30,31 @@ void App::update(double deltaTime)
     ImGui::Begin("Test");
     ImGui::Text("Hello world");
     ImGui::Text("Frame time: %.1fms (%.1f FPS)", deltaTime * 1000, ImGui::GetIO().Framerate);
-    static bool enableCulling = true;
-    ImGui::Checkbox("Enable culling", &enableCulling);
+    static Renderer::RenderOptions options;
+    ImGui::Checkbox("Enable culling", &options.enableCulling);
+    ImGui::Checkbox("Enable instancing", &options.enableInstancing);
+    ImGui::Checkbox("Enable occlusion culling", &options.enableOcclusionCulling);
+    ImGui::Checkbox("Enable LOD selection", &options.enableLod);
+    ImGui::Checkbox("Enable cluster culling", &options.enableClusterCulling);
+    ImGui::Checkbox("Enable mesh heap defragmentation", &options.enableDefragmentation);
+    const Renderer::FrameStats& stats = renderer->getFrameStats();
+    ImGui::Text("Draws: %u, batches: %u, indirect commands: %u", stats.drawCount, stats.batchCount, stats.commandCount);
+    ImGui::Text("GPU time: culling %.3fms, main pass %.3fms", stats.cullTime, stats.renderTime);
+    ImGui::Text("Upload rate: %.1f MiB/s", stats.uploadRate);
+    ImGui::Text(
+            "Mesh memory: %.1f MiB, fragmentation: %.1f%%, defragmented %.1f KiB",
+            double(stats.meshMemory) / (1024.0 * 1024.0),
+            stats.meshHeapFragmentation * 100.0f,
+            double(stats.defragmentedBytes) / 1024.0
+    );
+    ImGui::Text(
+            "Streamed textures: %.1f / %.1f MiB",
+            double(stats.textureMemory) / (1024.0 * 1024.0),
+            double(stats.textureBudget) / (1024.0 * 1024.0)
+    );
     ImGui::End();
     ImGui::Render();
-    renderer->render(world, camera, enableCulling);
+    renderer->render(world, camera, options);
 }
 
 void App::processEvents(double deltaTime)
@@ -3,25 +3,13 @@
 //
 
 #pragma once
-#include <cstdint>
+#include "types.h"
 #include <fmt/format.h>
 #include <source_location>
 #include <stdexcept>
 
 namespace dragonfire {
 
-using UInt8 = std::uint8_t;
-using UInt16 = std::uint16_t;
-using UInt32 = std::uint32_t;
-using UInt64 = std::uint64_t;
-using UInt = UInt32;
-using Int8 = std::int8_t;
-using Int16 = std::int16_t;
-using Int32 = std::int32_t;
-using Int64 = std::int64_t;
-using Int = Int32;
-using USize = std::size_t;
-
 #ifdef NDEBUG
 [[noreturn]] void crash(const char* msg);
 
@@ -0,0 +1,23 @@
+//
+// Created by josh on 10/19/26.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace dragonfire {
+
+using UInt8 = std::uint8_t;
+using UInt16 = std::uint16_t;
+using UInt32 = std::uint32_t;
+using UInt64 = std::uint64_t;
+using UInt = UInt32;
+using Int8 = std::int8_t;
+using Int16 = std::int16_t;
+using Int32 = std::int32_t;
+using Int64 = std::int64_t;
+using Int = Int32;
+using USize = std::size_t;
+
+}   // namespace dragonfire
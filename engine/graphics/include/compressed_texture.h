@@ -0,0 +1,46 @@
+//
+// Created by josh on 10/19/26.
+//
+
+#pragma once
+#include <span>
+
+namespace dragonfire {
+
+/// A block compressed image together with its whole mip chain, stored on disk as a KTX2 file
+struct CompressedTexture {
+    enum class Format {
+        /// Opaque color, 8 bytes per 4x4 block
+        BC1_SRGB,
+        /// Normal maps, only x and y are stored and z is reconstructed when sampling
+        BC5_UNORM,
+        /// Color with alpha, 16 bytes per 4x4 block
+        BC7_SRGB,
+    };
+
+    struct Level {
+        UInt32 width = 0, height = 0;
+        /// Range of the level's blocks in the data
+        USize offset = 0, size = 0;
+    };
+
+    Format format{};
+    /// Every level down to 1x1, largest first
+    std::vector<Level> levels;
+    std::vector<UInt8> data;
+
+    static constexpr UInt32 BLOCK_DIMENSION = 4;
+    static UInt32 getBlockSize(Format format);
+
+    /**
+     * @brief Generates the mip chain of an image and compresses every level of it
+     * Color is filtered in linear space and normals are renormalized after filtering.
+     * @param pixels 8 bit rgba texels, color is in sRGB and normals are unsigned normalized
+     */
+    static CompressedTexture encode(const UInt8* pixels, UInt32 width, UInt32 height, Format format);
+    /// @throws std::runtime_error if the file isn't a KTX2 file of a supported format without supercompression
+    static CompressedTexture readKtx2(std::span<const UInt8> file);
+    [[nodiscard]] std::vector<UInt8> writeKtx2() const;
+};
+
+}   // namespace dragonfire
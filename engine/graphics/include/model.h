@@ -4,6 +4,7 @@
 
 #pragma once
 #include <glm/glm.hpp>
+#include <span>
 #include "material.h"
 
 namespace dragonfire {
@@ -17,6 +18,58 @@ public:
         glm::vec2 uv;
     };
 
+    /// Half sized vertex with 16 bit positions normalized to the mesh's bounds, octahedral normals and half float uvs
+    struct CompactVertex {
+        /// Unorm, the fourth component only pads the position to 8 bytes
+        UInt16 position[4];
+        /// Snorm octahedral encoding
+        Int16 normal[2];
+        UInt16 uv[2];
+    };
+
+    enum class VertexFormat {
+        FULL,
+        COMPACT,
+    };
+
+    /// Maps the normalized positions of compact vertices back to model space
+    struct Quantization {
+        glm::vec3 offset{0.0f};
+        glm::vec3 scale{1.0f};
+    };
+
+    /// A range of a mesh's index buffer rendering a simplified version of it
+    struct Lod {
+        UInt32 indexOffset = 0, indexCount = 0;
+        /// Simplification error in model space units
+        float error = 0.0f;
+        /// Range of the mesh's meshlets covering this level's indices
+        UInt32 meshletOffset = 0, meshletCount = 0;
+    };
+
+    /// A small cluster of triangles that is culled on its own, laid out the same way the gpu reads it
+    struct alignas(16) Meshlet {
+        /// Model space bounding sphere
+        glm::vec4 bounds;
+        /// Normal cone axis in xyz and cutoff in w, the meshlet faces away when viewed from inside the cone
+        glm::vec4 cone;
+        /// Index range relative to the start of the level of detail the meshlet belongs to
+        UInt32 indexOffset = 0, indexCount = 0;
+    };
+
+    /// Geometry compressed with meshoptimizer's vertex and index codecs, decoded straight into upload memory
+    struct EncodedMesh {
+        std::span<const UInt8> vertexData, indexData;
+        UInt32 vertexCount = 0, indexCount = 0;
+        VertexFormat format = VertexFormat::FULL;
+        Quantization quantization;
+        std::span<const Lod> lods;
+        std::span<const Meshlet> meshlets;
+    };
+
+    static constexpr USize MAX_LOD_COUNT = 8;
+    static constexpr USize MESHLET_MAX_VERTICES = 64, MESHLET_MAX_TRIANGLES = 124;
+
     struct Primitive {
         MeshHandle mesh{};
         glm::vec4 bounds;
@@ -24,6 +77,11 @@ public:
         glm::mat4 transform{};
     };
 
+    /**
+     * @brief Imports a gltf model, or loads the baked copy written by an earlier import of the same file
+     * The baked copy stores the processed geometry compressed with meshoptimizer's codecs together
+     * with the materials and encoded images, so the gltf file isn't read again while it's unchanged.
+     */
     static Model loadGltfModel(const char* path, class Renderer* renderer, bool optimizeModel = true);
 
 private:
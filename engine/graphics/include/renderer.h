@@ -4,18 +4,66 @@
 
 #pragma once
 #include "camera.h"
+#include "compressed_texture.h"
 #include "material.h"
 #include "model.h"
 #include <SDL_video.h>
+#include <optional>
 
 namespace dragonfire {
 
 class Renderer {
 public:
+    struct RenderOptions {
+        bool enableCulling = true;
+        /// Merge draws of the same mesh and material into instanced draws
+        bool enableInstancing = true;
+        /// Skip draws hidden behind the depth of what was visible last frame
+        bool enableOcclusionCulling = true;
+        /// Draw simplified meshes when the simplification error is smaller than a pixel on screen
+        bool enableLod = true;
+        /// Cull the meshlets of large meshes individually instead of drawing the whole mesh
+        bool enableClusterCulling = true;
+        /// Compact the mesh heaps a few megabytes per frame when meshes are freed
+        bool enableDefragmentation = true;
+    };
+
+    /// Statistics of the last frame that finished rendering on the gpu
+    struct FrameStats {
+        UInt32 drawCount = 0;
+        UInt32 batchCount = 0;
+        UInt32 commandCount = 0;
+        double cullTime = 0.0;
+        double renderTime = 0.0;
+        /// MiB per second of gpu uploads that finished, averaged over about a second
+        double uploadRate = 0.0;
+        /// Largest fragmentation of the mesh heaps, 0 when the free space of each is contiguous
+        float meshHeapFragmentation = 0.0f;
+        UInt64 defragmentedBytes = 0;
+        /// Device memory bound to the vertex, index and meshlet heaps
+        UInt64 meshMemory = 0;
+        /// Resident size of the streamed textures and the budget they are kept under
+        UInt64 textureMemory = 0, textureBudget = 0;
+    };
+
     virtual ~Renderer() = default;
     virtual void init() = 0;
     virtual void shutdown() = 0;
-    virtual MeshHandle createMesh(std::span<Model::Vertex> vertices, std::span<UInt32> indices) = 0;
+    virtual MeshHandle createMesh(
+            std::span<Model::Vertex> vertices,
+            std::span<UInt32> indices,
+            std::span<const Model::Lod> lods = {},
+            std::span<const Model::Meshlet> meshlets = {}
+    ) = 0;
+    virtual MeshHandle createCompactMesh(
+            std::span<Model::CompactVertex> vertices,
+            std::span<UInt32> indices,
+            const Model::Quantization& quantization,
+            std::span<const Model::Lod> lods = {},
+            std::span<const Model::Meshlet> meshlets = {}
+    ) = 0;
+    /// The mesh is decoded on the calling thread, so meshes can be decoded in parallel
+    virtual MeshHandle createEncodedMesh(const Model::EncodedMesh& mesh) = 0;
     virtual UInt32 loadTexture(
             const std::string& name,
             const void* data,
@@ -28,14 +76,56 @@ public:
             Material::TextureFilterMode minFilter = Material::TextureFilterMode::NONE,
             Material::TextureFilterMode magFilter = Material::TextureFilterMode::NONE
     ) = 0;
+    /// An image uploaded by loadTextures, either raw rgba pixels or a block compressed texture
+    struct TextureUpload {
+        std::string name;
+        /// 8 or 16 bit rgba texels, only read during loadTextures
+        const void* pixels = nullptr;
+        UInt32 width = 0, height = 0;
+        UInt bitDepth = 8, pixelSize = 1;
+        /// Used instead of the pixels if set
+        std::optional<CompressedTexture> compressed;
+        Material::TextureWrapMode wrapS = Material::TextureWrapMode::REPEAT;
+        Material::TextureWrapMode wrapT = Material::TextureWrapMode::REPEAT;
+        Material::TextureFilterMode minFilter = Material::TextureFilterMode::NONE;
+        Material::TextureFilterMode magFilter = Material::TextureFilterMode::NONE;
+    };
+
+    /**
+     * @brief Uploads the textures with a submission per batch of them instead of one per texture
+     * Their descriptors are written with a single update per frame. Compressed textures may be moved from,
+     * the renderer keeps their levels to stream them. Safe to call from several threads, which share batches.
+     * @return the texture id of every upload, 0 for textures that couldn't be loaded
+     */
+    virtual std::vector<UInt32> loadTextures(std::span<TextureUpload> textures) = 0;
+    /**
+     * @brief Uploads a block compressed texture with the mip chain it comes with
+     * The renderer keeps the texture to stream its finer levels in and out depending on how it is sampled.
+     */
+    virtual UInt32 loadCompressedTexture(
+            const std::string& name,
+            CompressedTexture texture,
+            Material::TextureWrapMode wrapS = Material::TextureWrapMode::REPEAT,
+            Material::TextureWrapMode wrapT = Material::TextureWrapMode::REPEAT,
+            Material::TextureFilterMode minFilter = Material::TextureFilterMode::NONE,
+            Material::TextureFilterMode magFilter = Material::TextureFilterMode::NONE
+    ) = 0;
+    /// Whether the device can sample block compressed textures, they have to be uploaded uncompressed otherwise
+    virtual bool supportsCompressedTextures() = 0;
+    /// Id of the texture loaded under the name, if there is one
+    virtual std::optional<UInt32> findTexture(const std::string& name) = 0;
     virtual void freeMesh(MeshHandle mesh) = 0;
-    virtual void render(class World& world, const Camera& camera, bool enableCulling = true) = 0;
+    virtual void freeTexture(const std::string& name) = 0;
+    virtual void render(class World& world, const Camera& camera, const RenderOptions& options = {}) = 0;
     virtual void startImGuiFrame() = 0;
 
     SDL_Window* getWindow() { return window; }
 
+    [[nodiscard]] const FrameStats& getFrameStats() const { return frameStats; }
+
 protected:
     UInt64 frameCount = 0;
+    FrameStats frameStats;
     std::shared_ptr<spdlog::logger> logger;
     SDL_Window* window = nullptr;
 
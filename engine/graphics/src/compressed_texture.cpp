@@ -0,0 +1,366 @@
+//
+// Created by josh on 10/19/26.
+//
+
+#include "compressed_texture.h"
+#define RGBCX_IMPLEMENTATION
+#include <algorithm>
+#include <array>
+#include <bc7enc.h>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <glm/glm.hpp>
+#include <mutex>
+#include <rgbcx.h>
+
+namespace dragonfire {
+
+static constexpr std::array<UInt8, 12> KTX2_IDENTIFIER =
+        {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};   // «KTX 20»\r\n\x1A\n
+
+struct Ktx2Header {
+    std::array<UInt8, 12> identifier = KTX2_IDENTIFIER;
+    UInt32 vkFormat = 0, typeSize = 1;
+    UInt32 pixelWidth = 0, pixelHeight = 0, pixelDepth = 0;
+    UInt32 layerCount = 0, faceCount = 1, levelCount = 0, supercompressionScheme = 0;
+    UInt32 dfdByteOffset = 0, dfdByteLength = 0, kvdByteOffset = 0, kvdByteLength = 0;
+    UInt64 sgdByteOffset = 0, sgdByteLength = 0;
+};
+
+static_assert(sizeof(Ktx2Header) == 80);
+
+struct Ktx2Level {
+    UInt64 byteOffset = 0, byteLength = 0, uncompressedByteLength = 0;
+};
+
+/// Quality of the BC1 encoder from 0 to 18, higher levels search more endpoints
+static constexpr UInt32 BC1_QUALITY_LEVEL = 10;
+
+static bc7enc_compress_block_params bc7Params;
+static std::once_flag encoderInitFlag;
+
+static void initEncoders()
+{
+    std::call_once(encoderInitFlag, [] {
+        rgbcx::init();
+        bc7enc_compress_block_init();
+        bc7enc_compress_block_params_init(&bc7Params);
+        bc7Params.m_perceptual = true;
+    });
+}
+
+UInt32 CompressedTexture::getBlockSize(CompressedTexture::Format format)
+{
+    switch (format) {
+        case Format::BC1_SRGB: return 8;
+        case Format::BC5_UNORM:
+        case Format::BC7_SRGB: return 16;
+    }
+    crash("Unreachable");
+}
+
+// The graphics library doesn't depend on vulkan, so the VkFormat values KTX2 stores are spelled out
+static UInt32 getVkFormat(CompressedTexture::Format format)
+{
+    switch (format) {
+        case CompressedTexture::Format::BC1_SRGB: return 132;    // VK_FORMAT_BC1_RGB_SRGB_BLOCK
+        case CompressedTexture::Format::BC5_UNORM: return 141;   // VK_FORMAT_BC5_UNORM_BLOCK
+        case CompressedTexture::Format::BC7_SRGB: return 146;    // VK_FORMAT_BC7_SRGB_BLOCK
+    }
+    crash("Unreachable");
+}
+
+static CompressedTexture::Format getFormat(UInt32 vkFormat)
+{
+    using Format = CompressedTexture::Format;
+    for (Format format : {Format::BC1_SRGB, Format::BC5_UNORM, Format::BC7_SRGB}) {
+        if (getVkFormat(format) == vkFormat)
+            return format;
+    }
+    throw FormattedError("Unsupported KTX2 texture format {}", vkFormat);
+}
+
+/// Basic data format descriptor of the format as laid out by the Khronos data format specification
+static std::vector<UInt8> getDataFormatDescriptor(CompressedTexture::Format format)
+{
+    struct Sample {
+        UInt16 bitOffset = 0;
+        UInt8 bitLength = 0, channelType = 0;
+        UInt8 position[4]{};
+        UInt32 lower = 0, upper = UINT32_MAX;
+    };
+
+    static_assert(sizeof(Sample) == 16);
+    std::vector<Sample> samples;
+    UInt8 colorModel = 0, transferFunction = 2;   // KHR_DF_TRANSFER_SRGB
+    switch (format) {
+        case CompressedTexture::Format::BC1_SRGB:
+            colorModel = 128;   // KHR_DF_MODEL_BC1A
+            samples.push_back(Sample{0, 63, 0});
+            break;
+        case CompressedTexture::Format::BC5_UNORM:
+            colorModel = 132;   // KHR_DF_MODEL_BC5
+            transferFunction = 1;
+            samples.push_back(Sample{0, 63, 0});
+            samples.push_back(Sample{64, 63, 1});
+            break;
+        case CompressedTexture::Format::BC7_SRGB:
+            colorModel = 134;   // KHR_DF_MODEL_BC7
+            samples.push_back(Sample{0, 127, 0});
+            break;
+    }
+    const UInt16 blockSize = UInt16(24 + 16 * samples.size());
+    const UInt32 totalSize = sizeof(UInt32) + blockSize;
+    const UInt32 descriptorType = 0;   // Khronos vendor, basic descriptor block
+    const UInt16 version = 2;
+    const UInt8 header[] = {
+            colorModel,
+            1,   // BT.709 primaries
+            transferFunction,
+            0,   // straight alpha
+            3,   // 4x4x1x1 texel blocks, stored minus one
+            3,
+            0,
+            0,
+            UInt8(CompressedTexture::getBlockSize(format)),
+            0,
+            0,
+            0,
+            0,
+            0,
+            0,
+            0,
+    };
+
+    std::vector<UInt8> out(totalSize);
+    UInt8* ptr = out.data();
+    memcpy(ptr, &totalSize, sizeof(totalSize));
+    memcpy(ptr + 4, &descriptorType, sizeof(descriptorType));
+    memcpy(ptr + 8, &version, sizeof(version));
+    memcpy(ptr + 10, &blockSize, sizeof(blockSize));
+    memcpy(ptr + 12, header, sizeof(header));
+    memcpy(ptr + 28, samples.data(), samples.size() * sizeof(Sample));
+    return out;
+}
+
+static const std::array<float, 256> SRGB_TO_LINEAR = [] {
+    std::array<float, 256> table{};
+    for (USize i = 0; i < table.size(); i++) {
+        const float value = float(i) / 255.0f;
+        table[i] = value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+    }
+    return table;
+}();
+
+static UInt8 toUnorm(float value)
+{
+    return UInt8(std::lround(std::clamp(value, 0.0f, 1.0f) * 255.0f));
+}
+
+static UInt8 toSrgb(float value)
+{
+    value = std::clamp(value, 0.0f, 1.0f);
+    return toUnorm(value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f);
+}
+
+/// Texels are filtered as linear color or as normals in [-1, 1]
+static std::vector<glm::vec4> toFilterSpace(const std::vector<UInt8>& texels, bool normalMap)
+{
+    std::vector<glm::vec4> out(texels.size() / 4);
+    for (USize i = 0; i < out.size(); i++) {
+        const UInt8* texel = &texels[i * 4];
+        if (normalMap) {
+            out[i] = glm::vec4(texel[0], texel[1], texel[2], texel[3]) / 127.5f - 1.0f;
+        }
+        else {
+            out[i] = glm::vec4(
+                    SRGB_TO_LINEAR[texel[0]],
+                    SRGB_TO_LINEAR[texel[1]],
+                    SRGB_TO_LINEAR[texel[2]],
+                    float(texel[3]) / 255.0f
+            );
+        }
+    }
+    return out;
+}
+
+static std::vector<UInt8> fromFilterSpace(const std::vector<glm::vec4>& values, bool normalMap)
+{
+    std::vector<UInt8> out(values.size() * 4);
+    for (USize i = 0; i < values.size(); i++) {
+        UInt8* texel = &out[i * 4];
+        if (normalMap) {
+            const glm::vec3 normal = glm::vec3(values[i]);
+            const float length = glm::length(normal);
+            const glm::vec3 unit = length > 1e-6f ? normal / length : glm::vec3(0.0f, 0.0f, 1.0f);
+            texel[0] = toUnorm(unit.x * 0.5f + 0.5f);
+            texel[1] = toUnorm(unit.y * 0.5f + 0.5f);
+            texel[2] = toUnorm(unit.z * 0.5f + 0.5f);
+            texel[3] = 255;
+        }
+        else {
+            texel[0] = toSrgb(values[i].r);
+            texel[1] = toSrgb(values[i].g);
+            texel[2] = toSrgb(values[i].b);
+            texel[3] = toUnorm(values[i].a);
+        }
+    }
+    return out;
+}
+
+/// Box filters the level down to the next one, odd edges are clamped
+static std::vector<glm::vec4> downsample(const std::vector<glm::vec4>& level, UInt32 width, UInt32 height)
+{
+    const UInt32 nextWidth = std::max(width / 2, 1u), nextHeight = std::max(height / 2, 1u);
+    std::vector<glm::vec4> out(USize(nextWidth) * nextHeight);
+    for (UInt32 y = 0; y < nextHeight; y++) {
+        const UInt32 y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+        for (UInt32 x = 0; x < nextWidth; x++) {
+            const UInt32 x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+            out[USize(y) * nextWidth + x] = (level[USize(y0) * width + x0] + level[USize(y0) * width + x1]
+                                             + level[USize(y1) * width + x0] + level[USize(y1) * width + x1])
+                                          * 0.25f;
+        }
+    }
+    return out;
+}
+
+static void compressLevel(
+        const UInt8* texels,
+        UInt32 width,
+        UInt32 height,
+        CompressedTexture::Format format,
+        UInt8* out
+)
+{
+    constexpr UInt32 dim = CompressedTexture::BLOCK_DIMENSION;
+    const UInt32 blockSize = CompressedTexture::getBlockSize(format);
+    UInt8 block[dim * dim * 4];
+    for (UInt32 blockY = 0; blockY < height; blockY += dim) {
+        for (UInt32 blockX = 0; blockX < width; blockX += dim) {
+            // Blocks hanging over the edge of small levels repeat the edge texels
+            for (UInt32 y = 0; y < dim; y++) {
+                for (UInt32 x = 0; x < dim; x++) {
+                    const UInt32 srcX = std::min(blockX + x, width - 1), srcY = std::min(blockY + y, height - 1);
+                    memcpy(&block[(y * dim + x) * 4], &texels[(USize(srcY) * width + srcX) * 4], 4);
+                }
+            }
+            switch (format) {
+                case CompressedTexture::Format::BC1_SRGB:
+                    rgbcx::encode_bc1(BC1_QUALITY_LEVEL, out, block, false, false);
+                    break;
+                case CompressedTexture::Format::BC5_UNORM: rgbcx::encode_bc5(out, block, 0, 1, 4); break;
+                case CompressedTexture::Format::BC7_SRGB: bc7enc_compress_block(out, block, &bc7Params); break;
+            }
+            out += blockSize;
+        }
+    }
+}
+
+static USize getLevelSize(UInt32 width, UInt32 height, CompressedTexture::Format format)
+{
+    constexpr UInt32 dim = CompressedTexture::BLOCK_DIMENSION;
+    return USize((width + dim - 1) / dim) * ((height + dim - 1) / dim) * CompressedTexture::getBlockSize(format);
+}
+
+CompressedTexture CompressedTexture::encode(const UInt8* pixels, UInt32 width, UInt32 height, Format format)
+{
+    initEncoders();
+    const bool normalMap = format == Format::BC5_UNORM;
+    CompressedTexture texture;
+    texture.format = format;
+    // The first level is compressed from the source texels as they are, the rest from the filtered values
+    std::vector<UInt8> texels(pixels, pixels + USize(width) * height * 4);
+    std::vector<glm::vec4> values = toFilterSpace(texels, normalMap);
+    const UInt32 levelCount = std::bit_width(std::max(width, height));
+    for (UInt32 i = 0; i < levelCount; i++) {
+        Level level;
+        level.width = std::max(width >> i, 1u);
+        level.height = std::max(height >> i, 1u);
+        if (i > 0) {
+            values = downsample(values, std::max(width >> (i - 1), 1u), std::max(height >> (i - 1), 1u));
+            texels = fromFilterSpace(values, normalMap);
+        }
+        level.offset = texture.data.size();
+        level.size = getLevelSize(level.width, level.height, format);
+        texture.data.resize(level.offset + level.size);
+        compressLevel(texels.data(), level.width, level.height, format, texture.data.data() + level.offset);
+        texture.levels.push_back(level);
+    }
+    return texture;
+}
+
+CompressedTexture CompressedTexture::readKtx2(std::span<const UInt8> file)
+{
+    Ktx2Header header;
+    if (file.size() < sizeof(header))
+        throw std::runtime_error("KTX2 file is truncated");
+    memcpy(&header, file.data(), sizeof(header));
+    if (header.identifier != KTX2_IDENTIFIER)
+        throw std::runtime_error("File is not a KTX2 file");
+    if (header.supercompressionScheme != 0 || header.pixelDepth != 0 || header.layerCount > 1 || header.faceCount != 1
+        || header.levelCount == 0 || header.levelCount > 32)
+        throw std::runtime_error("KTX2 file isn't a single 2D texture with a stored mip chain");
+
+    CompressedTexture texture;
+    texture.format = getFormat(header.vkFormat);
+    if (sizeof(header) + header.levelCount * sizeof(Ktx2Level) > file.size())
+        throw std::runtime_error("KTX2 file is truncated");
+    std::vector<Ktx2Level> ktxLevels(header.levelCount);
+    memcpy(ktxLevels.data(), file.data() + sizeof(header), ktxLevels.size() * sizeof(Ktx2Level));
+
+    texture.levels.resize(header.levelCount);
+    USize size = 0;
+    for (USize i = 0; i < ktxLevels.size(); i++) {
+        Level& level = texture.levels[i];
+        level.width = std::max(header.pixelWidth >> i, 1u);
+        level.height = std::max(header.pixelHeight >> i, 1u);
+        level.offset = size;
+        level.size = getLevelSize(level.width, level.height, texture.format);
+        const Ktx2Level& ktxLevel = ktxLevels[i];
+        if (ktxLevel.byteLength != level.size || ktxLevel.byteOffset > file.size()
+            || ktxLevel.byteLength > file.size() - ktxLevel.byteOffset)
+            throw FormattedError("Level {} of KTX2 file is out of bounds", i);
+        size += level.size;
+    }
+    texture.data.resize(size);
+    for (USize i = 0; i < ktxLevels.size(); i++) {
+        const Level& level = texture.levels[i];
+        memcpy(texture.data.data() + level.offset, file.data() + ktxLevels[i].byteOffset, level.size);
+    }
+    return texture;
+}
+
+std::vector<UInt8> CompressedTexture::writeKtx2() const
+{
+    const std::vector<UInt8> dfd = getDataFormatDescriptor(format);
+    const UInt32 blockSize = getBlockSize(format);
+    Ktx2Header header;
+    header.vkFormat = getVkFormat(format);
+    header.pixelWidth = levels.empty() ? 0 : levels[0].width;
+    header.pixelHeight = levels.empty() ? 0 : levels[0].height;
+    header.levelCount = levels.size();
+    header.dfdByteOffset = sizeof(header) + levels.size() * sizeof(Ktx2Level);
+    header.dfdByteLength = dfd.size();
+
+    // Level data is stored from the smallest level to the largest, each aligned to the block size
+    std::vector<Ktx2Level> ktxLevels(levels.size());
+    USize offset = header.dfdByteOffset + header.dfdByteLength;
+    for (USize i = levels.size(); i-- > 0;) {
+        offset = (offset + blockSize - 1) / blockSize * blockSize;
+        ktxLevels[i].byteOffset = offset;
+        ktxLevels[i].byteLength = ktxLevels[i].uncompressedByteLength = levels[i].size;
+        offset += levels[i].size;
+    }
+
+    std::vector<UInt8> out(offset);
+    memcpy(out.data(), &header, sizeof(header));
+    memcpy(out.data() + sizeof(header), ktxLevels.data(), ktxLevels.size() * sizeof(Ktx2Level));
+    memcpy(out.data() + header.dfdByteOffset, dfd.data(), dfd.size());
+    for (USize i = 0; i < levels.size(); i++)
+        memcpy(out.data() + ktxLevels[i].byteOffset, data.data() + levels[i].offset, levels[i].size);
+    return out;
+}
+
+}   // namespace dragonfire
@@ -3,7 +3,7 @@
 //
 
 #include "model.h"
-#ifdef __GNUC__   // STB image SIMD support doesn't work with gcc
+#if defined(__GNUC__) && !defined(__x86_64__)   // STB image SIMD support doesn't work with 32 bit gcc
     #define STBI_NO_SIMD
 #endif
 #define TINYGLTF_IMPLEMENTATION
@@ -12,10 +12,16 @@
 #define TINYGLTF_NO_INCLUDE_JSON
 #define TINYGLTF_USE_CPP14
 #include "renderer.h"
+#include <algorithm>
+#include <ankerl/unordered_dense.h>
+#include <chrono>
+#include <config.h>
 #include <file.h>
 #include <meshoptimizer.h>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <tiny_gltf.h>
+#include <utility.h>
 
 namespace dragonfire {
 
@@ -100,6 +106,115 @@ static void optimize(std::vector<Model::Vertex>& vertices, std::vector<UInt32>&
     );
 }
 
+/**
+ * @brief Appends progressively simplified copies of the mesh to the index buffer
+ *  Each level targets half the triangles of the previous one, the chain stops early
+ *  once the simplifier can't make meaningful progress.
+ * @return the index ranges of every level of detail, starting with the full mesh
+ */
+static std::vector<Model::Lod> buildLods(const std::vector<Model::Vertex>& vertices, std::vector<UInt32>& indices)
+{
+    std::vector<Model::Lod> lods;
+    lods.push_back(Model::Lod{0, UInt32(indices.size()), 0.0f});
+    const float scale = meshopt_simplifyScale(&vertices[0].position.x, vertices.size(), sizeof(Model::Vertex));
+    std::vector<UInt32> lodIndices(indices.size());
+    while (lods.size() < Model::MAX_LOD_COUNT) {
+        const Model::Lod& previous = lods.back();
+        const USize targetCount = USize(previous.indexCount * 0.5f) / 3 * 3;
+        float error = 0.0f;
+        USize count = meshopt_simplify(
+                lodIndices.data(),
+                &indices[previous.indexOffset],
+                previous.indexCount,
+                &vertices[0].position.x,
+                vertices.size(),
+                sizeof(Model::Vertex),
+                targetCount,
+                1e-2f,
+                0,
+                &error
+        );
+        if (count == 0 || count > previous.indexCount * 0.75f)
+            break;
+        meshopt_optimizeVertexCache(lodIndices.data(), lodIndices.data(), count, vertices.size());
+        // errors are relative to the mesh extents and accumulate across levels
+        Model::Lod lod{UInt32(indices.size()), UInt32(count), std::max(previous.error, error * scale)};
+        indices.insert(indices.end(), lodIndices.begin(), lodIndices.begin() + count);
+        lods.push_back(lod);
+    }
+    return lods;
+}
+
+/**
+ * @brief Splits every level of detail into meshlets so they can be culled individually
+ *  The indices of each level are rewritten in meshlet order, which lets every meshlet be drawn
+ *  as a plain index range without mesh shader support.
+ * @return the bounds, normal cones and index ranges of all meshlets, ordered by level of detail
+ */
+static std::vector<Model::Meshlet> buildMeshlets(
+        const std::vector<Model::Vertex>& vertices,
+        std::vector<UInt32>& indices,
+        std::vector<Model::Lod>& lods
+)
+{
+    std::vector<Model::Meshlet> out;
+    std::vector<meshopt_Meshlet> meshlets;
+    std::vector<UInt32> meshletVertices;
+    std::vector<UInt8> meshletTriangles;
+    for (Model::Lod& lod : lods) {
+        const USize maxMeshlets = meshopt_buildMeshletsBound(
+                lod.indexCount,
+                Model::MESHLET_MAX_VERTICES,
+                Model::MESHLET_MAX_TRIANGLES
+        );
+        meshlets.resize(maxMeshlets);
+        meshletVertices.resize(maxMeshlets * Model::MESHLET_MAX_VERTICES);
+        meshletTriangles.resize(maxMeshlets * Model::MESHLET_MAX_TRIANGLES * 3);
+        const USize meshletCount = meshopt_buildMeshlets(
+                meshlets.data(),
+                meshletVertices.data(),
+                meshletTriangles.data(),
+                &indices[lod.indexOffset],
+                lod.indexCount,
+                &vertices[0].position.x,
+                vertices.size(),
+                sizeof(Model::Vertex),
+                Model::MESHLET_MAX_VERTICES,
+                Model::MESHLET_MAX_TRIANGLES,
+                0.25f
+        );
+
+        lod.meshletOffset = UInt32(out.size());
+        lod.meshletCount = UInt32(meshletCount);
+        UInt32* lodIndices = &indices[lod.indexOffset];
+        UInt32 indexOffset = 0;
+        for (USize i = 0; i < meshletCount; i++) {
+            const meshopt_Meshlet& meshlet = meshlets[i];
+            const meshopt_Bounds bounds = meshopt_computeMeshletBounds(
+                    &meshletVertices[meshlet.vertex_offset],
+                    &meshletTriangles[meshlet.triangle_offset],
+                    meshlet.triangle_count,
+                    &vertices[0].position.x,
+                    vertices.size(),
+                    sizeof(Model::Vertex)
+            );
+            Model::Meshlet& outMeshlet = out.emplace_back();
+            outMeshlet.bounds = glm::vec4(bounds.center[0], bounds.center[1], bounds.center[2], bounds.radius);
+            outMeshlet.cone =
+                    glm::vec4(bounds.cone_axis[0], bounds.cone_axis[1], bounds.cone_axis[2], bounds.cone_cutoff);
+            outMeshlet.indexOffset = indexOffset;
+            outMeshlet.indexCount = meshlet.triangle_count * 3;
+            // The meshlets cover every triangle of the level exactly once, so it can be rewritten in place
+            for (UInt32 j = 0; j < outMeshlet.indexCount; j++) {
+                const UInt8 local = meshletTriangles[meshlet.triangle_offset + j];
+                lodIndices[indexOffset + j] = meshletVertices[meshlet.vertex_offset + local];
+            }
+            indexOffset += outMeshlet.indexCount;
+        }
+    }
+    return out;
+}
+
 static USize loadIndices(USize accessorIndex, const tinygltf::Model& model, std::vector<UInt32>& indices)
 {
     const tinygltf::Accessor& accessor = model.accessors[accessorIndex];
@@ -145,45 +260,292 @@ static Material::TextureFilterMode getFilterMode(int mode)
     }
 }
 
-static UInt32 loadTexture(USize index, const tinygltf::Model& model, Renderer* renderer)
+/// An image in its file format together with the sampler state of the texture using it
+struct TextureSource {
+    std::string name;
+    std::span<const UInt8> data;
+    Material::TextureWrapMode wrapS{}, wrapT{};
+    Material::TextureFilterMode minFilter{}, magFilter{};
+    /// Normal maps are compressed differently from color
+    bool normalMap = false;
+};
+
+static TextureSource getTextureSource(USize index, bool normalMap, const tinygltf::Model& model)
 {
     const tinygltf::Texture& texture = model.textures[index];
     const tinygltf::Sampler& sampler = model.samplers[texture.sampler];
     const tinygltf::Image& image = model.images[texture.source];
-    Material::TextureWrapMode wrapS, wrapT;
-    wrapS = getWrapMode(sampler.wrapS);
-    wrapT = getWrapMode(sampler.wrapT);
-    Material::TextureFilterMode minFilter, magFilter;
-    minFilter = getFilterMode(sampler.minFilter);
-    magFilter = getFilterMode(sampler.magFilter);
-    const std::string& name = texture.name.empty() ? image.name : texture.name;
-    auto id = renderer->loadTexture(
+    TextureSource source;
+    source.name = texture.name.empty() ? image.name : texture.name;
+    source.data = image.image;
+    source.wrapS = getWrapMode(sampler.wrapS);
+    source.wrapT = getWrapMode(sampler.wrapT);
+    source.minFilter = getFilterMode(sampler.minFilter);
+    source.magFilter = getFilterMode(sampler.magFilter);
+    source.normalMap = normalMap;
+    return source;
+}
+
+/// Pixels decoded by stbi, which have to outlive the upload reading them
+using DecodedPixels = std::unique_ptr<void, void (*)(void*)>;
+
+/// Decodes the image into rgba texels, pointing the upload at them
+static DecodedPixels
+decodeTexture(const TextureSource& source, const std::string& name, Renderer::TextureUpload& upload)
+{
+    const int size = int(source.data.size());
+    const bool wide = stbi_is_16_bit_from_memory(source.data.data(), size);
+    int width, height, channels;
+    // Textures are always uploaded with four channels
+    DecodedPixels pixels(nullptr, stbi_image_free);
+    if (wide)
+        pixels.reset(stbi_load_16_from_memory(source.data.data(), size, &width, &height, &channels, 4));
+    else
+        pixels.reset(stbi_load_from_memory(source.data.data(), size, &width, &height, &channels, 4));
+    if (!pixels)
+        throw FormattedError("Failed to decode image of texture \"{}\": {}", name, stbi_failure_reason());
+    upload.pixels = pixels.get();
+    upload.width = width;
+    upload.height = height;
+    upload.bitDepth = wide ? 16 : 8;
+    upload.pixelSize = wide ? 2 : 1;
+    return pixels;
+}
+
+/// Normal maps become BC5, opaque color BC1 and color with alpha BC7
+static CompressedTexture compressTexture(const TextureSource& source, const std::string& name)
+{
+    const auto start = std::chrono::steady_clock::now();
+    int width, height, channels;
+    std::unique_ptr<stbi_uc, void (*)(void*)> pixels(
+            stbi_load_from_memory(source.data.data(), int(source.data.size()), &width, &height, &channels, 4),
+            stbi_image_free
+    );
+    if (!pixels)
+        throw FormattedError("Failed to decode image of texture \"{}\": {}", name, stbi_failure_reason());
+    const USize size = USize(width) * height * 4;
+    CompressedTexture::Format format = CompressedTexture::Format::BC5_UNORM;
+    if (!source.normalMap) {
+        bool opaque = true;
+        for (USize i = 3; i < size && opaque; i += 4)
+            opaque = pixels.get()[i] == 255;
+        format = opaque ? CompressedTexture::Format::BC1_SRGB : CompressedTexture::Format::BC7_SRGB;
+    }
+    CompressedTexture texture = CompressedTexture::encode(pixels.get(), width, height, format);
+    const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    spdlog::info(
+            "Compressed texture \"{}\" from {} KiB to {} KiB including its mip chain in {:.2f} ms",
             name,
-            image.image.data(),
-            image.width,
-            image.height,
-            image.bits,
-            image.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT ? 2 : 1,
-            wrapS,
-            wrapT,
-            minFilter,
-            magFilter
+            size >> 10,
+            texture.data.size() >> 10,
+            elapsed
     );
-    spdlog::info("Loaded texture \"{}\" at index {}", name, id);
-    return id;
+    return texture;
+}
+
+/**
+ * @brief Loads the block compressed copy of the image from the texture cache
+ *  Images without a cached copy are compressed and written to the cache first, so this only happens once.
+ */
+static CompressedTexture loadCompressedTexture(const TextureSource& source, const std::string& name, UInt64 hash)
+{
+    const std::string path = fmt::format("cache/textures/{:016x}.ktx2", hash);
+    std::optional<CompressedTexture> texture;
+    if (PHYSFS_exists(path.c_str())) {
+        try {
+            File file(path);
+            const std::vector<UInt8> data = file.readData();
+            file.close();
+            texture = CompressedTexture::readKtx2(data);
+        }
+        catch (const std::exception& e) {
+            spdlog::warn("Compressed texture \"{}\" is unusable, compressing it again: {}", path, e.what());
+        }
+    }
+    if (!texture) {
+        texture = compressTexture(source, name);
+        try {
+            PHYSFS_mkdir("cache/textures");
+            File file(path, File::Mode::write);
+            file.writeData(texture->writeKtx2());
+            file.close();
+        }
+        catch (const std::exception& e) {
+            spdlog::warn("Failed to write compressed texture \"{}\": {}", path, e.what());
+        }
+    }
+    return std::move(*texture);
+}
+
+/// Decoded images held back for a batch upload, limited so a batch doesn't hold too much memory. The renderer
+/// splits what every worker uploads into staging batches of its own.
+static constexpr USize TEXTURE_BATCH_SIZE = 64, TEXTURE_BATCH_BYTES = 1 << 25;
+
+/// Names of the images loaded so far by their content hash, shared by every import
+static ankerl::unordered_dense::map<UInt64, std::string> loadedImages;
+static std::mutex loadedImagesMutex;
+
+/**
+ * @brief Decodes the images on the thread pool and loads them as textures
+ *  Images are deduplicated by content, including against the ones loaded by earlier imports,
+ *  so every distinct image is only decoded and uploaded once. Block compressed copies from the
+ *  texture cache are used instead when the renderer supports them.
+ * @return the texture id of every source
+ */
+static std::vector<UInt32> loadTextures(std::span<const TextureSource> sources, Renderer* renderer)
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<UInt32> ids(sources.size());
+    std::vector<std::string> names(sources.size());
+    std::vector<UInt64> hashes(sources.size());
+    std::vector<USize> firstSources(sources.size());
+    std::vector<USize> decodes;
+    ankerl::unordered_dense::map<UInt64, USize> hashSources;
+    {
+        std::unique_lock lock(loadedImagesMutex);
+        for (USize i = 0; i < sources.size(); i++) {
+            const TextureSource& source = sources[i];
+            const std::string_view data(reinterpret_cast<const char*>(source.data.data()), source.data.size());
+            hashes[i] = hashAll(ankerl::unordered_dense::hash<std::string_view>{}(data), source.normalMap);
+            auto [it, inserted] = hashSources.try_emplace(hashes[i], i);
+            firstSources[i] = it->second;
+            if (!inserted)
+                continue;
+            // Unnamed images would all collide in the renderer, so they are named after their content
+            auto loaded = loadedImages.find(hashes[i]);
+            if (loaded != loadedImages.end())
+                names[i] = loaded->second;
+            else
+                names[i] = source.name.empty() ? fmt::format("image_{:016x}", hashes[i]) : source.name;
+            std::optional<UInt32> id = renderer->findTexture(names[i]);
+            if (id)
+                ids[i] = *id;
+            else
+                decodes.push_back(i);
+        }
+    }
+
+    const bool compressed = renderer->supportsCompressedTextures();
+    // Every thread uploads its images in batches, so a submission covers many textures
+    BS::multi_future<void> future =
+            GLOBAL_THREAD_POOL.parallelize_loop(decodes.size(), [&](const USize begin, const USize end) {
+                std::vector<Renderer::TextureUpload> uploads;
+                std::vector<DecodedPixels> pixels;
+                std::vector<USize> indices;
+                USize batchBytes = 0;
+                const auto upload = [&] {
+                    const std::vector<UInt32> batchIds = renderer->loadTextures(uploads);
+                    for (USize i = 0; i < indices.size(); i++)
+                        ids[indices[i]] = batchIds[i];
+                    uploads.clear();
+                    pixels.clear();
+                    indices.clear();
+                    batchBytes = 0;
+                };
+                for (USize i = begin; i < end; i++) {
+                    const USize index = decodes[i];
+                    const TextureSource& source = sources[index];
+                    Renderer::TextureUpload& texture = uploads.emplace_back();
+                    texture.name = names[index];
+                    texture.wrapS = source.wrapS;
+                    texture.wrapT = source.wrapT;
+                    texture.minFilter = source.minFilter;
+                    texture.magFilter = source.magFilter;
+                    if (compressed) {
+                        texture.compressed = loadCompressedTexture(source, names[index], hashes[index]);
+                        batchBytes += texture.compressed->data.size();
+                    }
+                    else {
+                        pixels.push_back(decodeTexture(source, names[index], texture));
+                        batchBytes += USize(texture.width) * texture.height * texture.pixelSize * 4;
+                    }
+                    indices.push_back(index);
+                    if (uploads.size() >= TEXTURE_BATCH_SIZE || batchBytes >= TEXTURE_BATCH_BYTES)
+                        upload();
+                }
+                if (!uploads.empty())
+                    upload();
+            });
+    future.get();
+    {
+        std::unique_lock lock(loadedImagesMutex);
+        for (USize i : decodes)
+            loadedImages[hashes[i]] = names[i];
+    }
+    for (USize i = 0; i < sources.size(); i++)
+        ids[i] = ids[firstSources[i]];
+
+    const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (!sources.empty()) {
+        spdlog::info(
+                "Loaded {} textures, decoded {} distinct images in {:.2f} ms",
+                sources.size(),
+                decodes.size(),
+                elapsed
+        );
+    }
+    return ids;
 }
 
-Material loadMaterial(const tinygltf::Material& material, const tinygltf::Model& model, Renderer* renderer)
+static std::string getPipelineId(const tinygltf::Material& material)
 {
-    std::string pipelineId = material.values.contains("PIPELINE_ID") ? material.values.at("PIPELINE_ID").string_value
-                                                                     : material.name;
-    TextureIds textures{};
-    if (material.pbrMetallicRoughness.baseColorTexture.index >= 0)
-        textures.albedo = loadTexture(material.pbrMetallicRoughness.baseColorTexture.index, model, renderer);
-    if (material.normalTexture.index >= 0)
-        textures.normal = loadTexture(material.normalTexture.index, model, renderer);
-
-    return Material(std::move(pipelineId), textures);
+    return material.values.contains("PIPELINE_ID") ? material.values.at("PIPELINE_ID").string_value : material.name;
+}
+
+static glm::vec2 encodeOctahedral(glm::vec3 n)
+{
+    n /= std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    glm::vec2 e(n.x, n.y);
+    if (n.z < 0.0f) {
+        e.x = (1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+        e.y = (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return e;
+}
+
+/**
+ * @brief Converts the vertices to the compact format if 16 bit positions are precise enough for the mesh
+ * @param maxError largest allowed position error in model space units, quantization is disabled when it's 0
+ * @return false if the mesh is too large to be quantized within the error
+ */
+static bool quantizeVertices(
+        const std::vector<Model::Vertex>& vertices,
+        std::vector<Model::CompactVertex>& out,
+        Model::Quantization& quantization,
+        float maxError
+)
+{
+    if (maxError <= 0.0f || vertices.empty())
+        return false;
+    glm::vec3 min = vertices[0].position, max = vertices[0].position;
+    for (const Model::Vertex& vertex : vertices) {
+        min = glm::min(min, vertex.position);
+        max = glm::max(max, vertex.position);
+    }
+    // Rounding to the nearest step is off by at most half of it
+    const glm::vec3 extent = glm::max(max - min, glm::vec3(1e-8f));
+    const glm::vec3 step = extent / 65535.0f;
+    if (std::max({step.x, step.y, step.z}) * 0.5f > maxError)
+        return false;
+    quantization.offset = min;
+    quantization.scale = extent;
+
+    out.resize(vertices.size());
+    for (USize i = 0; i < vertices.size(); i++) {
+        const Model::Vertex& vertex = vertices[i];
+        Model::CompactVertex& compact = out[i];
+        const glm::vec3 position = (vertex.position - min) / extent;
+        compact.position[0] = UInt16(meshopt_quantizeUnorm(position.x, 16));
+        compact.position[1] = UInt16(meshopt_quantizeUnorm(position.y, 16));
+        compact.position[2] = UInt16(meshopt_quantizeUnorm(position.z, 16));
+        compact.position[3] = 0;
+        const glm::vec2 normal = encodeOctahedral(vertex.normal);
+        compact.normal[0] = Int16(meshopt_quantizeSnorm(normal.x, 16));
+        compact.normal[1] = Int16(meshopt_quantizeSnorm(normal.y, 16));
+        compact.uv[0] = meshopt_quantizeHalf(vertex.uv.x);
+        compact.uv[1] = meshopt_quantizeHalf(vertex.uv.y);
+    }
+    return true;
 }
 
 static glm::vec4 computeBounds(const std::vector<Model::Vertex>& vertices, const std::vector<UInt32>& indices)
@@ -202,55 +564,485 @@ static glm::vec4 computeBounds(const std::vector<Model::Vertex>& vertices, const
     return {center, radius};
 }
 
+/*
+ * Baked models are a header followed by every texture and then every primitive. Each record is a fixed
+ * size struct followed by its variable sized data in the order of the struct's size fields.
+ */
+static constexpr UInt32 BAKED_MAGIC = 0x424d4644;   // "DFMB"
+static constexpr UInt32 BAKED_VERSION = 3;
+static constexpr UInt32 NO_BAKED_TEXTURE = UINT32_MAX;
+
+struct BakedHeader {
+    UInt32 magic = BAKED_MAGIC, version = BAKED_VERSION;
+    /// Size and modification time of the gltf file, the baked copy is stale when either changes
+    Int64 sourceSize = 0, sourceModTime = 0;
+    /// Import settings the geometry was processed with
+    float quantizationError = 0.0f;
+    UInt32 optimized = 0;
+    UInt32 textureCount = 0, primitiveCount = 0;
+
+    bool operator==(const BakedHeader& other) const = default;
+};
+
+/// Followed by the name and the image file as stored in the gltf
+struct BakedTexture {
+    UInt32 nameSize = 0, dataSize = 0;
+    Material::TextureWrapMode wrapS{}, wrapT{};
+    Material::TextureFilterMode minFilter{}, magFilter{};
+    UInt32 normalMap = 0;
+};
+
+/// Followed by the pipeline id, levels of detail, meshlets and the encoded vertex and index streams
+struct BakedPrimitive {
+    glm::vec4 bounds{};
+    glm::mat4 transform{};
+    Model::Quantization quantization;
+    Model::VertexFormat format{};
+    UInt32 vertexCount = 0, indexCount = 0, lodCount = 0, meshletCount = 0;
+    UInt32 vertexDataSize = 0, indexDataSize = 0;
+    /// Indices into the baked textures
+    UInt32 albedoTexture = NO_BAKED_TEXTURE, normalTexture = NO_BAKED_TEXTURE;
+    UInt32 pipelineIdSize = 0;
+};
+
+static void writeBytes(std::vector<UInt8>& out, const void* data, USize size)
+{
+    const UInt8* bytes = static_cast<const UInt8*>(data);
+    out.insert(out.end(), bytes, bytes + size);
+}
+
+template<typename T>
+static void writeValue(std::vector<UInt8>& out, const T& value)
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+    writeBytes(out, &value, sizeof(T));
+}
+
+/// Reads the records of a baked model in order, throwing if the file ends early
+class BakedReader {
+public:
+    explicit BakedReader(std::span<const UInt8> data) : data(data) {}
+
+    std::span<const UInt8> take(USize size)
+    {
+        if (size > data.size() - offset)
+            throw std::runtime_error("Baked model is truncated");
+        std::span<const UInt8> out = data.subspan(offset, size);
+        offset += size;
+        return out;
+    }
+
+    template<typename T>
+    T read()
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        memcpy(&value, take(sizeof(T)).data(), sizeof(T));
+        return value;
+    }
+
+    /// Copies the values out since the file gives no alignment guarantees
+    template<typename T>
+    std::vector<T> readArray(USize count)
+    {
+        std::vector<T> values(count);
+        memcpy(values.data(), take(count * sizeof(T)).data(), count * sizeof(T));
+        return values;
+    }
+
+private:
+    std::span<const UInt8> data;
+    USize offset = 0;
+};
+
+static std::string getBakedPath(const char* path)
+{
+    std::string bakedPath = path;
+    std::replace(bakedPath.begin(), bakedPath.end(), '/', '_');
+    return "cache/models/" + bakedPath + ".dfmodel";
+}
+
+static BakedHeader getBakedHeader(const char* path, bool optimizeModel, float quantizationError)
+{
+    PHYSFS_Stat stat;
+    if (PHYSFS_stat(path, &stat) == 0)
+        throw PhysFSError();
+    BakedHeader header;
+    header.sourceSize = stat.filesize;
+    header.sourceModTime = stat.modtime;
+    header.quantizationError = quantizationError;
+    header.optimized = optimizeModel;
+    return header;
+}
+
+static void bakeTexture(const TextureSource& source, std::vector<UInt8>& out)
+{
+    BakedTexture baked;
+    baked.nameSize = source.name.size();
+    baked.dataSize = source.data.size();
+    baked.wrapS = source.wrapS;
+    baked.wrapT = source.wrapT;
+    baked.minFilter = source.minFilter;
+    baked.magFilter = source.magFilter;
+    baked.normalMap = source.normalMap;
+    writeValue(out, baked);
+    writeBytes(out, source.name.data(), source.name.size());
+    writeBytes(out, source.data.data(), source.data.size());
+}
+
+static TextureSource readBakedTexture(BakedReader& reader)
+{
+    const BakedTexture baked = reader.read<BakedTexture>();
+    const std::span<const UInt8> name = reader.take(baked.nameSize);
+    TextureSource source;
+    source.name.assign(name.begin(), name.end());
+    source.data = reader.take(baked.dataSize);
+    source.wrapS = baked.wrapS;
+    source.wrapT = baked.wrapT;
+    source.minFilter = baked.minFilter;
+    source.magFilter = baked.magFilter;
+    source.normalMap = baked.normalMap;
+    return source;
+}
+
+/**
+ * @brief Creates the primitives of a baked model, decoding their geometry in parallel on the thread pool
+ * @throws std::exception if there is no baked copy or it doesn't match the expected header
+ */
+static std::vector<Model::Primitive> loadBakedModel(const char* path, const BakedHeader& expected, Renderer* renderer)
+{
+    const auto start = std::chrono::steady_clock::now();
+    File file(path);
+    const std::vector<UInt8> data = file.readData();
+    file.close();
+    BakedReader reader(data);
+    BakedHeader header = reader.read<BakedHeader>();
+    const UInt32 textureCount = header.textureCount, primitiveCount = header.primitiveCount;
+    header.textureCount = header.primitiveCount = 0;
+    if (header != expected)
+        throw std::runtime_error("Baked model is out of date");
+
+    std::vector<TextureSource> textures(textureCount);
+    for (TextureSource& texture : textures)
+        texture = readBakedTexture(reader);
+
+    struct PrimitiveData {
+        BakedPrimitive baked;
+        std::string pipelineId;
+        std::vector<Model::Lod> lods;
+        std::vector<Model::Meshlet> meshlets;
+        Model::EncodedMesh mesh;
+    };
+
+    std::vector<PrimitiveData> primitives(primitiveCount);
+    for (PrimitiveData& primitive : primitives) {
+        primitive.baked = reader.read<BakedPrimitive>();
+        const BakedPrimitive& baked = primitive.baked;
+        const std::span<const UInt8> pipelineId = reader.take(baked.pipelineIdSize);
+        primitive.pipelineId.assign(pipelineId.begin(), pipelineId.end());
+        primitive.lods = reader.readArray<Model::Lod>(baked.lodCount);
+        primitive.meshlets = reader.readArray<Model::Meshlet>(baked.meshletCount);
+        primitive.mesh.vertexData = reader.take(baked.vertexDataSize);
+        primitive.mesh.indexData = reader.take(baked.indexDataSize);
+        primitive.mesh.vertexCount = baked.vertexCount;
+        primitive.mesh.indexCount = baked.indexCount;
+        primitive.mesh.format = baked.format;
+        primitive.mesh.quantization = baked.quantization;
+        primitive.mesh.lods = primitive.lods;
+        primitive.mesh.meshlets = primitive.meshlets;
+        for (UInt32 texture : {baked.albedoTexture, baked.normalTexture}) {
+            if (texture != NO_BAKED_TEXTURE && texture >= textureCount)
+                throw std::runtime_error("Baked primitive references a missing texture");
+        }
+    }
+
+    // Every worker decodes straight into the staging ring, so geometry decoding scales with the pool
+    const std::vector<UInt32> textureIds = loadTextures(textures, renderer);
+    std::vector<MeshHandle> handles(primitiveCount);
+    BS::multi_future<void> future = GLOBAL_THREAD_POOL.parallelize_loop(primitiveCount, [&](UInt32 begin, UInt32 end) {
+        for (UInt32 i = begin; i < end; i++)
+            handles[i] = renderer->createEncodedMesh(primitives[i].mesh);
+    });
+    future.wait();
+    try {
+        future.get();
+    }
+    catch (...) {
+        for (MeshHandle handle : handles) {
+            if (handle)
+                renderer->freeMesh(handle);
+        }
+        throw;
+    }
+
+    std::vector<Model::Primitive> out;
+    out.reserve(primitiveCount);
+    for (UInt32 i = 0; i < primitiveCount; i++) {
+        const BakedPrimitive& baked = primitives[i].baked;
+        TextureIds textures{};
+        if (baked.albedoTexture != NO_BAKED_TEXTURE)
+            textures.albedo = textureIds[baked.albedoTexture];
+        if (baked.normalTexture != NO_BAKED_TEXTURE)
+            textures.normal = textureIds[baked.normalTexture];
+        out.push_back(Model::Primitive{
+                handles[i],
+                baked.bounds,
+                Material(std::move(primitives[i].pipelineId), textures),
+                baked.transform,
+        });
+    }
+    const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    spdlog::info(
+            "Loaded baked model \"{}\" with {} primitives and {} textures, {} KiB in {:.2f} ms",
+            path,
+            primitiveCount,
+            textureCount,
+            data.size() >> 10,
+            elapsed
+    );
+    return out;
+}
+
+static std::vector<UInt8> encodeVertices(const void* vertices, USize vertexCount, USize vertexSize)
+{
+    std::vector<UInt8> out(meshopt_encodeVertexBufferBound(vertexCount, vertexSize));
+    out.resize(meshopt_encodeVertexBuffer(out.data(), out.size(), vertices, vertexCount, vertexSize));
+    return out;
+}
+
+static std::vector<UInt8> encodeIndices(const std::vector<UInt32>& indices, USize vertexCount)
+{
+    std::vector<UInt8> out(meshopt_encodeIndexBufferBound(indices.size(), vertexCount));
+    out.resize(meshopt_encodeIndexBuffer(out.data(), out.size(), indices.data(), indices.size()));
+    return out;
+}
+
+/// Geometry of a primitive processed by an import worker
+struct ImportedPrimitive {
+    MeshHandle mesh{};
+    /// Baked record without the material, which is filled in when the primitives are put together
+    BakedPrimitive baked;
+    /// Levels of detail, meshlets and the encoded vertex and index streams that follow the record
+    std::vector<UInt8> bakedData;
+    USize rawGeometrySize = 0;
+};
+
+/// Runs the whole geometry pipeline of one primitive and creates its mesh, safe to call from any thread
+static ImportedPrimitive importPrimitive(
+        const tinygltf::Model& model,
+        const tinygltf::Primitive& primitive,
+        Renderer* renderer,
+        bool optimizeModel,
+        float maxQuantizationError
+)
+{
+    std::vector<Model::Vertex> vertices;
+    std::vector<Model::CompactVertex> compactVertices;
+    std::vector<UInt32> indices;
+    USize count = 0;
+    const float* positions = reinterpret_cast<const float*>(getBufferData("POSITION", model, primitive, &count));
+    const float* normals = reinterpret_cast<const float*>(getBufferData("NORMAL", model, primitive));
+    const float* uvs = reinterpret_cast<const float*>(getBufferData("TEXCOORD_0", model, primitive));
+    vertices.reserve(count);
+    for (USize i = 0; i < count; i++) {
+        Model::Vertex& vertex = vertices.emplace_back();
+        vertex.position.x = positions[i * 3 + 0];
+        vertex.position.y = positions[i * 3 + 1];
+        vertex.position.z = positions[i * 3 + 2];
+        vertex.normal.x = normals[i * 3 + 0];
+        vertex.normal.y = normals[i * 3 + 1];
+        vertex.normal.z = normals[i * 3 + 2];
+        if (uvs) {
+            vertex.uv.x = uvs[i * 2 + 0];
+            vertex.uv.y = uvs[i * 2 + 1];
+        }
+    }
+    USize indexCount = loadIndices(primitive.indices, model, indices);
+    if (optimizeModel)
+        optimize(vertices, indices);
+    glm::vec4 bounds = computeBounds(vertices, indices);
+    std::vector<Model::Lod> lods = buildLods(vertices, indices);
+    std::vector<Model::Meshlet> meshlets = buildMeshlets(vertices, indices, lods);
+    // Simplification and meshlets are built from the full precision vertices either way
+    Model::Quantization quantization;
+    const bool compact = quantizeVertices(vertices, compactVertices, quantization, maxQuantizationError);
+
+    ImportedPrimitive out;
+    out.mesh = compact ? renderer->createCompactMesh(compactVertices, indices, quantization, lods, meshlets)
+                       : renderer->createMesh(vertices, indices, lods, meshlets);
+    spdlog::info(
+            "Loaded primitive geometry with {} {} vertices, {} indices, {} levels of detail, {} meshlets and "
+            "radius {}",
+            count,
+            compact ? "compact" : "full",
+            indexCount,
+            lods.size(),
+            meshlets.size(),
+            bounds.w
+    );
+
+    const USize vertexSize = compact ? sizeof(Model::CompactVertex) : sizeof(Model::Vertex);
+    const std::vector<UInt8> vertexData = encodeVertices(
+            compact ? static_cast<const void*>(compactVertices.data()) : vertices.data(),
+            vertices.size(),
+            vertexSize
+    );
+    const std::vector<UInt8> indexData = encodeIndices(indices, vertices.size());
+    BakedPrimitive& baked = out.baked;
+    baked.bounds = bounds;
+    baked.transform = glm::rotate(glm::identity<glm::mat4>(), glm::radians(180.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    baked.quantization = quantization;
+    baked.format = compact ? Model::VertexFormat::COMPACT : Model::VertexFormat::FULL;
+    baked.vertexCount = vertices.size();
+    baked.indexCount = indices.size();
+    baked.lodCount = lods.size();
+    baked.meshletCount = meshlets.size();
+    baked.vertexDataSize = vertexData.size();
+    baked.indexDataSize = indexData.size();
+    writeBytes(out.bakedData, lods.data(), lods.size() * sizeof(Model::Lod));
+    writeBytes(out.bakedData, meshlets.data(), meshlets.size() * sizeof(Model::Meshlet));
+    writeBytes(out.bakedData, vertexData.data(), vertexData.size());
+    writeBytes(out.bakedData, indexData.data(), indexData.size());
+    out.rawGeometrySize = vertices.size() * vertexSize + indices.size() * sizeof(UInt32);
+    return out;
+}
+
 Model Model::loadGltfModel(const char* path, Renderer* renderer, bool optimizeModel)
 {
+    float maxQuantizationError;
+    try {
+        maxQuantizationError = float(Config::INSTANCE.get<double>("graphics.vertexQuantizationError"));
+    }
+    catch (...) {
+        maxQuantizationError = 1e-4f;
+    }
+    Model out;
+    const std::string bakedPath = getBakedPath(path);
+    const BakedHeader bakedHeader = getBakedHeader(path, optimizeModel, maxQuantizationError);
+    try {
+        out.primitives = loadBakedModel(bakedPath.c_str(), bakedHeader, renderer);
+        return out;
+    }
+    catch (const std::exception& e) {
+        spdlog::info("No usable baked copy of model \"{}\", importing it: {}", path, e.what());
+    }
+
+    const auto start = std::chrono::steady_clock::now();
     static thread_local tinygltf::TinyGLTF gltf = initGltf();
     tinygltf::Model model;
     loadGltfFile(path, &model, gltf);
-    std::vector<Vertex> vertices;
-    std::vector<UInt32> indices;
-    Model out;
+    std::vector<const tinygltf::Primitive*> gltfPrimitives;
     for (const tinygltf::Mesh& mesh : model.meshes) {
-        for (const tinygltf::Primitive& primitive : mesh.primitives) {
-            USize count = 0;
-            const float* positions =
-                    reinterpret_cast<const float*>(getBufferData("POSITION", model, primitive, &count));
-            const float* normals = reinterpret_cast<const float*>(getBufferData("NORMAL", model, primitive));
-            const float* uvs = reinterpret_cast<const float*>(getBufferData("TEXCOORD_0", model, primitive));
-            vertices.reserve(count);
-            for (USize i = 0; i < count; i++) {
-                Vertex& vertex = vertices.emplace_back();
-                vertex.position.x = positions[i * 3 + 0];
-                vertex.position.y = positions[i * 3 + 1];
-                vertex.position.z = positions[i * 3 + 2];
-                vertex.normal.x = normals[i * 3 + 0];
-                vertex.normal.y = normals[i * 3 + 1];
-                vertex.normal.z = normals[i * 3 + 2];
-                if (uvs) {
-                    vertex.uv.x = uvs[i * 2 + 0];
-                    vertex.uv.y = uvs[i * 2 + 1];
+        for (const tinygltf::Primitive& primitive : mesh.primitives)
+            gltfPrimitives.push_back(&primitive);
+    }
+
+    // Primitives only read the parsed file and the renderer's mesh creation is thread safe, so the whole
+    // geometry pipeline runs on the pool. Uploads are only recorded and go out together at the next frame
+    std::vector<ImportedPrimitive> imported(gltfPrimitives.size());
+    BS::multi_future<void> future =
+            GLOBAL_THREAD_POOL.parallelize_loop(gltfPrimitives.size(), [&](const USize begin, const USize end) {
+                for (USize i = begin; i < end; i++) {
+                    imported[i] =
+                            importPrimitive(model, *gltfPrimitives[i], renderer, optimizeModel, maxQuantizationError);
                 }
-            }
-            USize indexCount = loadIndices(primitive.indices, model, indices);
-            if (optimizeModel)
-                optimize(vertices, indices);
-            MeshHandle handle = renderer->createMesh(vertices, indices);
-            Material material = loadMaterial(model.materials[primitive.material], model, renderer);
-
-            glm::vec4 bounds = computeBounds(vertices, indices);
-            out.primitives.emplace_back(Primitive{
-                    handle,
-                    bounds,
-                    material,
-                    glm::rotate(glm::identity<glm::mat4>(), glm::radians(180.0f), glm::vec3(1.0f, 0.0f, 0.0f)),
             });
-
-            spdlog::info("Loaded primitive geometry with {} vertices and {} indices and radius {}", count, indexCount, bounds.w);
-            vertices.clear();
-            indices.clear();
+    future.wait();
+    try {
+        future.get();
+    }
+    catch (...) {
+        for (const ImportedPrimitive& primitive : imported) {
+            if (primitive.mesh)
+                renderer->freeMesh(primitive.mesh);
         }
+        throw;
+    }
+    const double importTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    // Every texture used by the model's materials becomes one source, shared ones are only decoded and baked once
+    std::vector<TextureSource> textureSources;
+    ankerl::unordered_dense::map<int, UInt32> textureSourceIndices;
+    auto getTextureSourceIndex = [&](int index, bool normalMap) {
+        if (index < 0)
+            return NO_BAKED_TEXTURE;
+        auto [it, inserted] = textureSourceIndices.try_emplace(index * 2 + normalMap, UInt32(textureSources.size()));
+        if (inserted)
+            textureSources.push_back(getTextureSource(index, normalMap, model));
+        return it->second;
+    };
+    for (USize i = 0; i < imported.size(); i++) {
+        const tinygltf::Material& material = model.materials[gltfPrimitives[i]->material];
+        const int albedo = material.pbrMetallicRoughness.baseColorTexture.index;
+        imported[i].baked.albedoTexture = getTextureSourceIndex(albedo, false);
+        imported[i].baked.normalTexture = getTextureSourceIndex(material.normalTexture.index, true);
+    }
+    std::vector<UInt32> textureIds;
+    try {
+        textureIds = loadTextures(textureSources, renderer);
     }
+    catch (...) {
+        for (const ImportedPrimitive& primitive : imported)
+            renderer->freeMesh(primitive.mesh);
+        throw;
+    }
+
+    std::vector<UInt8> bakedPrimitives;
+    USize rawGeometrySize = 0, encodedGeometrySize = 0;
+    for (USize i = 0; i < imported.size(); i++) {
+        ImportedPrimitive& result = imported[i];
+        const std::string pipelineId = getPipelineId(model.materials[gltfPrimitives[i]->material]);
+        TextureIds textures{};
+        if (result.baked.albedoTexture != NO_BAKED_TEXTURE)
+            textures.albedo = textureIds[result.baked.albedoTexture];
+        if (result.baked.normalTexture != NO_BAKED_TEXTURE)
+            textures.normal = textureIds[result.baked.normalTexture];
+        out.primitives.emplace_back(Primitive{
+                result.mesh,
+                result.baked.bounds,
+                Material(std::string(pipelineId), textures),
+                result.baked.transform,
+        });
+
+        result.baked.pipelineIdSize = pipelineId.size();
+        writeValue(bakedPrimitives, result.baked);
+        writeBytes(bakedPrimitives, pipelineId.data(), pipelineId.size());
+        writeBytes(bakedPrimitives, result.bakedData.data(), result.bakedData.size());
+        rawGeometrySize += result.rawGeometrySize;
+        encodedGeometrySize += result.baked.vertexDataSize + result.baked.indexDataSize;
+    }
+    spdlog::info(
+            "Processed the geometry of {} primitives of model \"{}\" in {:.2f} ms on {} threads",
+            imported.size(),
+            path,
+            importTime,
+            GLOBAL_THREAD_POOL.get_thread_count()
+    );
 
+    try {
+        BakedHeader header = bakedHeader;
+        header.textureCount = textureSources.size();
+        header.primitiveCount = out.primitives.size();
+        std::vector<UInt8> bakedTextures;
+        for (const TextureSource& source : textureSources)
+            bakeTexture(source, bakedTextures);
+        PHYSFS_mkdir("cache/models");
+        File file(bakedPath, File::Mode::write);
+        file.writeData(&header, sizeof(header));
+        file.writeData(bakedTextures);
+        file.writeData(bakedPrimitives);
+        file.close();
+        spdlog::info(
+                "Baked model \"{}\" to \"{}\", geometry encoded from {} KiB to {} KiB",
+                path,
+                bakedPath,
+                rawGeometrySize >> 10,
+                encodedGeometrySize >> 10
+        );
+    }
+    catch (const std::exception& e) {
+        spdlog::warn("Failed to write baked model \"{}\": {}", bakedPath, e.what());
+    }
     return out;
 }
 
@@ -258,6 +1050,22 @@ tinygltf::TinyGLTF initGltf()
 {
     tinygltf::TinyGLTF loader;
     loader.SetPreserveImageChannels(true);
+    // Images are kept in their file format and decoded in parallel once it's known which ones are used
+    loader.SetImageLoader(
+            [](tinygltf::Image* image,
+               const int,
+               std::string*,
+               std::string*,
+               int,
+               int,
+               const unsigned char* bytes,
+               int size,
+               void*) {
+                image->image.assign(bytes, bytes + size);
+                return true;
+            },
+            nullptr
+    );
     tinygltf::FsCallbacks fsCallbacks{};
     fsCallbacks.FileExists = [](const std::string& filename, void*) { return PHYSFS_exists(filename.c_str()) != 0; };
     fsCallbacks.ExpandFilePath = [](const std::string& path, void*) { return path; };
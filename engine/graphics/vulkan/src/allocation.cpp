@@ -73,6 +73,104 @@ Buffer& Buffer::operator=(dragonfire::Buffer&& other) noexcept
     return *this;
 }
 
+SparseBuffer::SparseBuffer(
+        vk::Device device,
+        VmaAllocator allocator,
+        vk::DeviceSize size,
+        vk::BufferUsageFlags usage,
+        vk::DeviceSize minPageSize
+)
+    : device(device), allocator(allocator)
+{
+    vk::BufferCreateInfo createInfo{};
+    createInfo.size = size;
+    createInfo.usage = usage;
+    // Without residency every page would have to be bound before the buffer is used
+    createInfo.flags = vk::BufferCreateFlagBits::eSparseBinding | vk::BufferCreateFlagBits::eSparseResidency;
+    createInfo.sharingMode = vk::SharingMode::eExclusive;
+    buffer = device.createBuffer(createInfo);
+    requirements = device.getBufferMemoryRequirements(buffer);
+    // Sparse pages have to be a multiple of the buffer's alignment
+    pageSize = (std::max(minPageSize, requirements.alignment) + requirements.alignment - 1) / requirements.alignment
+             * requirements.alignment;
+    pages.resize((requirements.size + pageSize - 1) / pageSize, nullptr);
+    spdlog::trace("Created sparse buffer of size {} with {} pages", size, pages.size());
+}
+
+void SparseBuffer::commit(vk::DeviceSize offset, vk::DeviceSize size, std::vector<vk::SparseMemoryBind>& binds)
+{
+    if (size == 0)
+        return;
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    allocInfo.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    VkMemoryRequirements pageRequirements = requirements;
+    pageRequirements.size = pageSize;
+    const USize last = (offset + size - 1) / pageSize;
+    for (USize page = offset / pageSize; page <= last; page++) {
+        if (pages[page])
+            continue;
+        VmaAllocationInfo info;
+        vk::resultCheck(
+                static_cast<vk::Result>(
+                        vmaAllocateMemoryPages(allocator, &pageRequirements, &allocInfo, 1, &pages[page], &info)
+                ),
+                "Failed to allocate sparse buffer page"
+        );
+        vk::SparseMemoryBind& bind = binds.emplace_back();
+        bind.resourceOffset = page * pageSize;
+        bind.size = std::min(pageSize, requirements.size - bind.resourceOffset);
+        bind.memory = info.deviceMemory;
+        bind.memoryOffset = info.offset;
+        committedPages++;
+    }
+}
+
+void SparseBuffer::destroy()
+{
+    if (buffer) {
+        device.destroy(buffer);
+        for (VmaAllocation page : pages) {
+            if (page)
+                vmaFreeMemory(allocator, page);
+        }
+        pages.clear();
+        committedPages = 0;
+        buffer = nullptr;
+    }
+}
+
+SparseBuffer::SparseBuffer(SparseBuffer&& other) noexcept
+{
+    if (this != &other) {
+        destroy();
+        device = other.device;
+        allocator = other.allocator;
+        buffer = other.buffer;
+        requirements = other.requirements;
+        pageSize = other.pageSize;
+        pages = std::move(other.pages);
+        committedPages = other.committedPages;
+        other.buffer = nullptr;
+    }
+}
+
+SparseBuffer& SparseBuffer::operator=(SparseBuffer&& other) noexcept
+{
+    if (this != &other) {
+        destroy();
+        device = other.device;
+        allocator = other.allocator;
+        buffer = other.buffer;
+        requirements = other.requirements;
+        pageSize = other.pageSize;
+        pages = std::move(other.pages);
+        committedPages = other.committedPages;
+        other.buffer = nullptr;
+    }
+    return *this;
+}
+
 Image Image::Builder::build()
 {
     VkImageCreateInfo& create = createInfo;
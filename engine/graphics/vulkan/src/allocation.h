@@ -119,6 +119,47 @@ public:
     };
 };
 
+/**
+ * @brief Buffer with a large address range whose memory is allocated in pages as ranges of it are used
+ * Binding new pages is left to the caller through vkQueueBindSparse, the queue needs sparse binding support and
+ * the device sparseResidencyBuffer, since pages outside the ranges in use are never bound.
+ */
+class SparseBuffer {
+    vk::Device device;
+    VmaAllocator allocator = nullptr;
+    vk::Buffer buffer = nullptr;
+    vk::MemoryRequirements requirements;
+    vk::DeviceSize pageSize = 0;
+    std::vector<VmaAllocation> pages;
+    UInt64 committedPages = 0;
+
+public:
+    SparseBuffer() = default;
+    SparseBuffer(
+            vk::Device device,
+            VmaAllocator allocator,
+            vk::DeviceSize size,
+            vk::BufferUsageFlags usage,
+            vk::DeviceSize minPageSize
+    );
+
+    SparseBuffer(SparseBuffer&) = delete;
+    SparseBuffer& operator=(SparseBuffer&) = delete;
+    SparseBuffer(SparseBuffer&& other) noexcept;
+    SparseBuffer& operator=(SparseBuffer&& other) noexcept;
+
+    operator vk::Buffer() const { return buffer; }
+
+    /// Allocates memory for the pages of the range that don't have any yet and appends their binds
+    void commit(vk::DeviceSize offset, vk::DeviceSize size, std::vector<vk::SparseMemoryBind>& binds);
+
+    [[nodiscard]] vk::DeviceSize getCommittedBytes() const { return committedPages * pageSize; }
+
+    void destroy();
+
+    ~SparseBuffer() { destroy(); }
+};
+
 template<typename T>
 Allocation::Builder<T>::Builder() : allocInfo({})
 {
@@ -0,0 +1,136 @@
+//
+// Created by josh on 10/19/26.
+//
+
+#include "deletion_queue.h"
+
+namespace dragonfire {
+
+DeletionQueue::DeletionQueue(vk::Device device, UInt64 frameDelay) : device(device), frameDelay(frameDelay)
+{
+}
+
+DeletionQueue::Entry& DeletionQueue::getEntry()
+{
+    if (entries.empty() || entries.back().frame != currentFrame)
+        entries.emplace_back().frame = currentFrame;
+    return entries.back();
+}
+
+void DeletionQueue::push(Buffer&& buffer)
+{
+    std::unique_lock lock(mutex);
+    getEntry().buffers.push_back(std::move(buffer));
+}
+
+void DeletionQueue::push(Image&& image)
+{
+    std::unique_lock lock(mutex);
+    getEntry().images.push_back(std::move(image));
+}
+
+void DeletionQueue::push(vk::ImageView view)
+{
+    std::unique_lock lock(mutex);
+    getEntry().views.push_back(view);
+}
+
+void DeletionQueue::push(vk::Sampler sampler)
+{
+    std::unique_lock lock(mutex);
+    getEntry().samplers.push_back(sampler);
+}
+
+void DeletionQueue::push(vk::Pipeline pipeline)
+{
+    std::unique_lock lock(mutex);
+    getEntry().pipelines.push_back(pipeline);
+}
+
+void DeletionQueue::push(VmaVirtualBlock block, VmaVirtualAllocation allocation, std::mutex* blockMutex)
+{
+    std::unique_lock lock(mutex);
+    getEntry().virtualAllocations.push_back({block, allocation, blockMutex});
+}
+
+void DeletionQueue::nextFrame(UInt64 frame)
+{
+    std::deque<Entry> retired;
+    {
+        std::unique_lock lock(mutex);
+        currentFrame = frame;
+        while (!entries.empty() && entries.front().frame + frameDelay <= frame) {
+            retired.push_back(std::move(entries.front()));
+            entries.pop_front();
+        }
+    }
+    // Destroyed without the lock, freeing virtual allocations takes the owning registry's lock
+    for (Entry& entry : retired)
+        retire(entry);
+}
+
+void DeletionQueue::flush()
+{
+    std::deque<Entry> retired;
+    {
+        std::unique_lock lock(mutex);
+        retired = std::move(entries);
+        entries.clear();
+    }
+    for (Entry& entry : retired)
+        retire(entry);
+}
+
+void DeletionQueue::retire(Entry& entry)
+{
+    for (Buffer& buffer : entry.buffers)
+        buffer.destroy();
+    for (Image& image : entry.images)
+        image.destroy();
+    for (vk::ImageView view : entry.views)
+        device.destroy(view);
+    for (vk::Sampler sampler : entry.samplers)
+        device.destroy(sampler);
+    for (vk::Pipeline pipeline : entry.pipelines)
+        device.destroy(pipeline);
+    for (const VirtualAllocation& allocation : entry.virtualAllocations) {
+        std::unique_lock lock(*allocation.mutex);
+        vmaVirtualFree(allocation.block, allocation.allocation);
+    }
+}
+
+void DeletionQueue::destroy() noexcept
+{
+    if (device) {
+        flush();
+        device = nullptr;
+    }
+}
+
+DeletionQueue::DeletionQueue(DeletionQueue&& other) noexcept
+{
+    if (this != &other) {
+        std::unique_lock l1(mutex), l2(other.mutex);
+        device = other.device;
+        other.device = nullptr;
+        frameDelay = other.frameDelay;
+        currentFrame = other.currentFrame;
+        entries = std::move(other.entries);
+    }
+}
+
+DeletionQueue& DeletionQueue::operator=(DeletionQueue&& other) noexcept
+{
+    if (this != &other) {
+        destroy();
+        std::unique_lock l1(mutex), l2(other.mutex);
+        device = other.device;
+        other.device = nullptr;
+        frameDelay = other.frameDelay;
+        currentFrame = other.currentFrame;
+        entries = std::move(other.entries);
+    }
+    return *this;
+}
+
+}   // namespace dragonfire
@@ -0,0 +1,73 @@
+//
+// Created by josh on 10/19/26.
+//
+
+#pragma once
+#include "allocation.h"
+#include <deque>
+#include <mutex>
+
+namespace dragonfire {
+
+/**
+ * @brief Defers destruction of gpu resources until no frame in flight can still use them
+ * Resources are tagged with the frame that was current when they were queued and destroyed
+ * once that frame's fence has been waited on.
+ */
+class DeletionQueue {
+public:
+    DeletionQueue() = default;
+    DeletionQueue(vk::Device device, UInt64 frameDelay);
+
+    void push(Buffer&& buffer);
+    void push(Image&& image);
+    void push(vk::ImageView view);
+    void push(vk::Sampler sampler);
+    void push(vk::Pipeline pipeline);
+    /// Virtual blocks aren't thread safe, the allocation is freed while holding the block's mutex
+    void push(VmaVirtualBlock block, VmaVirtualAllocation allocation, std::mutex* blockMutex);
+
+    /**
+     * @brief Starts a new frame, destroying everything queued by frames that are no longer in flight
+     * Must be called after waiting for the fence of the frame that used the same frame slot.
+     */
+    void nextFrame(UInt64 frame);
+    /// Destroys everything still queued, the device must be idle
+    void flush();
+    void destroy() noexcept;
+
+    ~DeletionQueue() noexcept { destroy(); }
+
+    DeletionQueue(DeletionQueue&) = delete;
+    DeletionQueue& operator=(DeletionQueue&) = delete;
+    DeletionQueue(DeletionQueue&& other) noexcept;
+    DeletionQueue& operator=(DeletionQueue&& other) noexcept;
+
+private:
+    struct VirtualAllocation {
+        VmaVirtualBlock block;
+        VmaVirtualAllocation allocation;
+        std::mutex* mutex;
+    };
+
+    /// Everything queued during a single frame
+    struct Entry {
+        UInt64 frame = 0;
+        std::vector<Buffer> buffers;
+        std::vector<Image> images;
+        std::vector<vk::ImageView> views;
+        std::vector<vk::Sampler> samplers;
+        std::vector<vk::Pipeline> pipelines;
+        std::vector<VirtualAllocation> virtualAllocations;
+    };
+
+    vk::Device device;
+    UInt64 frameDelay = 0, currentFrame = 0;
+    std::deque<Entry> entries;
+    std::mutex mutex;
+
+    Entry& getEntry();
+    void retire(Entry& entry);
+};
+
+}   // namespace dragonfire
@@ -38,6 +38,15 @@ vk::DescriptorSetLayout DescriptorLayoutManager::getOrCreateLayout(DescriptorLay
     if (info.bindless) {
         std::vector<vk::DescriptorBindingFlags, FrameAllocator<vk::DescriptorBindingFlags>> flags;
         flags.resize(info.bindings.size());
+        // Sampler and image arrays are filled in as textures load, while the set may already be bound
+        for (USize i = 0; i < info.bindings.size(); i++) {
+            const vk::DescriptorType type = info.bindings[i].descriptorType;
+            if (info.bindings[i].descriptorCount > 1
+                && (type == vk::DescriptorType::eSampler || type == vk::DescriptorType::eSampledImage
+                    || type == vk::DescriptorType::eCombinedImageSampler))
+                flags[i] |= vk::DescriptorBindingFlagBits::ePartiallyBound
+                            | vk::DescriptorBindingFlagBits::eUpdateAfterBind;
+        }
         flags.back() |= vk::DescriptorBindingFlagBits::ePartiallyBound
                         | vk::DescriptorBindingFlagBits::eVariableDescriptorCount
                         | vk::DescriptorBindingFlagBits::eUpdateAfterBind;
@@ -5,8 +5,6 @@
 #pragma once
 #include <ankerl/unordered_dense.h>
 
-struct SpvReflectShaderModule;
-
 namespace dragonfire {
 
 class DescriptorLayoutManager {
@@ -5,6 +5,7 @@
 #include "vk_renderer.h"
 #include <SDL_vulkan.h>
 #include <allocators.h>
+#include <bit>
 #include <imgui_impl_sdl2.h>
 #include <imgui_impl_vulkan.h>
 #include <utility.h>
@@ -73,6 +74,32 @@ void VkRenderer::init()
     catch (...) {
         maxDrawCount = 1 << 14;
     }
+    maxBatchCount = maxDrawCount * UInt32(Model::MAX_LOD_COUNT);
+    try {
+        maxClusterCount = Config::INSTANCE.get<Int64>("graphics.maxClusterCount");
+    }
+    catch (...) {
+        maxClusterCount = 1 << 17;
+    }
+    try {
+        lodPixelError = float(Config::INSTANCE.get<double>("graphics.lodPixelError"));
+    }
+    catch (...) {
+        lodPixelError = 1.0f;
+    }
+    try {
+        defragmentBudget = Config::INSTANCE.get<Int64>("graphics.defragmentBudget");
+    }
+    catch (...) {
+        defragmentBudget = 1 << 22;
+    }
+    USize stagingRingSize;
+    try {
+        stagingRingSize = Config::INSTANCE.get<Int64>("graphics.stagingRingSize");
+    }
+    catch (...) {
+        stagingRingSize = 1 << 27;
+    }
     try {
         createInstance(validation);
         if (validation) {
@@ -86,31 +113,70 @@ void VkRenderer::init()
         createGpuAllocator();
         createMsaaImage();
         createDepthImage();
+        createDepthPyramid();
         createRenderPass();
         swapchain.initFramebuffers(mainRenderPass, msaaView, depthView);
         layoutManager = DescriptorLayoutManager(device);
-        {
-            PipelineFactory pipelineFactory(device, msaaSamples, &layoutManager, maxDrawCount, getRenderPasses());
-            pipelineLibrary.loadMaterialFiles("assets/materials", this, pipelineFactory);
-            auto [pipeline, layout] = pipelineFactory.createComputePipeline("cull.comp");
-            cullComputePipeline = pipeline;
-            cullComputeLayout = layout;
-        }
-        meshRegistry = Mesh::MeshRegistry(device, allocator, queues.graphics, queues.graphicsFamily);
+        pipelineFactory = std::make_unique<PipelineFactory>(
+                device,
+                physicalDevice.getProperties(),
+                msaaSamples,
+                &layoutManager,
+                maxDrawCount,
+                getRenderPasses()
+        );
+        pipelineLibrary.loadMaterialFiles("assets/materials", this, pipelineFactory.get());
+        auto [pipeline, layout] = pipelineFactory->createComputePipeline("cull.comp");
+        cullComputePipeline = pipeline;
+        cullComputeLayout = layout;
+        std::tie(depthReducePipeline, depthReduceLayout) = pipelineFactory->createComputePipeline("depth_reduce.comp");
+        std::tie(depthResolvePipeline, depthResolveLayout) =
+                pipelineFactory->createComputePipeline("depth_resolve.comp");
+        stagingRing = StagingRing(device, allocator, stagingRingSize);
+        deletionQueue = DeletionQueue(device, FRAMES_IN_FLIGHT);
+        meshRegistry = Mesh::MeshRegistry(
+                device,
+                allocator,
+                queues.transfer,
+                queues.transferFamily,
+                queues.graphicsFamily,
+                &queues.mutex,
+                &stagingRing
+        );
+        // Mip chains are generated by blitting each level from the previous one on the graphics queue
+        const vk::FormatFeatureFlags blitFeatures = vk::FormatFeatureFlagBits::eBlitSrc
+                                                  | vk::FormatFeatureFlagBits::eBlitDst
+                                                  | vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+        const vk::FormatProperties textureFormat = physicalDevice.getFormatProperties(vk::Format::eR8G8B8A8Srgb);
         textureRegistry = Texture::TextureRegistry(
                 device,
                 allocator,
                 queues.graphics,
                 queues.graphicsFamily,
-                limits.maxSamplerAnisotropy
+                limits.maxSamplerAnisotropy,
+                (textureFormat.optimalTilingFeatures & blitFeatures) == blitFeatures,
+                maxDrawCount,
+                &queues.mutex,
+                &stagingRing
         );
+        // Pending mesh uploads hold on to their staging memory until the next frame submits them, staged textures
+        // until their batch is full
+        stagingRing.addFlushCallback([this] { meshRegistry.submitUploads(); });
+        stagingRing.addFlushCallback([this] { textureRegistry.submitPending(); });
+        uploadSampleTime = std::chrono::steady_clock::now();
         createGlobalUBO();
         createDescriptorPool();
+        createOcclusionResources();
         UInt32 i = 0;
         for (auto& frame : frames) {
             initFrame(frame, i);
             i++;
         }
+        std::vector<Texture::TextureRegistry::DescriptorTarget> textureTargets;
+        for (const Frame& frame : frames)
+            textureTargets.push_back({frame.frameSet, frame.textureBinding, frame.samplerBinding});
+        textureRegistry.setDescriptorTargets(std::move(textureTargets));
+        writeDepthPyramidDescriptors();
         presentData.thread = std::jthread(std::bind_front(&VkRenderer::present, this));
         initImGui();
         logger->info("Vulkan initialization finished");
@@ -201,10 +267,13 @@ static bool checkFeatures(vk::PhysicalDevice device) noexcept
     auto& indexFeatures = chain.get<vk::PhysicalDeviceDescriptorIndexingFeatures>();
     auto& bufferFeatures = chain.get<vk::PhysicalDeviceBufferDeviceAddressFeatures>();
     auto& vk12Features = chain.get<vk::PhysicalDeviceVulkan12Features>();
-    return features.features.sparseBinding && features.features.samplerAnisotropy && features.features.sampleRateShading
-           && features.features.multiDrawIndirect && indexFeatures.descriptorBindingPartiallyBound
+    return features.features.sparseBinding && features.features.sparseResidencyBuffer
+           && features.features.samplerAnisotropy && features.features.sampleRateShading
+           && features.features.multiDrawIndirect && features.features.fragmentStoresAndAtomics
+           && indexFeatures.descriptorBindingPartiallyBound
            && indexFeatures.runtimeDescriptorArray && indexFeatures.descriptorBindingSampledImageUpdateAfterBind
-           && indexFeatures.descriptorBindingVariableDescriptorCount && bufferFeatures.bufferDeviceAddress
+           && indexFeatures.descriptorBindingVariableDescriptorCount
+           && indexFeatures.shaderSampledImageArrayNonUniformIndexing && bufferFeatures.bufferDeviceAddress
            && vk12Features.drawIndirectCount;
 }
 
@@ -329,7 +398,9 @@ bool VkRenderer::getQueueFamilies(vk::PhysicalDevice pDevice) noexcept
             foundPresent = true;
             queues.presentFamily = i;
         }
-        else if (!foundTransfer && prop.queueFlags & vk::QueueFlagBits::eTransfer) {
+        // Mesh heaps bind their memory on the transfer queue as they grow
+        else if (!foundTransfer && prop.queueFlags & vk::QueueFlagBits::eTransfer
+                 && prop.queueFlags & vk::QueueFlagBits::eSparseBinding) {
             foundTransfer = true;
             queues.transferFamily = i;
         }
@@ -348,7 +419,8 @@ bool VkRenderer::getQueueFamilies(vk::PhysicalDevice pDevice) noexcept
         return false;
     }
 
-    if (!foundTransfer && foundGraphics) {
+    if (!foundTransfer && foundGraphics
+        && properties[queues.graphicsFamily].queueFlags & vk::QueueFlagBits::eSparseBinding) {
         queues.transferFamily = queues.graphicsFamily;
         foundTransfer = true;
     }
@@ -386,12 +458,22 @@ void VkRenderer::createDevice()
     vk12Features.runtimeDescriptorArray = true;
     vk12Features.descriptorBindingSampledImageUpdateAfterBind = true;
     vk12Features.descriptorBindingVariableDescriptorCount = true;
+    // Instances of a draw may use different materials, so texture indices aren't uniform
+    vk12Features.shaderSampledImageArrayNonUniformIndexing = true;
     vk12Features.descriptorIndexing = true;
+    vk12Features.timelineSemaphore = true;
 
     features.features.sparseBinding = true;
+    // Mesh heaps only bind memory to the pages meshes are allocated in
+    features.features.sparseResidencyBuffer = true;
     features.features.samplerAnisotropy = true;
     features.features.sampleRateShading = true;
     features.features.multiDrawIndirect = true;
+    // Fragment shaders report the texture widths they sample for streaming with atomics
+    features.features.fragmentStoresAndAtomics = true;
+    // Optional, textures are uploaded uncompressed without it
+    textureCompression = physicalDevice.getFeatures().textureCompressionBC;
+    features.features.textureCompressionBC = textureCompression;
 
     for (const char* ext : DEVICE_EXTENSIONS)
         logger->info("Loaded device extension: {}", ext);
@@ -559,7 +641,9 @@ void VkRenderer::createDepthImage()
                          .withFormat(getDepthFormat(physicalDevice))
                          .withExtent(swapchain.getExtent())
                          .withSamples(msaaSamples)
-                         .withImageUsage(vk::ImageUsageFlagBits::eDepthStencilAttachment)
+                         .withImageUsage(
+                                 vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eSampled
+                         )
                          .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
                          .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
                          .build();
@@ -573,28 +657,36 @@ void VkRenderer::createDepthImage()
     depthView = depthImage.createView(device, subRange);
 }
 
-void VkRenderer::createRenderPass()
+static vk::RenderPass createMainRenderPass(
+        vk::Device device,
+        vk::Format colorFormat,
+        vk::Format depthFormat,
+        vk::SampleCountFlagBits samples,
+        bool late
+)
 {
     vk::AttachmentDescription attachments[3];
-    attachments[0].format = swapchain.getFormat();
-    attachments[0].samples = msaaSamples;
-    attachments[0].loadOp = vk::AttachmentLoadOp::eClear;
+    attachments[0].format = colorFormat;
+    attachments[0].samples = samples;
+    attachments[0].loadOp = late ? vk::AttachmentLoadOp::eLoad : vk::AttachmentLoadOp::eClear;
     attachments[0].storeOp = vk::AttachmentStoreOp::eStore;
     attachments[0].stencilLoadOp = vk::AttachmentLoadOp::eDontCare;
     attachments[0].stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
-    attachments[0].initialLayout = vk::ImageLayout::eUndefined;
+    attachments[0].initialLayout = late ? vk::ImageLayout::eColorAttachmentOptimal : vk::ImageLayout::eUndefined;
     attachments[0].finalLayout = vk::ImageLayout::eColorAttachmentOptimal;
 
-    attachments[1].format = getDepthFormat(physicalDevice);
-    attachments[1].samples = msaaSamples;
-    attachments[1].loadOp = vk::AttachmentLoadOp::eClear;
-    attachments[1].storeOp = vk::AttachmentStoreOp::eDontCare;
+    // The depth of the first pass is kept so the depth pyramid can be built from it
+    attachments[1].format = depthFormat;
+    attachments[1].samples = samples;
+    attachments[1].loadOp = late ? vk::AttachmentLoadOp::eLoad : vk::AttachmentLoadOp::eClear;
+    attachments[1].storeOp = late ? vk::AttachmentStoreOp::eDontCare : vk::AttachmentStoreOp::eStore;
     attachments[1].stencilLoadOp = vk::AttachmentLoadOp::eDontCare;
     attachments[1].stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
-    attachments[1].initialLayout = vk::ImageLayout::eUndefined;
-    attachments[1].finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+    attachments[1].initialLayout = late ? vk::ImageLayout::eDepthStencilReadOnlyOptimal : vk::ImageLayout::eUndefined;
+    attachments[1].finalLayout = late ? vk::ImageLayout::eDepthStencilAttachmentOptimal
+                                      : vk::ImageLayout::eDepthStencilReadOnlyOptimal;
 
-    attachments[2].format = swapchain.getFormat();
+    attachments[2].format = colorFormat;
     attachments[2].samples = vk::SampleCountFlagBits::e1;
     attachments[2].loadOp = vk::AttachmentLoadOp::eDontCare;
     attachments[2].storeOp = vk::AttachmentStoreOp::eDontCare;   // eStore; ?
@@ -618,25 +710,171 @@ void VkRenderer::createRenderPass()
     subpass.pDepthStencilAttachment = &depthRef;
     subpass.pResolveAttachments = &resolveRef;
 
-    vk::SubpassDependency dependency;
-    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency.dstSubpass = 0;
-    dependency.srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput
-                              | vk::PipelineStageFlagBits::eEarlyFragmentTests;
-    dependency.dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput
-                              | vk::PipelineStageFlagBits::eEarlyFragmentTests;
-    dependency.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite
-                               | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+    vk::SubpassDependency dependencies[2];
+    dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[0].dstSubpass = 0;
+    dependencies[0].srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput
+                                   | vk::PipelineStageFlagBits::eEarlyFragmentTests;
+    dependencies[0].dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput
+                                   | vk::PipelineStageFlagBits::eEarlyFragmentTests;
+    dependencies[0].dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite
+                                    | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+    if (late) {
+        // wait for the first pass and for the depth pyramid build to finish reading its depth
+        dependencies[0].srcStageMask |= vk::PipelineStageFlagBits::eLateFragmentTests
+                                        | vk::PipelineStageFlagBits::eComputeShader;
+        dependencies[0].dstStageMask |= vk::PipelineStageFlagBits::eLateFragmentTests;
+        dependencies[0].srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite
+                                        | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+        dependencies[0].dstAccessMask |= vk::AccessFlagBits::eColorAttachmentRead
+                                         | vk::AccessFlagBits::eDepthStencilAttachmentRead;
+    }
+    dependencies[1].srcSubpass = 0;
+    dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[1].srcStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests
+                                   | vk::PipelineStageFlagBits::eLateFragmentTests;
+    dependencies[1].dstStageMask = vk::PipelineStageFlagBits::eComputeShader;
+    dependencies[1].srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+    dependencies[1].dstAccessMask = vk::AccessFlagBits::eShaderRead;
 
     vk::RenderPassCreateInfo createInfo;
     createInfo.attachmentCount = 3;
     createInfo.pAttachments = attachments;
     createInfo.subpassCount = 1;
     createInfo.pSubpasses = &subpass;
-    createInfo.dependencyCount = 1;
-    createInfo.pDependencies = &dependency;
+    createInfo.dependencyCount = late ? 1 : 2;
+    createInfo.pDependencies = dependencies;
+
+    return device.createRenderPass(createInfo);
+}
+
+void VkRenderer::createRenderPass()
+{
+    const vk::Format depthFormat = getDepthFormat(physicalDevice);
+    mainRenderPass = createMainRenderPass(device, swapchain.getFormat(), depthFormat, msaaSamples, false);
+    lateRenderPass = createMainRenderPass(device, swapchain.getFormat(), depthFormat, msaaSamples, true);
+}
+
+void VkRenderer::createDepthPyramid()
+{
+    // Power of two sizes keep every level an exact 2x2 reduction of the one above it
+    const vk::Extent2D extent = swapchain.getExtent();
+    depthPyramidExtent = vk::Extent2D(std::bit_floor(extent.width), std::bit_floor(extent.height));
+    depthPyramidLevels = std::min(
+            UInt32(std::bit_width(std::max(depthPyramidExtent.width, depthPyramidExtent.height))),
+            MAX_PYRAMID_LEVELS
+    );
+    depthPyramid = Image::Builder()
+                           .withAllocator(allocator)
+                           .withFormat(vk::Format::eR32Sfloat)
+                           .withExtent(depthPyramidExtent)
+                           .withMipLevels(depthPyramidLevels)
+                           .withImageUsage(vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eSampled)
+                           .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
+                           .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
+                           .build();
+
+    vk::ImageSubresourceRange subRange{};
+    subRange.aspectMask = vk::ImageAspectFlagBits::eColor;
+    subRange.layerCount = 1;
+    subRange.levelCount = depthPyramidLevels;
+    subRange.baseArrayLayer = 0;
+    subRange.baseMipLevel = 0;
+    depthPyramidView = depthPyramid.createView(device, subRange);
+    subRange.levelCount = 1;
+    for (UInt32 i = 0; i < depthPyramidLevels; i++) {
+        subRange.baseMipLevel = i;
+        depthPyramidMips[i] = depthPyramid.createView(device, subRange);
+    }
+}
+
+void VkRenderer::createOcclusionResources()
+{
+    visibilityBuffer =
+            Buffer::Builder()
+                    .withAllocator(allocator)
+                    .withBufferUsage(vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst)
+                    .withSize(maxDrawCount * sizeof(UInt32))
+                    .withSharingMode(vk::SharingMode::eExclusive)
+                    .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
+                    .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
+                    .build();
 
-    mainRenderPass = device.createRenderPass(createInfo);
+    // The pyramid is only read with texelFetch, so no min/max reduction sampler is required
+    vk::SamplerCreateInfo samplerInfo{};
+    samplerInfo.magFilter = vk::Filter::eNearest;
+    samplerInfo.minFilter = vk::Filter::eNearest;
+    samplerInfo.mipmapMode = vk::SamplerMipmapMode::eNearest;
+    samplerInfo.addressModeU = vk::SamplerAddressMode::eClampToEdge;
+    samplerInfo.addressModeV = vk::SamplerAddressMode::eClampToEdge;
+    samplerInfo.addressModeW = vk::SamplerAddressMode::eClampToEdge;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+    depthSampler = device.createSampler(samplerInfo);
+
+    DescriptorLayoutManager::LayoutInfo reduceLayout;
+    reduceLayout.bindings.emplace_back(
+            0,
+            vk::DescriptorType::eCombinedImageSampler,
+            1,
+            vk::ShaderStageFlagBits::eCompute
+    );
+    reduceLayout.bindings.emplace_back(1, vk::DescriptorType::eStorageImage, 1, vk::ShaderStageFlagBits::eCompute);
+    std::array<vk::DescriptorSetLayout, MAX_PYRAMID_LEVELS> setLayouts;
+    setLayouts.fill(layoutManager.getOrCreateLayout(reduceLayout));
+    vk::DescriptorSetAllocateInfo allocateInfo{};
+    allocateInfo.descriptorPool = descriptorPool;
+    allocateInfo.descriptorSetCount = MAX_PYRAMID_LEVELS;
+    allocateInfo.pSetLayouts = setLayouts.data();
+    vk::resultCheck(
+            device.allocateDescriptorSets(&allocateInfo, depthReduceSets.data()),
+            "Failed to allocate depth pyramid descriptor sets"
+    );
+}
+
+void VkRenderer::writeDepthPyramidDescriptors()
+{
+    std::array<vk::DescriptorImageInfo, MAX_PYRAMID_LEVELS * 2 + FRAMES_IN_FLIGHT> imageInfos;
+    std::array<vk::WriteDescriptorSet, MAX_PYRAMID_LEVELS * 2 + FRAMES_IN_FLIGHT> writes{};
+    UInt32 count = 0;
+    for (UInt32 level = 0; level < depthPyramidLevels; level++) {
+        vk::DescriptorImageInfo& input = imageInfos[count];
+        input.sampler = depthSampler;
+        input.imageView = level == 0 ? depthView : depthPyramidMips[level - 1];
+        input.imageLayout = level == 0 ? vk::ImageLayout::eDepthStencilReadOnlyOptimal : vk::ImageLayout::eGeneral;
+        writes[count].dstSet = depthReduceSets[level];
+        writes[count].dstBinding = 0;
+        writes[count].dstArrayElement = 0;
+        writes[count].descriptorCount = 1;
+        writes[count].descriptorType = vk::DescriptorType::eCombinedImageSampler;
+        writes[count].pImageInfo = &input;
+        count++;
+
+        vk::DescriptorImageInfo& output = imageInfos[count];
+        output.imageView = depthPyramidMips[level];
+        output.imageLayout = vk::ImageLayout::eGeneral;
+        writes[count].dstSet = depthReduceSets[level];
+        writes[count].dstBinding = 1;
+        writes[count].dstArrayElement = 0;
+        writes[count].descriptorCount = 1;
+        writes[count].descriptorType = vk::DescriptorType::eStorageImage;
+        writes[count].pImageInfo = &output;
+        count++;
+    }
+    for (Frame& frame : frames) {
+        vk::DescriptorImageInfo& pyramid = imageInfos[count];
+        pyramid.sampler = depthSampler;
+        pyramid.imageView = depthPyramidView;
+        pyramid.imageLayout = vk::ImageLayout::eGeneral;
+        writes[count].dstSet = frame.computeSet;
+        writes[count].dstBinding = 10;
+        writes[count].dstArrayElement = 0;
+        writes[count].descriptorCount = 1;
+        writes[count].descriptorType = vk::DescriptorType::eCombinedImageSampler;
+        writes[count].pImageInfo = &pyramid;
+        count++;
+    }
+    device.updateDescriptorSets(count, writes.data(), 0, nullptr);
 }
 
 void VkRenderer::createGlobalUBO()
@@ -661,11 +899,14 @@ void VkRenderer::createDescriptorPool()
 {
     vk::DescriptorPoolSize sizes[] = {
             {vk::DescriptorType::eUniformBuffer, 16},
-            {vk::DescriptorType::eCombinedImageSampler, maxDrawCount},
-            {vk::DescriptorType::eStorageBuffer, 64}};
+            {vk::DescriptorType::eCombinedImageSampler, UInt32(maxDrawCount + MAX_PYRAMID_LEVELS + FRAMES_IN_FLIGHT)},
+            {vk::DescriptorType::eStorageBuffer, 64},
+            {vk::DescriptorType::eStorageImage, MAX_PYRAMID_LEVELS},
+            {vk::DescriptorType::eSampledImage, UInt32(maxDrawCount * FRAMES_IN_FLIGHT)},
+            {vk::DescriptorType::eSampler, Texture::TextureRegistry::MAX_SAMPLERS * UInt32(FRAMES_IN_FLIGHT)}};
     vk::DescriptorPoolCreateInfo createInfo{};
     createInfo.flags = vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind;
-    createInfo.poolSizeCount = 3;
+    createInfo.poolSizeCount = 6;
     createInfo.pPoolSizes = sizes;
     createInfo.maxSets = FRAMES_IN_FLIGHT * 16 + maxDrawCount;
     descriptorPool = device.createDescriptorPool(createInfo);
@@ -707,7 +948,7 @@ void VkRenderer::initFrame(VkRenderer::Frame& frame, UInt32 frameIndex)
             Buffer::Builder()
                     .withAllocator(allocator)
                     .withBufferUsage(vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer)
-                    .withSize(maxDrawCount * sizeof(vk::DrawIndexedIndirectCommand))
+                    .withSize((maxBatchCount + maxClusterCount) * sizeof(vk::DrawIndexedIndirectCommand))
                     .withSharingMode(vk::SharingMode::eExclusive)
                     .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
                     .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
@@ -716,7 +957,10 @@ void VkRenderer::initFrame(VkRenderer::Frame& frame, UInt32 frameIndex)
     frame.countBuffer =
             Buffer::Builder()
                     .withAllocator(allocator)
-                    .withBufferUsage(vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer)
+                    .withBufferUsage(
+                            vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer
+                            | vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eTransferSrc
+                    )
                     .withSize(maxDrawCount * sizeof(UInt32))
                     .withSharingMode(vk::SharingMode::eExclusive)
                     .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
@@ -731,6 +975,89 @@ void VkRenderer::initFrame(VkRenderer::Frame& frame, UInt32 frameIndex)
                                        .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
                                        .withPreferredFlags(vk::MemoryPropertyFlagBits::eLazilyAllocated)
                                        .build();
+    frame.batchData =
+            Buffer::Builder()
+                    .withAllocator(allocator)
+                    .withBufferUsage(vk::BufferUsageFlagBits::eStorageBuffer)
+                    .withSize(maxBatchCount * sizeof(BatchData))
+                    .withSharingMode(vk::SharingMode::eExclusive)
+                    .withUsage(VMA_MEMORY_USAGE_CPU_TO_GPU)
+                    .withRequiredFlags(
+                            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent
+                    )
+                    .withAllocationFlags(VMA_ALLOCATION_CREATE_MAPPED_BIT)
+                    .build();
+    frame.batchCounts =
+            Buffer::Builder()
+                    .withAllocator(allocator)
+                    .withBufferUsage(vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst)
+                    .withSize(maxBatchCount * sizeof(UInt32))
+                    .withSharingMode(vk::SharingMode::eExclusive)
+                    .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
+                    .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
+                    .build();
+    // batch instances are followed by one slot for every command, used by meshlet commands
+    frame.instanceBuffer = Buffer::Builder()
+                                   .withAllocator(allocator)
+                                   .withBufferUsage(vk::BufferUsageFlagBits::eStorageBuffer)
+                                   .withSize((maxBatchCount * 2 + maxClusterCount) * sizeof(UInt32))
+                                   .withSharingMode(vk::SharingMode::eExclusive)
+                                   .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
+                                   .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
+                                   .build();
+    frame.statsBuffer = Buffer::Builder()
+                                .withAllocator(allocator)
+                                .withBufferUsage(vk::BufferUsageFlagBits::eTransferDst)
+                                .withSize(maxDrawCount * sizeof(UInt32))
+                                .withSharingMode(vk::SharingMode::eExclusive)
+                                .withUsage(VMA_MEMORY_USAGE_GPU_TO_CPU)
+                                .withRequiredFlags(
+                                        vk::MemoryPropertyFlagBits::eHostVisible
+                                        | vk::MemoryPropertyFlagBits::eHostCoherent
+                                )
+                                .withAllocationFlags(VMA_ALLOCATION_CREATE_MAPPED_BIT)
+                                .build();
+    frame.clusterBuffer =
+            Buffer::Builder()
+                    .withAllocator(allocator)
+                    .withBufferUsage(
+                            vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer
+                            | vk::BufferUsageFlagBits::eTransferDst
+                    )
+                    .withSize(sizeof(vk::DispatchIndirectCommand) + sizeof(UInt32) + maxDrawCount * sizeof(glm::uvec2))
+                    .withSharingMode(vk::SharingMode::eExclusive)
+                    .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
+                    .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
+                    .build();
+    // one entry per texture id, texture ids are bounded by the size of the bindless array
+    frame.textureFeedback = Buffer::Builder()
+                                    .withAllocator(allocator)
+                                    .withBufferUsage(
+                                            vk::BufferUsageFlagBits::eStorageBuffer
+                                            | vk::BufferUsageFlagBits::eTransferSrc
+                                            | vk::BufferUsageFlagBits::eTransferDst
+                                    )
+                                    .withSize(maxDrawCount * sizeof(UInt32))
+                                    .withSharingMode(vk::SharingMode::eExclusive)
+                                    .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
+                                    .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
+                                    .build();
+    frame.feedbackReadback = Buffer::Builder()
+                                     .withAllocator(allocator)
+                                     .withBufferUsage(vk::BufferUsageFlagBits::eTransferDst)
+                                     .withSize(maxDrawCount * sizeof(UInt32))
+                                     .withSharingMode(vk::SharingMode::eExclusive)
+                                     .withUsage(VMA_MEMORY_USAGE_GPU_TO_CPU)
+                                     .withRequiredFlags(
+                                             vk::MemoryPropertyFlagBits::eHostVisible
+                                             | vk::MemoryPropertyFlagBits::eHostCoherent
+                                     )
+                                     .withAllocationFlags(VMA_ALLOCATION_CREATE_MAPPED_BIT)
+                                     .build();
+    vk::QueryPoolCreateInfo queryInfo{};
+    queryInfo.queryType = vk::QueryType::eTimestamp;
+    queryInfo.queryCount = TIMESTAMP_COUNT;
+    frame.queryPool = device.createQueryPool(queryInfo);
 
     DescriptorLayoutManager::LayoutInfo layoutInfo, computeLayout, frameLayout;
     layoutInfo.bindings.emplace_back(
@@ -746,16 +1073,40 @@ void VkRenderer::initFrame(VkRenderer::Frame& frame, UInt32 frameIndex)
     computeLayout.bindings.emplace_back(3, vk::DescriptorType::eUniformBuffer, 1, vk::ShaderStageFlagBits::eCompute);
     computeLayout.bindings.emplace_back(4, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
     computeLayout.bindings.emplace_back(5, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    computeLayout.bindings.emplace_back(6, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    computeLayout.bindings.emplace_back(7, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    computeLayout.bindings.emplace_back(8, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    computeLayout.bindings.emplace_back(9, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    computeLayout.bindings.emplace_back(
+            10,
+            vk::DescriptorType::eCombinedImageSampler,
+            1,
+            vk::ShaderStageFlagBits::eCompute
+    );
+    computeLayout.bindings.emplace_back(11, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
+    computeLayout.bindings.emplace_back(12, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute);
 
     frameLayout.bindings.emplace_back(0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eVertex);
     frameLayout.bindings.emplace_back(1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eFragment);
+    frameLayout.bindings.emplace_back(2, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eVertex);
+    frameLayout.bindings.emplace_back(3, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eFragment);
+    frameLayout.bindings.emplace_back(4, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eFragment);
+    // images and samplers are bound separately, so textures share the handful of samplers they need
     frameLayout.bindings.emplace_back(
-            2,
-            vk::DescriptorType::eCombinedImageSampler,
+            5,
+            vk::DescriptorType::eSampler,
+            Texture::TextureRegistry::MAX_SAMPLERS,
+            vk::ShaderStageFlagBits::eFragment
+    );
+    // the bindless texture array has a variable descriptor count, so it must stay the last binding
+    frameLayout.bindings.emplace_back(
+            6,
+            vk::DescriptorType::eSampledImage,
             maxDrawCount,
             vk::ShaderStageFlagBits::eFragment
     );
-    frame.textureBinding = 2;
+    frame.samplerBinding = 5;
+    frame.textureBinding = 6;
     frameLayout.bindless = true;
 
     vk::DescriptorSetLayout setLayouts[] = {
@@ -789,7 +1140,7 @@ void VkRenderer::writeDescriptors(VkRenderer::Frame& frame, UInt32 frameIndex)
     globalUboInfo.buffer = globalUBO;
     globalUboInfo.offset = frameIndex * uboOffset;
     globalUboInfo.range = sizeof(UBOData);
-    std::array<vk::WriteDescriptorSet, 9> writes{};
+    std::array<vk::WriteDescriptorSet, 18> writes{};
     writes[0].dstSet = frame.globalDescriptorSet;
     writes[0].dstArrayElement = 0;
     writes[0].dstBinding = 0;
@@ -820,7 +1171,7 @@ void VkRenderer::writeDescriptors(VkRenderer::Frame& frame, UInt32 frameIndex)
     vk::DescriptorBufferInfo commandInfo{};
     commandInfo.buffer = frame.commandBuffer;
     commandInfo.offset = 0;
-    commandInfo.range = maxDrawCount * sizeof(vk::DrawIndexedIndirectCommand);
+    commandInfo.range = (maxBatchCount + maxClusterCount) * sizeof(vk::DrawIndexedIndirectCommand);
     writes[3].dstSet = frame.computeSet;
     writes[3].dstArrayElement = 0;
     writes[3].dstBinding = 1;
@@ -871,6 +1222,93 @@ void VkRenderer::writeDescriptors(VkRenderer::Frame& frame, UInt32 frameIndex)
     writes[8].descriptorCount = 1;
     writes[8].descriptorType = vk::DescriptorType::eStorageBuffer;
 
+    vk::DescriptorBufferInfo instanceInfo{};
+    instanceInfo.buffer = frame.instanceBuffer;
+    instanceInfo.offset = 0;
+    instanceInfo.range = (maxBatchCount * 2 + maxClusterCount) * sizeof(UInt32);
+    writes[9].dstSet = frame.computeSet;
+    writes[9].dstArrayElement = 0;
+    writes[9].dstBinding = 6;
+    writes[9].pBufferInfo = &instanceInfo;
+    writes[9].descriptorCount = 1;
+    writes[9].descriptorType = vk::DescriptorType::eStorageBuffer;
+    writes[10].dstSet = frame.frameSet;
+    writes[10].dstArrayElement = 0;
+    writes[10].dstBinding = 2;
+    writes[10].pBufferInfo = &instanceInfo;
+    writes[10].descriptorCount = 1;
+    writes[10].descriptorType = vk::DescriptorType::eStorageBuffer;
+    vk::DescriptorBufferInfo batchDataInfo{};
+    batchDataInfo.buffer = frame.batchData;
+    batchDataInfo.offset = 0;
+    batchDataInfo.range = maxBatchCount * sizeof(BatchData);
+    writes[11].dstSet = frame.computeSet;
+    writes[11].dstArrayElement = 0;
+    writes[11].dstBinding = 7;
+    writes[11].pBufferInfo = &batchDataInfo;
+    writes[11].descriptorCount = 1;
+    writes[11].descriptorType = vk::DescriptorType::eStorageBuffer;
+    vk::DescriptorBufferInfo batchCountInfo{};
+    batchCountInfo.buffer = frame.batchCounts;
+    batchCountInfo.offset = 0;
+    batchCountInfo.range = maxBatchCount * sizeof(UInt32);
+    writes[12].dstSet = frame.computeSet;
+    writes[12].dstArrayElement = 0;
+    writes[12].dstBinding = 8;
+    writes[12].pBufferInfo = &batchCountInfo;
+    writes[12].descriptorCount = 1;
+    writes[12].descriptorType = vk::DescriptorType::eStorageBuffer;
+    vk::DescriptorBufferInfo visibilityInfo{};
+    visibilityInfo.buffer = visibilityBuffer;
+    visibilityInfo.offset = 0;
+    visibilityInfo.range = maxDrawCount * sizeof(UInt32);
+    writes[13].dstSet = frame.computeSet;
+    writes[13].dstArrayElement = 0;
+    writes[13].dstBinding = 9;
+    writes[13].pBufferInfo = &visibilityInfo;
+    writes[13].descriptorCount = 1;
+    writes[13].descriptorType = vk::DescriptorType::eStorageBuffer;
+    vk::DescriptorBufferInfo meshletInfo{};
+    meshletInfo.buffer = meshRegistry.getMeshletBuffer();
+    meshletInfo.offset = 0;
+    meshletInfo.range = VK_WHOLE_SIZE;
+    writes[14].dstSet = frame.computeSet;
+    writes[14].dstArrayElement = 0;
+    writes[14].dstBinding = 11;
+    writes[14].pBufferInfo = &meshletInfo;
+    writes[14].descriptorCount = 1;
+    writes[14].descriptorType = vk::DescriptorType::eStorageBuffer;
+    vk::DescriptorBufferInfo clusterInfo{};
+    clusterInfo.buffer = frame.clusterBuffer;
+    clusterInfo.offset = 0;
+    clusterInfo.range = VK_WHOLE_SIZE;
+    writes[15].dstSet = frame.computeSet;
+    writes[15].dstArrayElement = 0;
+    writes[15].dstBinding = 12;
+    writes[15].pBufferInfo = &clusterInfo;
+    writes[15].descriptorCount = 1;
+    writes[15].descriptorType = vk::DescriptorType::eStorageBuffer;
+    vk::DescriptorBufferInfo feedbackInfo{};
+    feedbackInfo.buffer = frame.textureFeedback;
+    feedbackInfo.offset = 0;
+    feedbackInfo.range = VK_WHOLE_SIZE;
+    writes[16].dstSet = frame.frameSet;
+    writes[16].dstArrayElement = 0;
+    writes[16].dstBinding = 3;
+    writes[16].pBufferInfo = &feedbackInfo;
+    writes[16].descriptorCount = 1;
+    writes[16].descriptorType = vk::DescriptorType::eStorageBuffer;
+    vk::DescriptorBufferInfo samplerIndexInfo{};
+    samplerIndexInfo.buffer = textureRegistry.getSamplerIndexBuffer();
+    samplerIndexInfo.offset = 0;
+    samplerIndexInfo.range = VK_WHOLE_SIZE;
+    writes[17].dstSet = frame.frameSet;
+    writes[17].dstArrayElement = 0;
+    writes[17].dstBinding = 4;
+    writes[17].pBufferInfo = &samplerIndexInfo;
+    writes[17].descriptorCount = 1;
+    writes[17].descriptorType = vk::DescriptorType::eStorageBuffer;
+
     device.updateDescriptorSets(writes, {});
 }
 
@@ -3,122 +3,612 @@
 //
 
 #include "mesh.h"
+#include <algorithm>
 #include <config.h>
+#include <limits>
+#include <meshoptimizer.h>
 
 namespace dragonfire {
 
-Mesh Mesh::MeshRegistry::uploadMesh(const std::span<Model::Vertex> vertices, const std::span<UInt32> indices)
+static_assert(sizeof(Model::Vertex) % Mesh::VERTEX_UNIT_SIZE == 0 && sizeof(Model::CompactVertex) == Mesh::VERTEX_UNIT_SIZE);
+
+UInt32 Mesh::getVertexUnits(Model::VertexFormat format)
 {
-    const vk::DeviceSize vertexSize = vertices.size() * sizeof(Model::Vertex);
-    const vk::DeviceSize indexSize = indices.size() * sizeof(UInt32);
-    char* ptr = static_cast<char*>(getStagingPtr(vertexSize + indexSize));
-    memcpy(ptr, vertices.data(), vertexSize);
-    ptr += vertexSize;
-    memcpy(ptr, indices.data(), indexSize);
+    switch (format) {
+        case Model::VertexFormat::COMPACT: return sizeof(Model::CompactVertex) / VERTEX_UNIT_SIZE;
+        default:
+        case Model::VertexFormat::FULL: return sizeof(Model::Vertex) / VERTEX_UNIT_SIZE;
+    }
+}
 
+UInt32 Mesh::getIndexUnits(vk::IndexType type)
+{
+    switch (type) {
+        case vk::IndexType::eUint16: return sizeof(UInt16) / INDEX_UNIT_SIZE;
+        default:
+        case vk::IndexType::eUint32: return sizeof(UInt32) / INDEX_UNIT_SIZE;
+    }
+}
+
+void Mesh::MeshRegistry::allocateMeshRegion(Mesh& mesh, USize vertexCount, USize indexCount, USize meshletCount)
+{
+    // Heaps are measured in elements rather than bytes, so offsets are always element aligned. Both vertex
+    // formats share a heap measured in compact vertices, full vertices are aligned to their own size so the
+    // offset can be expressed in vertices of either format. Indices of both types share a heap the same way
+    const UInt32 vertexUnits = getVertexUnits(mesh.vertexFormat);
+    const UInt32 indexUnits = getIndexUnits(mesh.indexType);
     VmaVirtualAllocationCreateInfo vertexAllocInfo{}, indexAllocInfo{};
-    vertexAllocInfo.size = vertexSize;
-    vertexAllocInfo.alignment = 16;
-    indexAllocInfo.size = indexSize;
-    indexAllocInfo.alignment = 16;
+    vertexAllocInfo.size = vertexCount * vertexUnits;
+    vertexAllocInfo.alignment = vertexUnits;
+    indexAllocInfo.size = indexCount * indexUnits;
+    indexAllocInfo.alignment = indexUnits;
 
-    Mesh mesh{};
     VkResult result = vmaVirtualAllocate(vertexBlock, &vertexAllocInfo, &mesh.vertexAllocation, nullptr);
     if (result == VK_SUCCESS)
         result = vmaVirtualAllocate(indexBlock, &indexAllocInfo, &mesh.indexAllocation, nullptr);
+    if (result == VK_SUCCESS && meshletCount > 0) {
+        VmaVirtualAllocationCreateInfo meshletAllocInfo{};
+        meshletAllocInfo.size = meshletCount;
+        result = vmaVirtualAllocate(meshletBlock, &meshletAllocInfo, &mesh.meshletAllocation, nullptr);
+    }
     if (result != VK_SUCCESS)
         throw std::runtime_error("VMA virtual allocation failed");
     vmaGetVirtualAllocationInfo(vertexBlock, mesh.vertexAllocation, &mesh.vertexInfo);
-    vmaGetVirtualAllocationInfo(vertexBlock, mesh.vertexAllocation, &mesh.indexInfo);
+    vmaGetVirtualAllocationInfo(indexBlock, mesh.indexAllocation, &mesh.indexInfo);
+    if (meshletCount > 0)
+        vmaGetVirtualAllocationInfo(meshletBlock, mesh.meshletAllocation, &mesh.meshletInfo);
+
+    // Pages stay bound once committed, so regions freed later can be reused without binding them again
+    vertexBuffer.commit(mesh.vertexInfo.offset * VERTEX_UNIT_SIZE, mesh.vertexInfo.size * VERTEX_UNIT_SIZE, vertexBinds);
+    indexBuffer.commit(mesh.indexInfo.offset * INDEX_UNIT_SIZE, mesh.indexInfo.size * INDEX_UNIT_SIZE, indexBinds);
+    meshletBuffer.commit(
+            mesh.meshletInfo.offset * sizeof(Model::Meshlet),
+            meshletCount * sizeof(Model::Meshlet),
+            meshletBinds
+    );
+}
 
-    device.resetCommandPool(pool);
+void Mesh::MeshRegistry::beginBatch()
+{
+    if (pendingBatch.cmd)
+        return;
+    if (freeCommandBuffers.empty()) {
+        vk::CommandBufferAllocateInfo allocInfo{};
+        allocInfo.commandBufferCount = 1;
+        allocInfo.commandPool = pool;
+        allocInfo.level = vk::CommandBufferLevel::ePrimary;
+        vk::resultCheck(device.allocateCommandBuffers(&allocInfo, &pendingBatch.cmd), "Failed to allocate command buffer");
+    }
+    else {
+        pendingBatch.cmd = freeCommandBuffers.back();
+        freeCommandBuffers.pop_back();
+    }
     vk::CommandBufferBeginInfo beginInfo{};
     beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
-    cmd.begin(beginInfo);
+    pendingBatch.cmd.begin(beginInfo);
+    pendingBatch.value = nextUploadValue++;
+}
 
-    vk::BufferCopy vertexCopy;
-    vertexCopy.size = vertexSize;
-    vertexCopy.srcOffset = 0;
-    vertexCopy.dstOffset = mesh.vertexInfo.offset;
+void Mesh::MeshRegistry::recordCopy(
+        vk::Buffer dst,
+        const StagingRing::Allocation& staging,
+        vk::DeviceSize stagingOffset,
+        vk::DeviceSize dstOffset,
+        vk::DeviceSize size,
+        vk::AccessFlags dstAccess
+)
+{
+    if (size == 0)
+        return;
+    vk::BufferCopy copy{};
+    copy.srcOffset = staging.offset + stagingOffset;
+    copy.dstOffset = dstOffset;
+    copy.size = size;
+    pendingBatch.cmd.copyBuffer(staging.buffer, dst, copy);
 
-    cmd.copyBuffer(stagingBuffer, vertexBuffer, vertexCopy);
+    if (transferFamily != graphicsFamily) {
+        vk::BufferMemoryBarrier& barrier = pendingBatch.ownershipTransfers.emplace_back();
+        barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        barrier.dstAccessMask = dstAccess;
+        barrier.srcQueueFamilyIndex = transferFamily;
+        barrier.dstQueueFamilyIndex = graphicsFamily;
+        barrier.buffer = dst;
+        barrier.offset = dstOffset;
+        barrier.size = size;
+    }
+}
 
-    vk::BufferCopy indexCopy;
-    indexCopy.size = indexSize;
-    indexCopy.srcOffset = vertexSize;
-    indexCopy.dstOffset = mesh.indexInfo.offset;
+void Mesh::MeshRegistry::submitBatch()
+{
+    if (!pendingBatch.cmd)
+        return;
+    if (!pendingBatch.ownershipTransfers.empty()) {
+        // Release half of the ownership transfer, the acquire half is recorded on the graphics queue
+        std::vector<vk::BufferMemoryBarrier> releases = pendingBatch.ownershipTransfers;
+        for (vk::BufferMemoryBarrier& barrier : releases)
+            barrier.dstAccessMask = {};
+        pendingBatch.cmd.pipelineBarrier(
+                vk::PipelineStageFlagBits::eTransfer,
+                vk::PipelineStageFlagBits::eBottomOfPipe,
+                {},
+                {},
+                releases,
+                {}
+        );
+    }
+    pendingBatch.cmd.end();
 
-    cmd.copyBuffer(stagingBuffer, indexBuffer, indexCopy);
+    std::unique_lock queueLock(*queueMutex);
+    bindPages();
 
+    // Every batch waits for the latest binds, waiting on a value that was already reached costs nothing
+    const vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eTransfer;
+    vk::TimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &pendingBatch.value;
+    timelineInfo.waitSemaphoreValueCount = 1;
+    timelineInfo.pWaitSemaphoreValues = &sparseBindValue;
     vk::SubmitInfo submitInfo{};
-    submitInfo.pCommandBuffers = &cmd;
+    submitInfo.pCommandBuffers = &pendingBatch.cmd;
     submitInfo.commandBufferCount = 1;
-    cmd.end();
+    submitInfo.pSignalSemaphores = &uploadTimeline;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pWaitSemaphores = &sparseTimeline;
+    submitInfo.pWaitDstStageMask = &waitStage;
+    submitInfo.waitSemaphoreCount = 1;
+    submitInfo.pNext = &timelineInfo;
+    transferQueue.submit(submitInfo);
+    queueLock.unlock();
 
-    graphicsQueue.submit(submitInfo, fence);
+    for (UInt64 id : pendingBatch.stagingIds)
+        stagingRing->release(id, uploadTimeline, pendingBatch.value);
+    submittedBatches.push_back(std::move(pendingBatch));
+    pendingBatch = UploadBatch{};
+}
 
-    vk::resultCheck(device.waitForFences(fence, true, UINT64_MAX), "Fence wait failed");
-    device.resetFences(fence);
-    mesh.vertexCount = vertices.size();
-    mesh.indexCount = indices.size();
+void Mesh::MeshRegistry::bindPages()
+{
+    if (vertexBinds.empty() && indexBinds.empty() && meshletBinds.empty())
+        return;
+    std::vector<vk::SparseBufferMemoryBindInfo> bufferBinds;
+    const std::pair<vk::Buffer, std::vector<vk::SparseMemoryBind>*> buffers[] = {
+            {vertexBuffer, &vertexBinds},
+            {indexBuffer, &indexBinds},
+            {meshletBuffer, &meshletBinds},
+    };
+    for (auto [buffer, binds] : buffers) {
+        if (binds->empty())
+            continue;
+        vk::SparseBufferMemoryBindInfo& info = bufferBinds.emplace_back();
+        info.buffer = buffer;
+        info.bindCount = binds->size();
+        info.pBinds = binds->data();
+    }
+    const UInt64 value = ++sparseBindValue;
+    vk::TimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &value;
+    vk::BindSparseInfo bindInfo{};
+    bindInfo.bufferBindCount = bufferBinds.size();
+    bindInfo.pBufferBinds = bufferBinds.data();
+    bindInfo.signalSemaphoreCount = 1;
+    bindInfo.pSignalSemaphores = &sparseTimeline;
+    bindInfo.pNext = &timelineInfo;
+    transferQueue.bindSparse(bindInfo);
+    vertexBinds.clear();
+    indexBinds.clear();
+    meshletBinds.clear();
+}
 
-    return mesh;
+void Mesh::MeshRegistry::submitUploads()
+{
+    std::unique_lock lock(mutex);
+    submitBatch();
 }
 
-void* Mesh::MeshRegistry::getStagingPtr(USize size)
+UInt64 Mesh::MeshRegistry::acquireUploads(vk::CommandBuffer cmd)
 {
-    if (stagingBuffer.getInfo().size <= size) {
-        stagingBuffer =
-                Buffer::Builder()
-                        .withSize(std::max(size + 1, stagingBuffer.getInfo().size * 2))
-                        .withSharingMode(vk::SharingMode::eExclusive)
-                        .withBufferUsage(vk::BufferUsageFlagBits::eTransferSrc)
-                        .withAllocator(allocator)
-                        .withUsage(VMA_MEMORY_USAGE_CPU_TO_GPU)
-                        .withAllocationFlags(VMA_ALLOCATION_CREATE_MAPPED_BIT)
-                        .withRequiredFlags(
-                                vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent
-                        )
-                        .build();
+    std::unique_lock lock(mutex);
+    const UInt64 completed = device.getSemaphoreCounterValue(uploadTimeline);
+    UInt64 waitValue = 0;
+    std::vector<vk::BufferMemoryBarrier> acquires;
+    // Batches complete in submission order, so only a prefix of them can be done
+    while (!submittedBatches.empty() && submittedBatches.front().value <= completed) {
+        UploadBatch& batch = submittedBatches.front();
+        for (vk::BufferMemoryBarrier barrier : batch.ownershipTransfers) {
+            barrier.srcAccessMask = {};
+            acquires.push_back(barrier);
+        }
+        waitValue = batch.value;
+        freeCommandBuffers.push_back(batch.cmd);
+        submittedBatches.pop_front();
+    }
+    if (!acquires.empty()) {
+        cmd.pipelineBarrier(
+                vk::PipelineStageFlagBits::eTopOfPipe,
+                vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eComputeShader,
+                {},
+                {},
+                acquires,
+                {}
+        );
     }
-    return stagingBuffer.getInfo().pMappedData;
+    if (waitValue != 0)
+        acquiredValue = waitValue;
+    return waitValue;
+}
+
+static void writeIndices(std::span<const UInt32> indices, void* out, vk::IndexType indexType)
+{
+    if (indexType == vk::IndexType::eUint16)
+        std::copy(indices.begin(), indices.end(), static_cast<UInt16*>(out));
+    else
+        memcpy(out, indices.data(), indices.size_bytes());
+}
+
+MeshHandle Mesh::MeshRegistry::createMesh(
+        std::span<Model::Vertex> vertices,
+        std::span<UInt32> indices,
+        std::span<const Model::Lod> lods,
+        std::span<const Model::Meshlet> meshlets
+)
+{
+    return createMesh(
+            vertices.size(),
+            indices.size(),
+            Model::VertexFormat::FULL,
+            Model::Quantization{},
+            lods,
+            meshlets,
+            [&](void* vertexOut, void* indexOut, vk::IndexType indexType) {
+                memcpy(vertexOut, vertices.data(), vertices.size_bytes());
+                writeIndices(indices, indexOut, indexType);
+            }
+    );
 }
 
-MeshHandle Mesh::MeshRegistry::createMesh(std::span<Model::Vertex> vertices, std::span<UInt32> indices)
+MeshHandle Mesh::MeshRegistry::createCompactMesh(
+        std::span<Model::CompactVertex> vertices,
+        std::span<UInt32> indices,
+        const Model::Quantization& quantization,
+        std::span<const Model::Lod> lods,
+        std::span<const Model::Meshlet> meshlets
+)
 {
+    return createMesh(
+            vertices.size(),
+            indices.size(),
+            Model::VertexFormat::COMPACT,
+            quantization,
+            lods,
+            meshlets,
+            [&](void* vertexOut, void* indexOut, vk::IndexType indexType) {
+                memcpy(vertexOut, vertices.data(), vertices.size_bytes());
+                writeIndices(indices, indexOut, indexType);
+            }
+    );
+}
+
+MeshHandle Mesh::MeshRegistry::createEncodedMesh(const Model::EncodedMesh& mesh)
+{
+    const USize vertexSize = getVertexUnits(mesh.format) * VERTEX_UNIT_SIZE;
+    return createMesh(
+            mesh.vertexCount,
+            mesh.indexCount,
+            mesh.format,
+            mesh.quantization,
+            mesh.lods,
+            mesh.meshlets,
+            [&](void* vertexOut, void* indexOut, vk::IndexType indexType) {
+                const USize indexSize = indexType == vk::IndexType::eUint16 ? sizeof(UInt16) : sizeof(UInt32);
+                int result = meshopt_decodeVertexBuffer(
+                        vertexOut,
+                        mesh.vertexCount,
+                        vertexSize,
+                        mesh.vertexData.data(),
+                        mesh.vertexData.size()
+                );
+                if (result == 0)
+                    result = meshopt_decodeIndexBuffer(
+                            indexOut,
+                            mesh.indexCount,
+                            indexSize,
+                            mesh.indexData.data(),
+                            mesh.indexData.size()
+                    );
+                if (result != 0)
+                    throw FormattedError("Failed to decode mesh geometry, error {}", result);
+            }
+    );
+}
+
+MeshHandle Mesh::MeshRegistry::createMesh(
+        USize vertexCount,
+        USize indexCount,
+        Model::VertexFormat format,
+        const Model::Quantization& quantization,
+        std::span<const Model::Lod> lods,
+        std::span<const Model::Meshlet> meshlets,
+        const GeometryWriter& writeGeometry
+)
+{
+    // Every index of a mesh with fewer vertices than that fits in 16 bits, which halves its index memory
+    const bool shortIndices = vertexCount <= std::numeric_limits<UInt16>::max() + 1;
+    const vk::DeviceSize vertexSize = vertexCount * getVertexUnits(format) * VERTEX_UNIT_SIZE;
+    const vk::DeviceSize indexSize = indexCount * (shortIndices ? sizeof(UInt16) : sizeof(UInt32));
+    const vk::DeviceSize meshletSize = meshlets.size() * sizeof(Model::Meshlet);
+
+    Mesh* mesh = new Mesh();
+    mesh->vertexFormat = format;
+    mesh->indexType = shortIndices ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+    mesh->quantization = quantization;
+    mesh->vertexCount = vertexCount;
+    mesh->indexCount = indexCount;
+    mesh->meshletCount = meshlets.size();
+    if (lods.empty())
+        mesh->lods[0] = Model::Lod{0, mesh->indexCount, 0.0f};
+    else {
+        mesh->lodCount = UInt32(std::min(lods.size(), Model::MAX_LOD_COUNT));
+        std::copy_n(lods.begin(), mesh->lodCount, mesh->lods.begin());
+    }
+    {
+        std::unique_lock lock(mutex);
+        allocateMeshRegion(*mesh, vertexCount, indexCount, meshlets.size());
+    }
+
+    // The staging memory is filled without the lock so loader threads can write and decode in parallel
+    StagingRing::Allocation staging = stagingRing->allocate(vertexSize + indexSize + meshletSize);
+    char* ptr = static_cast<char*>(staging.ptr);
+    try {
+        writeGeometry(ptr, ptr + vertexSize, mesh->indexType);
+    }
+    catch (...) {
+        // Nothing was recorded yet, so the regions can be reused right away
+        stagingRing->release(staging.id, nullptr, 0);
+        std::unique_lock lock(mutex);
+        vmaVirtualFree(vertexBlock, mesh->vertexAllocation);
+        vmaVirtualFree(indexBlock, mesh->indexAllocation);
+        if (mesh->meshletCount > 0)
+            vmaVirtualFree(meshletBlock, mesh->meshletAllocation);
+        delete mesh;
+        throw;
+    }
+    memcpy(ptr + vertexSize + indexSize, meshlets.data(), meshletSize);
+
     std::unique_lock lock(mutex);
-    Mesh* mesh = new Mesh(uploadMesh(vertices, indices));
+    beginBatch();
+    recordCopy(
+            vertexBuffer,
+            staging,
+            0,
+            mesh->vertexInfo.offset * VERTEX_UNIT_SIZE,
+            vertexSize,
+            vk::AccessFlagBits::eVertexAttributeRead
+    );
+    recordCopy(
+            indexBuffer,
+            staging,
+            vertexSize,
+            mesh->indexInfo.offset * INDEX_UNIT_SIZE,
+            indexSize,
+            vk::AccessFlagBits::eIndexRead
+    );
+    recordCopy(
+            meshletBuffer,
+            staging,
+            vertexSize + indexSize,
+            mesh->meshletInfo.offset * sizeof(Model::Meshlet),
+            meshletSize,
+            vk::AccessFlagBits::eShaderRead
+    );
+    pendingBatch.stagingIds.push_back(staging.id);
+    mesh->uploadValue = pendingBatch.value;
     meshes.push_back(mesh);
     MeshHandle handle = reinterpret_cast<MeshHandle>(mesh);
     return handle;
 }
 
-void Mesh::MeshRegistry::freeMesh(MeshHandle mesh)
+void Mesh::MeshRegistry::freeMesh(MeshHandle mesh, DeletionQueue& deletionQueue)
 {
     std::unique_lock lock(mutex);
     Mesh* ptr = reinterpret_cast<Mesh*>(mesh);
-    freeMeshRegion(*ptr);
+    // The deletion queue only waits for frames, the upload copying into the regions has to finish first or a new
+    // mesh could be given them while the copy still writes there. Meshes freed right after loading hit this.
+    if (device.getSemaphoreCounterValue(uploadTimeline) < ptr->uploadValue) {
+        if (pendingBatch.cmd && ptr->uploadValue == pendingBatch.value)
+            submitBatch();
+        const UInt64 value = ptr->uploadValue;
+        lock.unlock();
+        vk::SemaphoreWaitInfo waitInfo{};
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &uploadTimeline;
+        waitInfo.pValues = &value;
+        vk::resultCheck(device.waitSemaphores(waitInfo, UINT64_MAX), "Failed to wait for mesh upload");
+        lock.lock();
+    }
+    freeMeshRegion(*ptr, deletionQueue);
     meshes.erase(std::find(meshes.begin(), meshes.end(), ptr));
     delete ptr;
 }
 
 UInt32 Mesh::getVertexOffset() const
 {
-    return vertexInfo.offset / sizeof(Model::Vertex);
+    return UInt32(vertexInfo.offset / getVertexUnits(vertexFormat));
 }
 
 UInt32 Mesh::getIndexOffset() const
 {
-    return indexInfo.offset / sizeof(UInt32);
+    return UInt32(indexInfo.offset / getIndexUnits(indexType));
+}
+
+UInt32 Mesh::getMeshletOffset() const
+{
+    return UInt32(meshletInfo.offset);
+}
+
+vk::DeviceSize Mesh::MeshRegistry::defragment(
+        vk::CommandBuffer cmd,
+        DeletionQueue& deletionQueue,
+        vk::DeviceSize budget
+)
+{
+    std::unique_lock lock(mutex);
+    // Free ranges may sit in pages whose binds haven't executed yet, the graphics queue can't copy into those
+    if (!vertexBinds.empty() || !indexBinds.empty() || !meshletBinds.empty()
+        || device.getSemaphoreCounterValue(sparseTimeline) < sparseBindValue)
+        return 0;
+    // Only meshes whose upload was acquired can move, the others may still be written by the transfer queue
+    std::vector<Mesh*> residentMeshes;
+    for (Mesh* mesh : meshes) {
+        if (isResident(*mesh))
+            residentMeshes.push_back(mesh);
+    }
+    const Heap heaps[] = {
+            {vertexBlock,
+             vertexBuffer,
+             VERTEX_UNIT_SIZE,
+             &Mesh::vertexAllocation,
+             &Mesh::vertexInfo,
+             [](const Mesh& mesh) { return getVertexUnits(mesh.vertexFormat); }},
+            {indexBlock,
+             indexBuffer,
+             INDEX_UNIT_SIZE,
+             &Mesh::indexAllocation,
+             &Mesh::indexInfo,
+             [](const Mesh& mesh) { return getIndexUnits(mesh.indexType); }},
+            {meshletBlock,
+             meshletBuffer,
+             sizeof(Model::Meshlet),
+             &Mesh::meshletAllocation,
+             &Mesh::meshletInfo,
+             [](const Mesh&) { return 1u; }},
+    };
+    vk::DeviceSize moved = 0;
+    bool barrierRecorded = false;
+    for (UInt32 i = 0; i < std::size(heaps) && moved < budget; i++) {
+        const Heap& heap = heaps[i];
+        VmaDetailedStatistics stats;
+        vmaCalculateVirtualBlockStatistics(heap.block, &stats);
+        // A single free range means everything is packed at the start of the heap, and there is no point in
+        // scanning again if nothing changed since the last pass found nothing it could move
+        if (stats.unusedRangeCount <= 1
+            || (stats.statistics.allocationBytes == settledHeaps[i].allocationBytes
+                && stats.unusedRangeCount == settledHeaps[i].unusedRangeCount))
+            continue;
+
+        // Allocations at the end of the heap are the ones keeping the free space split up
+        std::sort(residentMeshes.begin(), residentMeshes.end(), [&](const Mesh* a, const Mesh* b) {
+            return (a->*heap.info).offset > (b->*heap.info).offset;
+        });
+        std::vector<vk::BufferCopy> copies;
+        for (Mesh* mesh : residentMeshes) {
+            if (moved >= budget)
+                break;
+            VmaVirtualAllocationInfo& info = mesh->*heap.info;
+            if (info.size == 0)
+                continue;
+            VmaVirtualAllocationCreateInfo allocInfo{};
+            allocInfo.size = info.size;
+            allocInfo.alignment = heap.alignment(*mesh);
+            allocInfo.flags = VMA_VIRTUAL_ALLOCATION_CREATE_STRATEGY_MIN_OFFSET_BIT;
+            VmaVirtualAllocation allocation;
+            VkDeviceSize offset;
+            if (vmaVirtualAllocate(heap.block, &allocInfo, &allocation, &offset) != VK_SUCCESS)
+                continue;
+            if (offset >= info.offset) {
+                vmaVirtualFree(heap.block, allocation);
+                continue;
+            }
+            vk::BufferCopy& copy = copies.emplace_back();
+            copy.srcOffset = info.offset * heap.elementSize;
+            copy.dstOffset = offset * heap.elementSize;
+            copy.size = info.size * heap.elementSize;
+            moved += copy.size;
+            // Frames in flight still read the old region
+            deletionQueue.push(heap.block, mesh->*heap.allocation, &mutex);
+            mesh->*heap.allocation = allocation;
+            vmaGetVirtualAllocationInfo(heap.block, allocation, &info);
+        }
+        if (copies.empty()) {
+            settledHeaps[i] = {stats.statistics.allocationBytes, stats.unusedRangeCount};
+            continue;
+        }
+        if (!barrierRecorded) {
+            // Uploads acquired by earlier frames were only made visible to the stages that draw with them
+            vk::MemoryBarrier barrier{};
+            barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+            barrier.dstAccessMask = vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite;
+            cmd.pipelineBarrier(
+                    vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eVertexInput
+                            | vk::PipelineStageFlagBits::eComputeShader,
+                    vk::PipelineStageFlagBits::eTransfer,
+                    {},
+                    barrier,
+                    {},
+                    {}
+            );
+            barrierRecorded = true;
+        }
+        cmd.copyBuffer(heap.buffer, heap.buffer, copies);
+    }
+    if (barrierRecorded) {
+        vk::MemoryBarrier barrier{};
+        barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        barrier.dstAccessMask = vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead
+                              | vk::AccessFlagBits::eShaderRead;
+        cmd.pipelineBarrier(
+                vk::PipelineStageFlagBits::eTransfer,
+                vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eVertexShader
+                        | vk::PipelineStageFlagBits::eComputeShader,
+                {},
+                barrier,
+                {},
+                {}
+        );
+    }
+    return moved;
+}
+
+std::array<Mesh::MeshRegistry::HeapStats, 3> Mesh::MeshRegistry::getHeapStats()
+{
+    std::unique_lock lock(mutex);
+    const std::tuple<VmaVirtualBlock, vk::DeviceSize, const SparseBuffer&> blocks[] = {
+            {vertexBlock, VERTEX_UNIT_SIZE, vertexBuffer},
+            {indexBlock, INDEX_UNIT_SIZE, indexBuffer},
+            {meshletBlock, sizeof(Model::Meshlet), meshletBuffer},
+    };
+    std::array<HeapStats, 3> heapStats{};
+    for (UInt32 i = 0; i < std::size(blocks); i++) {
+        const auto& [block, elementSize, buffer] = blocks[i];
+        VmaDetailedStatistics stats;
+        vmaCalculateVirtualBlockStatistics(block, &stats);
+        HeapStats& out = heapStats[i];
+        out.usedBytes = stats.statistics.allocationBytes * elementSize;
+        out.freeBytes = (stats.statistics.blockBytes - stats.statistics.allocationBytes) * elementSize;
+        out.largestFreeBytes = stats.unusedRangeCount > 0 ? stats.unusedRangeSizeMax * elementSize : 0;
+        out.freeRangeCount = stats.unusedRangeCount;
+        out.committedBytes = buffer.getCommittedBytes();
+        out.fragmentation = out.freeBytes > 0 ? 1.0f - float(out.largestFreeBytes) / float(out.freeBytes) : 0.0f;
+    }
+    return heapStats;
 }
 
 Mesh::MeshRegistry::MeshRegistry(
         vk::Device device,
         VmaAllocator allocator,
-        vk::Queue graphicsQueue,
-        UInt32 graphicsFamily
+        vk::Queue transferQueue,
+        UInt32 transferFamily,
+        UInt32 graphicsFamily,
+        std::mutex* queueMutex,
+        StagingRing* stagingRing
 )
-    : allocator(allocator), device(device), graphicsQueue(graphicsQueue)
+    : allocator(allocator),
+      device(device),
+      transferQueue(transferQueue),
+      transferFamily(transferFamily),
+      graphicsFamily(graphicsFamily),
+      queueMutex(queueMutex),
+      stagingRing(stagingRing)
 {
     try {
         maxVertexCount = Config::INSTANCE.get<Int64>("graphics.maxVertexCount");
@@ -132,92 +622,113 @@ Mesh::MeshRegistry::MeshRegistry(
     catch (...) {
         maxIndexCount = 1 << 27;
     }
-    vertexBuffer = Buffer::Builder()
-                           .withSize(sizeof(Model::Vertex) * maxVertexCount)
-                           .withBufferUsage(
-                                   vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eVertexBuffer
-                                   | vk::BufferUsageFlagBits::eTransferDst
-                           )
-                           .withSharingMode(vk::SharingMode::eExclusive)
-                           .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
-                           .withPreferredFlags(vk::MemoryPropertyFlagBits::eLazilyAllocated)
-                           .withAllocationFlags(VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT)
-                           .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
-                           .withAllocator(allocator)
-                           .build();
-
-    indexBuffer = Buffer::Builder()
-                          .withSize(sizeof(UInt32) * maxIndexCount)
-                          .withBufferUsage(
-                                  vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndexBuffer
-                                  | vk::BufferUsageFlagBits::eTransferDst
-                          )
-                          .withSharingMode(vk::SharingMode::eExclusive)
-                          .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
-                          .withPreferredFlags(vk::MemoryPropertyFlagBits::eLazilyAllocated)
-                          .withAllocationFlags(VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT)
-                          .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
-                          .withAllocator(allocator)
-                          .build();
-
-    stagingBuffer = Buffer::Builder()
-                            .withSize(1 << 15)
-                            .withSharingMode(vk::SharingMode::eExclusive)
-                            .withBufferUsage(vk::BufferUsageFlagBits::eTransferSrc)
-                            .withAllocator(allocator)
-                            .withUsage(VMA_MEMORY_USAGE_CPU_TO_GPU)
-                            .withAllocationFlags(VMA_ALLOCATION_CREATE_MAPPED_BIT)
-                            .withRequiredFlags(
-                                    vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent
-                            )
-                            .build();
+    try {
+        maxMeshletCount = Config::INSTANCE.get<Int64>("graphics.maxMeshletCount");
+    }
+    catch (...) {
+        maxMeshletCount = 1 << 19;
+    }
+    // Only the address range is reserved up front, memory is bound in pages as meshes are allocated
+    vertexBuffer = SparseBuffer(
+            device,
+            allocator,
+            sizeof(Model::Vertex) * maxVertexCount,
+            vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eVertexBuffer
+                    | vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eTransferSrc,
+            HEAP_PAGE_SIZE
+    );
+    indexBuffer = SparseBuffer(
+            device,
+            allocator,
+            sizeof(UInt32) * maxIndexCount,
+            vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndexBuffer
+                    | vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eTransferSrc,
+            HEAP_PAGE_SIZE
+    );
+    meshletBuffer = SparseBuffer(
+            device,
+            allocator,
+            sizeof(Model::Meshlet) * maxMeshletCount,
+            vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst
+                    | vk::BufferUsageFlagBits::eTransferSrc,
+            HEAP_PAGE_SIZE
+    );
 
     VmaVirtualBlockCreateInfo blockCreateInfo{};
-    blockCreateInfo.size = vertexBuffer.getInfo().size;
+    blockCreateInfo.size = maxVertexCount * getVertexUnits(Model::VertexFormat::FULL);
     VkResult result = vmaCreateVirtualBlock(&blockCreateInfo, &vertexBlock);
     if (result == VK_SUCCESS) {
-        blockCreateInfo.size = indexBuffer.getInfo().size;
+        blockCreateInfo.size = maxIndexCount * getIndexUnits(vk::IndexType::eUint32);
         result = vmaCreateVirtualBlock(&blockCreateInfo, &indexBlock);
     }
+    if (result == VK_SUCCESS) {
+        blockCreateInfo.size = maxMeshletCount;
+        result = vmaCreateVirtualBlock(&blockCreateInfo, &meshletBlock);
+    }
     if (result != VK_SUCCESS)
-        throw std::runtime_error("Failed to create virtual blocks for vertex/index buffers");
+        throw std::runtime_error("Failed to create virtual blocks for vertex/index/meshlet buffers");
 
     vk::CommandPoolCreateInfo createInfo{};
-    createInfo.queueFamilyIndex = graphicsFamily;
+    createInfo.queueFamilyIndex = transferFamily;
+    createInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
     pool = device.createCommandPool(createInfo);
-    vk::CommandBufferAllocateInfo allocInfo{};
-    allocInfo.commandBufferCount = 1;
-    allocInfo.commandPool = pool;
-    allocInfo.level = vk::CommandBufferLevel::ePrimary;
-    vk::resultCheck(device.allocateCommandBuffers(&allocInfo, &cmd), "Failed to allocate command buffer");
-    fence = device.createFence(vk::FenceCreateInfo());
+
+    vk::SemaphoreTypeCreateInfo timelineInfo{};
+    timelineInfo.semaphoreType = vk::SemaphoreType::eTimeline;
+    timelineInfo.initialValue = 0;
+    vk::SemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.pNext = &timelineInfo;
+    uploadTimeline = device.createSemaphore(semaphoreInfo);
+    sparseTimeline = device.createSemaphore(semaphoreInfo);
 
     spdlog::get("Rendering")
-            ->info("Initialized mesh registry, max vertex count {}, max index count {}", maxVertexCount, maxIndexCount);
+            ->info(
+                    "Initialized mesh registry, max vertex count {}, max index count {}, max meshlet count {}",
+                    maxVertexCount,
+                    maxIndexCount,
+                    maxMeshletCount
+            );
 }
 
-void Mesh::MeshRegistry::freeMeshRegion(const Mesh& mesh)
+void Mesh::MeshRegistry::freeMeshRegion(const Mesh& mesh, DeletionQueue& deletionQueue)
 {
-    vmaVirtualFree(vertexBlock, mesh.vertexAllocation);
-    vmaVirtualFree(indexBlock, mesh.indexAllocation);
+    // Frames in flight may still read the regions, so they can't be handed out again until those finish
+    deletionQueue.push(vertexBlock, mesh.vertexAllocation, &mutex);
+    deletionQueue.push(indexBlock, mesh.indexAllocation, &mutex);
+    if (mesh.meshletCount > 0)
+        deletionQueue.push(meshletBlock, mesh.meshletAllocation, &mutex);
 }
 
 void Mesh::MeshRegistry::bindBuffers(vk::CommandBuffer buf)
 {
     buf.bindVertexBuffers(0, {vertexBuffer}, {0});
-    buf.bindIndexBuffer(indexBuffer, 0, vk::IndexType::eUint32);
+    bindIndexBuffer(buf, vk::IndexType::eUint32);
+}
+
+void Mesh::MeshRegistry::bindIndexBuffer(vk::CommandBuffer buf, vk::IndexType indexType)
+{
+    buf.bindIndexBuffer(indexBuffer, 0, indexType);
 }
 
 void Mesh::MeshRegistry::destroy() noexcept
 {
     if (device) {
+        // The renderer waits for the device to go idle before shutting down, so no upload is still in flight
+        pendingBatch = UploadBatch{};
+        submittedBatches.clear();
+        freeCommandBuffers.clear();
         device.destroy(pool);
+        device.destroy(uploadTimeline);
+        device.destroy(sparseTimeline);
+        vertexBinds.clear();
+        indexBinds.clear();
+        meshletBinds.clear();
         vmaClearVirtualBlock(vertexBlock);
         vmaClearVirtualBlock(indexBlock);
-        device.destroy(fence);
+        vmaClearVirtualBlock(meshletBlock);
         vertexBuffer.destroy();
         indexBuffer.destroy();
-        stagingBuffer.destroy();
+        meshletBuffer.destroy();
         device = nullptr;
     }
 }
@@ -231,16 +742,32 @@ Mesh::MeshRegistry::MeshRegistry(Mesh::MeshRegistry&& other) noexcept
         other.device = nullptr;
         maxVertexCount = other.maxVertexCount;
         maxIndexCount = other.maxIndexCount;
+        maxMeshletCount = other.maxMeshletCount;
         allocator = other.allocator;
         vertexBlock = other.vertexBlock;
         indexBlock = other.indexBlock;
+        meshletBlock = other.meshletBlock;
         pool = other.pool;
-        cmd = other.cmd;
-        graphicsQueue = other.graphicsQueue;
-        fence = other.fence;
+        transferQueue = other.transferQueue;
+        transferFamily = other.transferFamily;
+        graphicsFamily = other.graphicsFamily;
+        queueMutex = other.queueMutex;
+        stagingRing = other.stagingRing;
         vertexBuffer = std::move(other.vertexBuffer);
         indexBuffer = std::move(other.indexBuffer);
-        stagingBuffer = std::move(other.stagingBuffer);
+        meshletBuffer = std::move(other.meshletBuffer);
+        pendingBatch = std::move(other.pendingBatch);
+        submittedBatches = std::move(other.submittedBatches);
+        freeCommandBuffers = std::move(other.freeCommandBuffers);
+        uploadTimeline = other.uploadTimeline;
+        nextUploadValue = other.nextUploadValue;
+        acquiredValue = other.acquiredValue;
+        sparseTimeline = other.sparseTimeline;
+        sparseBindValue = other.sparseBindValue;
+        vertexBinds = std::move(other.vertexBinds);
+        indexBinds = std::move(other.indexBinds);
+        meshletBinds = std::move(other.meshletBinds);
+        settledHeaps = other.settledHeaps;
     }
 }
 
@@ -253,16 +780,32 @@ Mesh::MeshRegistry& Mesh::MeshRegistry::operator=(Mesh::MeshRegistry&& other) no
         other.device = nullptr;
         maxVertexCount = other.maxVertexCount;
         maxIndexCount = other.maxIndexCount;
+        maxMeshletCount = other.maxMeshletCount;
         allocator = other.allocator;
         vertexBlock = other.vertexBlock;
         indexBlock = other.indexBlock;
+        meshletBlock = other.meshletBlock;
         pool = other.pool;
-        cmd = other.cmd;
-        graphicsQueue = other.graphicsQueue;
-        fence = other.fence;
+        transferQueue = other.transferQueue;
+        transferFamily = other.transferFamily;
+        graphicsFamily = other.graphicsFamily;
+        queueMutex = other.queueMutex;
+        stagingRing = other.stagingRing;
         vertexBuffer = std::move(other.vertexBuffer);
         indexBuffer = std::move(other.indexBuffer);
-        stagingBuffer = std::move(other.stagingBuffer);
+        meshletBuffer = std::move(other.meshletBuffer);
+        pendingBatch = std::move(other.pendingBatch);
+        submittedBatches = std::move(other.submittedBatches);
+        freeCommandBuffers = std::move(other.freeCommandBuffers);
+        uploadTimeline = other.uploadTimeline;
+        nextUploadValue = other.nextUploadValue;
+        acquiredValue = other.acquiredValue;
+        sparseTimeline = other.sparseTimeline;
+        sparseBindValue = other.sparseBindValue;
+        vertexBinds = std::move(other.vertexBinds);
+        indexBinds = std::move(other.indexBinds);
+        meshletBinds = std::move(other.meshletBinds);
+        settledHeaps = other.settledHeaps;
     }
     return *this;
 }
@@ -4,6 +4,11 @@
 
 #pragma once
 #include "allocation.h"
+#include "deletion_queue.h"
+#include "staging.h"
+#include <array>
+#include <deque>
+#include <functional>
 #include <model.h>
 #include <mutex>
 #include <span>
@@ -11,22 +16,102 @@
 
 namespace dragonfire {
 class Mesh {
-    VmaVirtualAllocation vertexAllocation{}, indexAllocation{};
-    VmaVirtualAllocationInfo vertexInfo{}, indexInfo{};
+    VmaVirtualAllocation vertexAllocation{}, indexAllocation{}, meshletAllocation{};
+    VmaVirtualAllocationInfo vertexInfo{}, indexInfo{}, meshletInfo{};
 
 public:
     UInt32 vertexCount = 0, indexCount = 0;
+    /// Index ranges of each level of detail, relative to the start of the mesh's indices
+    std::array<Model::Lod, Model::MAX_LOD_COUNT> lods{};
+    UInt32 lodCount = 1;
+    UInt32 meshletCount = 0;
+    /// Value of the registry's upload timeline that signals this mesh's data is on the gpu
+    UInt64 uploadValue = 0;
+    Model::VertexFormat vertexFormat = Model::VertexFormat::FULL;
+    Model::Quantization quantization;
+    /// Meshes with fewer than 65536 vertices store 16-bit indices
+    vk::IndexType indexType = vk::IndexType::eUint32;
+
+    /// Granularity of the vertex heap, vertices of every format are a multiple of it
+    static constexpr vk::DeviceSize VERTEX_UNIT_SIZE = sizeof(Model::CompactVertex);
+    static UInt32 getVertexUnits(Model::VertexFormat format);
+    /// Granularity of the index heap, indices of every type are a multiple of it
+    static constexpr vk::DeviceSize INDEX_UNIT_SIZE = sizeof(UInt16);
+    static UInt32 getIndexUnits(vk::IndexType type);
 
     UInt32 getVertexOffset() const;
     UInt32 getIndexOffset() const;
+    UInt32 getMeshletOffset() const;
 
     class MeshRegistry {
     public:
-        MeshRegistry(vk::Device device, VmaAllocator allocator, vk::Queue graphicsQueue, UInt32 graphicsFamily);
+        MeshRegistry(
+                vk::Device device,
+                VmaAllocator allocator,
+                vk::Queue transferQueue,
+                UInt32 transferFamily,
+                UInt32 graphicsFamily,
+                std::mutex* queueMutex,
+                StagingRing* stagingRing
+        );
         MeshRegistry() = default;
-        MeshHandle createMesh(std::span<Model::Vertex> vertices, std::span<UInt32> indices);
-        void freeMesh(MeshHandle mesh);
+        MeshHandle createMesh(
+                std::span<Model::Vertex> vertices,
+                std::span<UInt32> indices,
+                std::span<const Model::Lod> lods,
+                std::span<const Model::Meshlet> meshlets
+        );
+        MeshHandle createCompactMesh(
+                std::span<Model::CompactVertex> vertices,
+                std::span<UInt32> indices,
+                const Model::Quantization& quantization,
+                std::span<const Model::Lod> lods,
+                std::span<const Model::Meshlet> meshlets
+        );
+        /// Decodes the mesh's vertex and index streams straight into staging memory on the calling thread
+        MeshHandle createEncodedMesh(const Model::EncodedMesh& mesh);
+        /// The mesh's regions are released through the deletion queue once no frame uses them, after waiting for
+        /// its upload if that is still in flight
+        void freeMesh(MeshHandle mesh, DeletionQueue& deletionQueue);
         void bindBuffers(vk::CommandBuffer buf);
+        /// Binds the index heap viewed as indices of the type, offsets of meshes using that type are valid after
+        void bindIndexBuffer(vk::CommandBuffer buf, vk::IndexType indexType);
+        /// Submits the uploads recorded since the last call to the transfer queue
+        void submitUploads();
+        /**
+         * @brief Takes ownership of the data of every upload that finished on the transfer queue
+         * @param cmd graphics command buffer that must wait on the upload timeline before it executes
+         * @return the timeline value to wait on, or 0 if nothing was acquired
+         */
+        UInt64 acquireUploads(vk::CommandBuffer cmd);
+
+        /// Whether the mesh's upload was acquired by the graphics queue, meshes can't be drawn before that
+        [[nodiscard]] bool isResident(const Mesh& mesh) const { return mesh.uploadValue <= acquiredValue; }
+
+        [[nodiscard]] vk::Semaphore getUploadTimeline() const { return uploadTimeline; }
+
+        [[nodiscard]] vk::Buffer getMeshletBuffer() const { return meshletBuffer; }
+
+        /**
+         * @brief Moves meshes towards the start of their heaps to merge the free space left by freed meshes
+         * The copies are recorded into the graphics command buffer before anything reads the mesh data and
+         * the mesh offsets are patched right away, the old regions are freed through the deletion queue.
+         * @param budget maximum number of bytes to copy
+         * @return the number of bytes copied
+         */
+        vk::DeviceSize defragment(vk::CommandBuffer cmd, DeletionQueue& deletionQueue, vk::DeviceSize budget);
+
+        struct HeapStats {
+            vk::DeviceSize usedBytes = 0, freeBytes = 0, largestFreeBytes = 0;
+            /// Memory actually bound to the heap, the rest of its range has no memory behind it
+            vk::DeviceSize committedBytes = 0;
+            UInt32 freeRangeCount = 0;
+            /// Share of the free space outside the largest free range, 0 when all of it is contiguous
+            float fragmentation = 0.0f;
+        };
+
+        /// Statistics of the vertex, index and meshlet heaps in that order
+        std::array<HeapStats, 3> getHeapStats();
         void destroy() noexcept;
 
         MeshRegistry(MeshRegistry&) = delete;
@@ -37,21 +122,84 @@ public:
         ~MeshRegistry() noexcept { destroy(); }
 
     private:
-        USize maxVertexCount = 0, maxIndexCount = 0;
+        USize maxVertexCount = 0, maxIndexCount = 0, maxMeshletCount = 0;
         VmaAllocator allocator = nullptr;
-        VmaVirtualBlock vertexBlock{}, indexBlock{};
+        VmaVirtualBlock vertexBlock{}, indexBlock{}, meshletBlock{};
         vk::Device device;
-        Buffer vertexBuffer, indexBuffer, stagingBuffer;
+        SparseBuffer vertexBuffer, indexBuffer, meshletBuffer;
+        static constexpr vk::DeviceSize HEAP_PAGE_SIZE = 1 << 21;
+        /// Pages committed since the last submission, bound on the transfer queue before the next batch runs
+        std::vector<vk::SparseMemoryBind> vertexBinds, indexBinds, meshletBinds;
+        vk::Semaphore sparseTimeline;
+        UInt64 sparseBindValue = 0;
         vk::CommandPool pool;
-        vk::CommandBuffer cmd;
-        vk::Queue graphicsQueue;
-        vk::Fence fence;
+        vk::Queue transferQueue;
+        UInt32 transferFamily = 0, graphicsFamily = 0;
+        std::mutex* queueMutex = nullptr;
+        StagingRing* stagingRing = nullptr;
         std::vector<Mesh*> meshes;
         std::mutex mutex;
 
-        Mesh uploadMesh(std::span<Model::Vertex> vertices, std::span<UInt32> indices);
-        void freeMeshRegion(const Mesh& mesh);
-        void* getStagingPtr(USize size);
+        /// Uploads recorded into a single transfer command buffer and submitted together
+        struct UploadBatch {
+            vk::CommandBuffer cmd;
+            /// Staging ring allocations read by the batch, released once it is submitted
+            std::vector<UInt64> stagingIds;
+            UInt64 value = 0;
+            /// Regions whose ownership moves from the transfer to the graphics queue family
+            std::vector<vk::BufferMemoryBarrier> ownershipTransfers;
+        };
+
+        UploadBatch pendingBatch;
+        std::deque<UploadBatch> submittedBatches;
+        std::vector<vk::CommandBuffer> freeCommandBuffers;
+        vk::Semaphore uploadTimeline;
+        UInt64 nextUploadValue = 1, acquiredValue = 0;
+
+        /// One of the suballocated buffers, used to defragment all of them the same way
+        struct Heap {
+            VmaVirtualBlock block;
+            vk::Buffer buffer;
+            vk::DeviceSize elementSize;
+            VmaVirtualAllocation Mesh::*allocation;
+            VmaVirtualAllocationInfo Mesh::*info;
+            /// Alignment of the mesh's allocation in elements, vertices and indices are aligned to their own size
+            UInt32 (*alignment)(const Mesh&);
+        };
+
+        /// Heap statistics of the last defragmentation pass that couldn't move anything
+        struct SettledHeap {
+            VkDeviceSize allocationBytes = 0;
+            UInt32 unusedRangeCount = 0;
+        };
+
+        std::array<SettledHeap, 3> settledHeaps{};
+
+        void allocateMeshRegion(Mesh& mesh, USize vertexCount, USize indexCount, USize meshletCount);
+        void freeMeshRegion(const Mesh& mesh, DeletionQueue& deletionQueue);
+        /// Fills the staging memory of a mesh's vertices and indices, indices are written as the given type
+        using GeometryWriter = std::function<void(void* vertices, void* indices, vk::IndexType indexType)>;
+        MeshHandle createMesh(
+                USize vertexCount,
+                USize indexCount,
+                Model::VertexFormat format,
+                const Model::Quantization& quantization,
+                std::span<const Model::Lod> lods,
+                std::span<const Model::Meshlet> meshlets,
+                const GeometryWriter& writeGeometry
+        );
+        void beginBatch();
+        void recordCopy(
+                vk::Buffer dst,
+                const StagingRing::Allocation& staging,
+                vk::DeviceSize stagingOffset,
+                vk::DeviceSize dstOffset,
+                vk::DeviceSize size,
+                vk::AccessFlags dstAccess
+        );
+        void submitBatch();
+        /// Submits the pending page binds, the queue mutex must be held
+        void bindPages();
     };
 };
 
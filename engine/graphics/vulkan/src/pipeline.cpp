@@ -4,6 +4,8 @@
 
 #include "pipeline.h"
 #include "vk_renderer.h"
+#include <algorithm>
+#include <config.h>
 #include <file.h>
 #include <material.h>
 #include <model.h>
@@ -13,17 +15,53 @@
 
 namespace dragonfire {
 
-Pipeline Pipeline::PipelineLibrary::getPipeline(const std::string& name)
+Pipeline Pipeline::PipelineLibrary::getPipeline(const std::string& name, Model::VertexFormat format)
 {
-    if (pipelines.contains(name))
-        return pipelines[name];
-    return {nullptr, nullptr};
+    const bool compact = format == Model::VertexFormat::COMPACT;
+    auto& map = compact ? compactPipelines : pipelines;
+    auto it = map.find(name);
+    if (it == map.end())
+        return {nullptr, nullptr};
+    MaterialPipeline& material = *it->second;
+    if (material.ready.load(std::memory_order_acquire))
+        return material.pipeline;
+    if (!material.requested.exchange(true)) {
+        {
+            std::unique_lock lock(compileMutex);
+            compileJobs++;
+        }
+        GLOBAL_THREAD_POOL.push_task([this, &material] {
+            compile(material);
+            {
+                std::unique_lock lock(compileMutex);
+                compileJobs--;
+            }
+            compileDone.notify_all();
+        });
+    }
+    MaterialPipeline* fallbackMaterial = compact ? compactFallback : fallback;
+    return fallbackMaterial ? fallbackMaterial->pipeline : Pipeline(nullptr, nullptr);
+}
+
+void Pipeline::PipelineLibrary::compile(MaterialPipeline& material)
+{
+    try {
+        auto [pl, layout] = factory->createPipeline(material.effect, material.vertexFormat);
+        material.pipeline = Pipeline(pl, layout);
+        material.ready.store(true, std::memory_order_release);
+    }
+    catch (const std::exception& e) {
+        // Left requested, so the material keeps drawing with the fallback instead of retrying every frame
+        spdlog::get("Rendering")
+                ->error("Failed to compile pipeline of material \"{}\", error: {}", material.name, e.what());
+    }
 }
 
-void Pipeline::PipelineLibrary::loadMaterialFiles(const char* dir, Renderer* renderer, PipelineFactory& pipelineFactory)
+void Pipeline::PipelineLibrary::loadMaterialFiles(const char* dir, Renderer* renderer, PipelineFactory* pipelineFactory)
 {
     VkRenderer* render = static_cast<VkRenderer*>(renderer);
     device = render->getDevice();
+    factory = pipelineFactory;
     auto logger = spdlog::get("Rendering");
     std::unique_ptr<char*, decltype([](char** ptr) { PHYSFS_freeList(ptr); })> files(PHYSFS_enumerateFiles(dir));
     if (!files)
@@ -37,11 +75,10 @@ void Pipeline::PipelineLibrary::loadMaterialFiles(const char* dir, Renderer* ren
     }
 
     struct ThreadData {
-        ankerl::unordered_dense::set<vk::Pipeline> pipelines;
-        ankerl::unordered_dense::set<vk::PipelineLayout> layouts;
-        ankerl::unordered_dense::map<std::string, Pipeline> loadedMaterials;
+        std::vector<std::pair<std::string, Material::ShaderEffect>> effects;
     };
 
+    // Only the files are read here, which is cheap next to compiling their pipelines
     BS::multi_future<ThreadData> future =
             GLOBAL_THREAD_POOL.parallelize_loop(fileCount, [&](const UInt start, const UInt end) {
                 ThreadData data;
@@ -55,11 +92,7 @@ void Pipeline::PipelineLibrary::loadMaterialFiles(const char* dir, Renderer* ren
                         std::string name = json["name"].get<std::string>();
                         Material::ShaderEffect effect = json.contains("effect") ? Material::ShaderEffect(json["effect"])
                                                                                 : Material::ShaderEffect();
-                        auto [pl, layout] = pipelineFactory.createPipeline(effect);
-                        data.pipelines.insert(pl);
-                        data.layouts.insert(layout);
-                        logger->info("Loaded material \"{}\"", name);
-                        data.loadedMaterials[std::move(name)] = Pipeline(pl, layout);
+                        data.effects.emplace_back(std::move(name), std::move(effect));
                         // TODO other material info
                     }
                     catch (const std::exception& e) {
@@ -71,20 +104,156 @@ void Pipeline::PipelineLibrary::loadMaterialFiles(const char* dir, Renderer* ren
 
     std::vector<ThreadData> data = future.get();
     for (ThreadData& d : data) {
-        createdPipelines.insert(d.pipelines.begin(), d.pipelines.end());
-        createdLayouts.insert(d.layouts.begin(), d.layouts.end());
-        pipelines.insert(d.loadedMaterials.begin(), d.loadedMaterials.end());
+        for (auto& [name, effect] : d.effects) {
+            // Meshes may use either vertex format, so triangle pipelines get a variant for each
+            if (PipelineFactory::hasMeshVertexInput(effect)) {
+                auto& compact = compactPipelines[name] = std::make_unique<MaterialPipeline>();
+                compact->name = name;
+                compact->effect = effect;
+                compact->vertexFormat = Model::VertexFormat::COMPACT;
+            }
+            auto& material = pipelines[name] = std::make_unique<MaterialPipeline>();
+            material->name = name;
+            material->effect = std::move(effect);
+            logger->info("Loaded material \"{}\"", name);
+        }
+    }
+
+    std::string fallbackName;
+    try {
+        fallbackName = Config::INSTANCE.get<std::string>("graphics.fallbackMaterial");
+    }
+    catch (...) {
+        fallbackName = "basic";
+    }
+    // Compiled up front since every other material draws with it until its own pipeline is ready
+    for (auto [map, target] : {std::pair(&pipelines, &fallback), std::pair(&compactPipelines, &compactFallback)}) {
+        auto it = map->find(fallbackName);
+        if (it == map->end())
+            continue;
+        MaterialPipeline& material = *it->second;
+        material.requested = true;
+        compile(material);
+        if (material.ready)
+            *target = &material;
+    }
+    if (!fallback)
+        logger->warn(
+                "Fallback material \"{}\" is not available, draws are skipped until their pipeline is ready",
+                fallbackName
+        );
+
+    bool hotReload;
+    try {
+        hotReload = Config::INSTANCE.get<bool>("graphics.shaderHotReload");
+    }
+    catch (...) {
+        hotReload = false;
+    }
+    if (hotReload) {
+        reloadThread = std::jthread(std::bind_front(&PipelineLibrary::watchShaders, this));
+        logger->info("Watching shaders for changes");
     }
 }
 
+void Pipeline::PipelineLibrary::watchShaders(const std::stop_token& stopToken)
+{
+    auto logger = spdlog::get("Rendering");
+    std::mutex waitMutex;
+    while (!stopToken.stop_requested()) {
+        {
+            std::unique_lock lock(waitMutex);
+            reloadCondVar.wait_for(lock, stopToken, std::chrono::milliseconds(500), [] { return false; });
+        }
+        if (stopToken.stop_requested())
+            break;
+        std::vector<std::string> changed;
+        try {
+            changed = factory->reloadChangedShaders();
+        }
+        catch (const std::exception& e) {
+            logger->error("Failed to check shaders for changes: {}", e.what());
+        }
+        if (changed.empty())
+            continue;
+        {
+            std::unique_lock lock(reloadMutex);
+            reloadedShaders.insert(reloadedShaders.end(), changed.begin(), changed.end());
+        }
+        // Materials that were never drawn compile with the new modules anyway, only compiled ones are recreated.
+        // Ones compiling right now may have picked up the old modules and keep them until their shaders change again
+        for (auto* map : {&pipelines, &compactPipelines}) {
+            for (auto& [name, material] : *map) {
+                if (!material->ready
+                    || std::ranges::none_of(changed, [&](const std::string& shader) {
+                           return PipelineFactory::usesShader(material->effect, shader);
+                       }))
+                    continue;
+                try {
+                    auto [pl, layout] = factory->createPipeline(material->effect, material->vertexFormat);
+                    std::unique_lock lock(reloadMutex);
+                    reloadedPipelines.emplace_back(material.get(), Pipeline(pl, layout));
+                    logger->info("Recreated pipeline of material \"{}\"", name);
+                }
+                catch (const std::exception& e) {
+                    logger->error("Failed to recreate pipeline of material \"{}\", error: {}", name, e.what());
+                }
+            }
+        }
+    }
+}
+
+void Pipeline::PipelineLibrary::applyReloadedPipelines(DeletionQueue& deletionQueue)
+{
+    std::vector<std::pair<MaterialPipeline*, Pipeline>> reloaded;
+    {
+        std::unique_lock lock(reloadMutex);
+        reloaded.swap(reloadedPipelines);
+    }
+    // Pipelines are only read by the thread building frames, which is the one calling this
+    for (auto& [material, pipeline] : reloaded) {
+        // Frames still in flight may be drawing with the old pipeline
+        deletionQueue.push(material->pipeline.pipeline);
+        if (material->pipeline.pipelineLayout != pipeline.pipelineLayout)
+            replacedLayouts.insert(material->pipeline.pipelineLayout);
+        material->pipeline = pipeline;
+    }
+}
+
+std::vector<std::string> Pipeline::PipelineLibrary::takeReloadedShaders()
+{
+    std::unique_lock lock(reloadMutex);
+    return std::exchange(reloadedShaders, {});
+}
+
 void Pipeline::PipelineLibrary::destroy()
 {
     if (device) {
-        for (vk::Pipeline pl : createdPipelines)
-            device.destroy(pl);
-        for (vk::PipelineLayout l : createdLayouts)
+        reloadThread = std::jthread();
+        {
+            std::unique_lock lock(compileMutex);
+            compileDone.wait(lock, [&] { return compileJobs == 0; });
+        }
+        // Layouts are shared between pipelines with the same descriptor sets and push constants
+        ankerl::unordered_dense::set<vk::PipelineLayout> layouts = std::move(replacedLayouts);
+        for (auto& [material, pipeline] : reloadedPipelines) {
+            device.destroy(pipeline.pipeline);
+            layouts.insert(pipeline.pipelineLayout);
+        }
+        reloadedPipelines.clear();
+        for (auto* map : {&pipelines, &compactPipelines}) {
+            for (auto& [name, material] : *map) {
+                if (!material->ready)
+                    continue;
+                device.destroy(material->pipeline.pipeline);
+                layouts.insert(material->pipeline.pipelineLayout);
+            }
+        }
+        for (vk::PipelineLayout l : layouts)
             device.destroy(l);
         pipelines.clear();
+        compactPipelines.clear();
+        fallback = compactFallback = nullptr;
         device = nullptr;
     }
 }
@@ -99,11 +268,52 @@ static std::array<vk::VertexInputAttributeDescription, 3> MESH_VERTEX_ATTRIBUTES
         vk::VertexInputAttributeDescription(2, 0, vk::Format::eR32G32Sfloat, offsetof(Model::Vertex, uv)),
 };
 
-std::pair<vk::Pipeline, vk::PipelineLayout> PipelineFactory::createPipeline(const Material::ShaderEffect& effect)
+static std::array<vk::VertexInputBindingDescription, 1> COMPACT_VERTEX_INPUT_BINDING = {
+        vk::VertexInputBindingDescription(0, sizeof(Model::CompactVertex), vk::VertexInputRate::eVertex),
+};
+
+/// Same locations as the full format, the vertex shader decodes the normals and positions are dequantized by the
+/// model matrix
+static std::array<vk::VertexInputAttributeDescription, 3> COMPACT_VERTEX_ATTRIBUTES = {
+        vk::VertexInputAttributeDescription(
+                0,
+                0,
+                vk::Format::eR16G16B16A16Unorm,
+                offsetof(Model::CompactVertex, position)
+        ),
+        vk::VertexInputAttributeDescription(1, 0, vk::Format::eR16G16Snorm, offsetof(Model::CompactVertex, normal)),
+        vk::VertexInputAttributeDescription(2, 0, vk::Format::eR16G16Sfloat, offsetof(Model::CompactVertex, uv)),
+};
+
+bool PipelineFactory::hasMeshVertexInput(const Material::ShaderEffect& effect)
+{
+    return effect.topology == Material::ShaderEffect::Topology::triangleList
+           || effect.topology == Material::ShaderEffect::Topology::triangleFan;
+}
+
+std::pair<vk::Pipeline, vk::PipelineLayout> PipelineFactory::createPipeline(
+        const Material::ShaderEffect& effect,
+        Model::VertexFormat vertexFormat
+)
 {
+    // Held until the pipeline is created, so hot reloading doesn't destroy the modules it is created from
+    std::shared_lock shaderLock(shaderMutex);
+    // Checks the shaders exist before they are looked up for the stages
+    vk::PipelineLayout layout = getCreateLayout(effect);
     std::array<vk::PipelineShaderStageCreateInfo, 5> stageInfos;
     UInt stageCount = getShaderStages(stageInfos, effect);
-    vk::PipelineLayout layout = getCreateLayout(effect);
+    // Vertex shaders declare the format as specialization constant 0
+    const vk::Bool32 compactVertices = vertexFormat == Model::VertexFormat::COMPACT;
+    const vk::SpecializationMapEntry specializationEntry(0, 0, sizeof(vk::Bool32));
+    vk::SpecializationInfo specializationInfo{};
+    specializationInfo.mapEntryCount = 1;
+    specializationInfo.pMapEntries = &specializationEntry;
+    specializationInfo.dataSize = sizeof(vk::Bool32);
+    specializationInfo.pData = &compactVertices;
+    for (UInt i = 0; i < stageCount; i++) {
+        if (stageInfos[i].stage == vk::ShaderStageFlagBits::eVertex)
+            stageInfos[i].pSpecializationInfo = &specializationInfo;
+    }
     vk::DynamicState dynamicStates[] = {vk::DynamicState::eViewport, vk::DynamicState::eScissor};
     vk::PipelineDynamicStateCreateInfo dynamicStateCreateInfo{};
     dynamicStateCreateInfo.pDynamicStates = dynamicStates;
@@ -162,8 +372,13 @@ std::pair<vk::Pipeline, vk::PipelineLayout> PipelineFactory::createPipeline(cons
     colorBlend.logicOpEnable = false;
 
     vk::PipelineVertexInputStateCreateInfo vertexInput{};
-    if (effect.topology == Material::ShaderEffect::Topology::triangleList
-        || effect.topology == Material::ShaderEffect::Topology::triangleFan) {
+    if (hasMeshVertexInput(effect) && compactVertices) {
+        vertexInput.pVertexBindingDescriptions = COMPACT_VERTEX_INPUT_BINDING.data();
+        vertexInput.vertexBindingDescriptionCount = COMPACT_VERTEX_INPUT_BINDING.size();
+        vertexInput.pVertexAttributeDescriptions = COMPACT_VERTEX_ATTRIBUTES.data();
+        vertexInput.vertexAttributeDescriptionCount = COMPACT_VERTEX_ATTRIBUTES.size();
+    }
+    else if (hasMeshVertexInput(effect)) {
         vertexInput.pVertexBindingDescriptions = MESH_VERTEX_INPUT_BINDING.data();
         vertexInput.vertexBindingDescriptionCount = MESH_VERTEX_INPUT_BINDING.size();
         vertexInput.pVertexAttributeDescriptions = MESH_VERTEX_ATTRIBUTES.data();
@@ -188,7 +403,7 @@ std::pair<vk::Pipeline, vk::PipelineLayout> PipelineFactory::createPipeline(cons
     createInfo.pColorBlendState = &colorBlend;
     createInfo.pVertexInputState = &vertexInput;
 
-    auto [result, pipeline] = device.createGraphicsPipeline(cache, createInfo);
+    auto [result, pipeline] = device.createGraphicsPipeline(getThreadCache(), createInfo);
     if (result != vk::Result::eSuccess)
         crash("Failed to create graphics pipeline");
     return {pipeline, layout};
@@ -204,7 +419,7 @@ UInt PipelineFactory::getShaderStages(
         infos[count] = vk::PipelineShaderStageCreateInfo(
                 {},
                 vk::ShaderStageFlagBits::eVertex,
-                shaders[effect.shaderNames.vertex].first,
+                shaders.at(effect.shaderNames.vertex).first,
                 "main"
         );
         count++;
@@ -213,7 +428,7 @@ UInt PipelineFactory::getShaderStages(
         infos[count] = vk::PipelineShaderStageCreateInfo(
                 {},
                 vk::ShaderStageFlagBits::eFragment,
-                shaders[effect.shaderNames.fragment].first,
+                shaders.at(effect.shaderNames.fragment).first,
                 "main"
         );
         count++;
@@ -222,7 +437,7 @@ UInt PipelineFactory::getShaderStages(
         infos[count] = vk::PipelineShaderStageCreateInfo(
                 {},
                 vk::ShaderStageFlagBits::eGeometry,
-                shaders[effect.shaderNames.geometry].first,
+                shaders.at(effect.shaderNames.geometry).first,
                 "main"
         );
         count++;
@@ -231,7 +446,7 @@ UInt PipelineFactory::getShaderStages(
         infos[count] = vk::PipelineShaderStageCreateInfo(
                 {},
                 vk::ShaderStageFlagBits::eTessellationEvaluation,
-                shaders[effect.shaderNames.tessEval].first,
+                shaders.at(effect.shaderNames.tessEval).first,
                 "main"
         );
         count++;
@@ -240,7 +455,7 @@ UInt PipelineFactory::getShaderStages(
         infos[count] = vk::PipelineShaderStageCreateInfo(
                 {},
                 vk::ShaderStageFlagBits::eTessellationControl,
-                shaders[effect.shaderNames.tessCtrl].first,
+                shaders.at(effect.shaderNames.tessCtrl).first,
                 "main"
         );
         count++;
@@ -263,36 +478,34 @@ vk::PipelineLayout PipelineFactory::getCreateLayout(const Material::ShaderEffect
 }
 
 vk::PipelineLayout PipelineFactory::getCreateLayout(
-        const PipelineFactory::PipelineLayoutInfo& layoutInfo,
+        PipelineFactory::PipelineLayoutInfo& layoutInfo,
         std::array<DescriptorLayoutManager::LayoutInfo, 4>& setLayoutInfos
 )
 {
-    USize hash = PipelineLayoutInfo::Hash()(layoutInfo);
-    {
-        std::shared_lock lock(mutex);
-        if (builtLayouts.contains(hash))
-            return builtLayouts[hash];
-    }
-
     UInt setLayoutCount = 0;
-    std::array<vk::DescriptorSetLayout, 4> setLayouts;
     for (auto& setLayoutInfo : setLayoutInfos) {
         if (setLayoutInfo.bindings.empty())
             break;
-        setLayouts[setLayoutCount] = layoutManager->getOrCreateLayout(setLayoutInfo);
+        layoutInfo.sets[setLayoutCount] = layoutManager->getOrCreateLayout(setLayoutInfo);
         setLayoutCount++;
     }
+    {
+        std::shared_lock lock(mutex);
+        if (auto it = builtLayouts.find(layoutInfo); it != builtLayouts.end())
+            return it->second;
+    }
+
     vk::PipelineLayoutCreateInfo createInfo{};
     createInfo.pPushConstantRanges = layoutInfo.pushConstants.data();
     createInfo.pushConstantRangeCount = layoutInfo.pushConstants.size();
-    createInfo.pSetLayouts = setLayouts.data();
+    createInfo.pSetLayouts = layoutInfo.sets.data();
     createInfo.setLayoutCount = setLayoutCount;
 
     std::unique_lock lock(mutex);
-    if (builtLayouts.contains(hash))
-        return builtLayouts[hash];
+    if (auto it = builtLayouts.find(layoutInfo); it != builtLayouts.end())
+        return it->second;
     vk::PipelineLayout layout = device.createPipelineLayout(createInfo);
-    builtLayouts[hash] = layout;
+    builtLayouts[layoutInfo] = layout;
     return layout;
 }
 
@@ -304,21 +517,20 @@ void PipelineFactory::loadLayoutReflectionData(
 {
     if (shaderName.empty())
         return;
-    if (!shaders.contains(shaderName))
+    auto it = shaders.find(shaderName);
+    if (it == shaders.end())
         throw FormattedError("Requested shader module \"{}\" not available", shaderName);
-    const auto& shader = shaders[shaderName].second;
+    const ShaderReflection& shader = it->second.second;
 
-    for (UInt i = 0; i < shader.push_constant_block_count; i++) {
-        const auto& pushInfo = shader.push_constant_blocks[i];
+    for (const ShaderReflection::PushConstantRange& pushInfo : shader.pushConstants) {
         info.pushConstants.emplace_back(
-                static_cast<vk::ShaderStageFlagBits>(shader.shader_stage),
+                static_cast<vk::ShaderStageFlagBits>(shader.stage),
                 pushInfo.offset,
                 pushInfo.size
         );
     }
 
-    for (UInt i = 0; i < shader.descriptor_binding_count; i++) {
-        const auto& bindingInfo = shader.descriptor_bindings[i];
+    for (const ShaderReflection::Binding& bindingInfo : shader.bindings) {
         if (bindingInfo.set > 3) {
             spdlog::error(
                     "descriptor set {} is outside the supported set range 0-3 and will be ignored",
@@ -328,15 +540,14 @@ void PipelineFactory::loadLayoutReflectionData(
         }
         auto& layoutInfo = layoutInfos[bindingInfo.set];
         auto& binding = layoutInfo.bindings.emplace_back();
-        TempString str = bindingInfo.name;
         binding.binding = bindingInfo.binding;
-        binding.descriptorType = static_cast<vk::DescriptorType>(bindingInfo.descriptor_type);
+        binding.descriptorType = static_cast<vk::DescriptorType>(bindingInfo.descriptorType);
         binding.descriptorCount = bindingInfo.count;
-        if (str.find("bindless") != std::string::npos) {
+        if (bindingInfo.bindless) {
             layoutInfo.bindless = true;
             binding.descriptorCount = maxDrawCount;
         }
-        binding.stageFlags = static_cast<vk::ShaderStageFlagBits>(shader.shader_stage);
+        binding.stageFlags = static_cast<vk::ShaderStageFlagBits>(shader.stage);
     }
 }
 
@@ -345,8 +556,12 @@ std::pair<vk::Pipeline, vk::PipelineLayout> PipelineFactory::createComputePipeli
         vk::PipelineCreateFlagBits flags
 )
 {
-    auto& [shader, reflection] = shaders[shaderName];
-    if (reflection.shader_stage != SPV_REFLECT_SHADER_STAGE_COMPUTE_BIT)
+    std::shared_lock shaderLock(shaderMutex);
+    auto it = shaders.find(shaderName);
+    if (it == shaders.end())
+        throw FormattedError("Requested shader module \"{}\" not available", shaderName);
+    auto& [shader, reflection] = it->second;
+    if (reflection.stage != VK_SHADER_STAGE_COMPUTE_BIT)
         throw FormattedError("Shader {} is not a compute shader", shaderName);
     PipelineLayoutInfo layoutInfo;
     std::array<DescriptorLayoutManager::LayoutInfo, 4> setLayoutInfos;
@@ -360,7 +575,7 @@ std::pair<vk::Pipeline, vk::PipelineLayout> PipelineFactory::createComputePipeli
     createInfo.flags = flags;
     createInfo.layout = layout;
 
-    auto [result, pipeline] = device.createComputePipeline(cache, createInfo);
+    auto [result, pipeline] = device.createComputePipeline(getThreadCache(), createInfo);
     if (result != vk::Result::eSuccess)
         crash("Failed to create compute pipeline");
     return {pipeline, layout};
@@ -368,43 +583,120 @@ std::pair<vk::Pipeline, vk::PipelineLayout> PipelineFactory::createComputePipeli
 
 PipelineFactory::PipelineFactory(
         vk::Device device,
+        const vk::PhysicalDeviceProperties& deviceProperties,
         vk::SampleCountFlagBits multisamplingSamples,
         DescriptorLayoutManager* layoutManager,
         vk::DeviceSize maxDrawCount,
         std::vector<vk::RenderPass>&& renderPasses
 )
     : device(device),
+      deviceProperties(deviceProperties),
       layoutManager(layoutManager),
       multisamplingSamples(multisamplingSamples),
       renderPasses(std::move(renderPasses)),
       maxDrawCount(maxDrawCount)
 {
     logger = spdlog::get("Rendering");
+    cachePath = fmt::format("cache/pipeline_{:04x}_{:04x}.cache", deviceProperties.vendorID, deviceProperties.deviceID);
     try {
-        vk::PipelineCacheCreateInfo createInfo{};
-        File file("cache/pipeline.cache");
-        auto data = file.readData();
+        File file(cachePath);
+        cacheData = file.readData();
         file.close();
-        createInfo.initialDataSize = data.size();
-        createInfo.pInitialData = data.data();
-        cache = device.createPipelineCache(createInfo);
+        // Drivers may accept data from another driver version and just miss on every pipeline, so it is checked here
+        if (!isCacheCompatible(cacheData)) {
+            logger->warn("Pipeline cache was written by a different driver, it will be rebuilt");
+            cacheData.clear();
+        }
     }
     catch (const std::exception& e) {
         logger->error("Failed to load pipeline cache(this is normal on the first run)");
-        cache = device.createPipelineCache(vk::PipelineCacheCreateInfo());
+        cacheData.clear();
     }
+    vk::PipelineCacheCreateInfo createInfo{};
+    createInfo.initialDataSize = cacheData.size();
+    createInfo.pInitialData = cacheData.data();
+    cache = device.createPipelineCache(createInfo);
+    savedCacheSize = cacheData.size();
     loadShaders();
+
+    Int64 saveInterval;
+    try {
+        saveInterval = Config::INSTANCE.get<Int64>("graphics.pipelineCacheSaveInterval");
+    }
+    catch (...) {
+        saveInterval = 30;
+    }
+    if (saveInterval > 0) {
+        saveThread = std::jthread(
+                std::bind_front(&PipelineFactory::saveCachePeriodically, this),
+                std::chrono::seconds(saveInterval)
+        );
+    }
+}
+
+bool PipelineFactory::isCacheCompatible(const std::vector<UInt8>& data) const
+{
+    VkPipelineCacheHeaderVersionOne header;
+    if (data.size() < sizeof(header))
+        return false;
+    memcpy(&header, data.data(), sizeof(header));
+    return header.headerSize >= sizeof(header) && header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+           && header.vendorID == deviceProperties.vendorID && header.deviceID == deviceProperties.deviceID
+           && memcmp(header.pipelineCacheUUID, deviceProperties.pipelineCacheUUID.data(), VK_UUID_SIZE) == 0;
+}
+
+vk::PipelineCache PipelineFactory::getThreadCache()
+{
+    std::unique_lock lock(cacheMutex);
+    auto [it, inserted] = threadCaches.try_emplace(std::this_thread::get_id());
+    if (inserted) {
+        vk::PipelineCacheCreateInfo createInfo{};
+        createInfo.initialDataSize = cacheData.size();
+        createInfo.pInitialData = cacheData.data();
+        it->second = device.createPipelineCache(createInfo);
+    }
+    return it->second;
 }
 
 void PipelineFactory::saveCache()
 {
-    PHYSFS_mkdir("cache");
+    std::unique_lock lock(cacheMutex);
+    if (!threadCaches.empty()) {
+        std::vector<vk::PipelineCache> sources;
+        sources.reserve(threadCaches.size());
+        for (const auto& [thread, threadCache] : threadCaches)
+            sources.push_back(threadCache);
+        device.mergePipelineCaches(cache, sources);
+    }
     auto data = device.getPipelineCacheData(cache);
-    File file("cache/pipeline.cache", File::Mode::write);
+    // Nothing was compiled since the last save
+    if (data.size() == savedCacheSize)
+        return;
+    PHYSFS_mkdir("cache");
+    File file(cachePath, File::Mode::write);
     file.writeData(data);
+    savedCacheSize = data.size();
     logger->info("Saved pipeline cache to disk");
 }
 
+void PipelineFactory::saveCachePeriodically(const std::stop_token& stopToken, std::chrono::seconds interval)
+{
+    std::mutex waitMutex;
+    while (!stopToken.stop_requested()) {
+        std::unique_lock lock(waitMutex);
+        saveCondVar.wait_for(lock, stopToken, interval, [] { return false; });
+        if (stopToken.stop_requested())
+            break;
+        // What a crash would lose is limited to what was compiled since the last save
+        try {
+            saveCache();
+        }
+        catch (const std::exception& e) {
+            logger->error("Failed to save pipeline cache: {}", e.what());
+        }
+    }
+}
+
 void PipelineFactory::loadShaders()
 {
 #ifdef SHADER_OUTPUT_PATH
@@ -415,24 +707,13 @@ void PipelineFactory::loadShaders()
     if (files == nullptr)
         throw std::runtime_error("Failed to load shader directory");
     for (char** i = files; *i != nullptr; i++) {
+        char* ext = strrchr(*i, '.');
+        if (!(ext && strcmp(ext, ".spv") == 0))
+            continue;
+        std::string name = *i;
+        name.erase(name.rfind(".spv"));
         try {
-            char* ext = strrchr(*i, '.');
-            if (!(ext && strcmp(ext, ".spv") == 0))
-                continue;
-            TempString path = "assets/shaders/";
-            path += *i;
-            File file(path.c_str());
-            auto spv = file.readData();
-            file.close();
-            std::string name = *i;
-            name.erase(name.rfind(".spv"));
-            auto& pair = shaders[std::move(name)];
-            if (spvReflectCreateShaderModule(spv.size(), spv.data(), &pair.second) != SPV_REFLECT_RESULT_SUCCESS)
-                throw std::runtime_error("Shader reflection failed");
-            vk::ShaderModuleCreateInfo createInfo{};
-            createInfo.codeSize = spvReflectGetCodeSize(&pair.second);
-            createInfo.pCode = spvReflectGetCode(&pair.second);
-            pair.first = device.createShaderModule(createInfo);
+            loadShader(name);
             logger->info("Loaded shader module \"{}\"", *i);
         }
         catch (const std::exception& e) {
@@ -442,19 +723,100 @@ void PipelineFactory::loadShaders()
     PHYSFS_freeList(files);
 }
 
+/// Latest modification time of the shader and its reflection, the reflection is written after the shader
+static Int64 getShaderWriteTime(const std::string& name)
+{
+    PHYSFS_Stat spvStat{}, reflectionStat{};
+    PHYSFS_stat(("assets/shaders/" + name + ".spv").c_str(), &spvStat);
+    PHYSFS_stat(("assets/shaders/" + name + ".refl").c_str(), &reflectionStat);
+    return std::max(spvStat.modtime, reflectionStat.modtime);
+}
+
+void PipelineFactory::loadShader(const std::string& name)
+{
+    const Int64 writeTime = getShaderWriteTime(name);
+    {
+        std::unique_lock lock(shaderMutex);
+        // Also recorded when loading fails, so a broken shader is only retried once it is written again
+        shaderWriteTimes[name] = writeTime;
+    }
+    File file("assets/shaders/" + name + ".spv");
+    auto spv = file.readData();
+    file.close();
+    // Written by ShaderReflect when the shader is compiled
+    File reflectionFile("assets/shaders/" + name + ".refl");
+    auto reflectionData = reflectionFile.readData();
+    reflectionFile.close();
+    ShaderReflection reflection = ShaderReflection::read(reflectionData, spv);
+
+    vk::ShaderModuleCreateInfo createInfo{};
+    createInfo.codeSize = spv.size();
+    createInfo.pCode = reinterpret_cast<const UInt32*>(spv.data());
+    vk::ShaderModule module = device.createShaderModule(createInfo);
+    std::unique_lock lock(shaderMutex);
+    auto& pair = shaders[name];
+    // Pipelines are only created while holding the shared lock, so no creation still uses the old module
+    if (pair.first)
+        device.destroy(pair.first);
+    pair.first = module;
+    pair.second = std::move(reflection);
+}
+
+std::vector<std::string> PipelineFactory::reloadChangedShaders()
+{
+    std::unique_ptr<char*, decltype([](char** ptr) { PHYSFS_freeList(ptr); })> files(
+            PHYSFS_enumerateFiles("assets/shaders")
+    );
+    if (!files)
+        throw PhysFSError();
+    std::vector<std::string> reloaded;
+    for (char** i = files.get(); *i != nullptr; i++) {
+        char* ext = strrchr(*i, '.');
+        if (!(ext && strcmp(ext, ".spv") == 0))
+            continue;
+        std::string name = *i;
+        name.erase(name.rfind(".spv"));
+        const Int64 writeTime = getShaderWriteTime(name);
+        {
+            std::shared_lock lock(shaderMutex);
+            auto it = shaderWriteTimes.find(name);
+            if (it != shaderWriteTimes.end() && it->second == writeTime)
+                continue;
+        }
+        try {
+            loadShader(name);
+            logger->info("Reloaded shader module \"{}\"", *i);
+            reloaded.push_back(std::move(name));
+        }
+        catch (const std::exception& e) {
+            logger->error("Failed to reload shader module \"{}\", error: {}", *i, e.what());
+        }
+    }
+    return reloaded;
+}
+
+bool PipelineFactory::usesShader(const Material::ShaderEffect& effect, const std::string& shaderName)
+{
+    const auto& names = effect.shaderNames;
+    return names.vertex == shaderName || names.fragment == shaderName || names.geometry == shaderName
+           || names.tessEval == shaderName || names.tessCtrl == shaderName;
+}
+
 void PipelineFactory::destroy() noexcept
 {
     if (device) {
-        for (auto& [name, modules] : shaders) {
+        saveThread = std::jthread();
+        for (auto& [name, modules] : shaders)
             device.destroy(modules.first);
-            spvReflectDestroyShaderModule(&modules.second);
-        }
         try {
             saveCache();
         }
         catch (const std::exception& e) {
             logger->error("Failed to save pipeline cache: {}", e.what());
         }
+        for (auto& [thread, threadCache] : threadCaches)
+            device.destroy(threadCache);
+        threadCaches.clear();
         device.destroy(cache);
         device = nullptr;
     }
@@ -475,12 +837,13 @@ bool PipelineFactory::PipelineLayoutInfo::operator==(const PipelineFactory::Pipe
 
 USize PipelineFactory::PipelineLayoutInfo::Hash::operator()(const PipelineFactory::PipelineLayoutInfo& layoutInfo) const
 {
-    USize result = std::hash<USize>()(layoutInfo.sets.size()) ^ std::hash<USize>()(layoutInfo.pushConstants.size());
-    for (auto set : layoutInfo.sets)
-        result ^= std::hash<bool>()(set);
+    USize result = std::hash<USize>()(layoutInfo.pushConstants.size());
+    // Combined in order, the same layout in different sets is a different pipeline layout
+    for (vk::DescriptorSetLayout set : layoutInfo.sets)
+        hashCombine(result, set);
     for (auto& range : layoutInfo.pushConstants)
-        result ^= std::hash<vk::PushConstantRange>()(range);
-    result ^= std::hash<vk::Flags<vk::PipelineLayoutCreateFlagBits>>()(layoutInfo.flags);
+        hashCombine(result, range);
+    hashCombine(result, layoutInfo.flags);
     return result;
 }
 }   // namespace dragonfire
\ No newline at end of file
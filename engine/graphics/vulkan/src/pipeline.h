@@ -3,20 +3,30 @@
 //
 
 #pragma once
+#include "deletion_queue.h"
 #include "descriptor_set.h"
 #include "renderer.h"
+#include "shader_reflection.h"
 #include <allocators.h>
 #include <ankerl/unordered_dense.h>
+#include <atomic>
+#include <condition_variable>
 #include <material.h>
+#include <model.h>
 #include <shared_mutex>
-#include <spirv_reflect.h>
+#include <thread>
 
 namespace dragonfire {
 
 class PipelineFactory {
 public:
+    /**
+     * @brief Loads the pipeline cache of the device, which is discarded when the driver that wrote it differs
+     * The cache is saved every graphics.pipelineCacheSaveInterval seconds while pipelines are compiled, and on destroy.
+     */
     PipelineFactory(
             vk::Device device,
+            const vk::PhysicalDeviceProperties& deviceProperties,
             vk::SampleCountFlagBits multisamplingSamples,
             DescriptorLayoutManager* layoutManager,
             vk::DeviceSize maxDrawCount,
@@ -26,8 +36,21 @@ public:
     ~PipelineFactory() noexcept { destroy(); };
 
     void destroy() noexcept;
+    /// Merges the caches of every thread that compiled pipelines and writes the result if it grew since the last save
     void saveCache();
-    std::pair<vk::Pipeline, vk::PipelineLayout> createPipeline(const Material::ShaderEffect& effect);
+    std::pair<vk::Pipeline, vk::PipelineLayout> createPipeline(
+            const Material::ShaderEffect& effect,
+            Model::VertexFormat vertexFormat = Model::VertexFormat::FULL
+    );
+    /// Whether pipelines of the effect draw meshes and so need a variant for each vertex format
+    static bool hasMeshVertexInput(const Material::ShaderEffect& effect);
+    static bool usesShader(const Material::ShaderEffect& effect, const std::string& shaderName);
+    /**
+     * @brief Reloads the shader modules written since they were loaded
+     * Pipelines already created keep the old modules' code, the caller recreates the ones using them.
+     * @return Names of the reloaded shaders
+     */
+    std::vector<std::string> reloadChangedShaders();
     std::pair<vk::Pipeline, vk::PipelineLayout> createComputePipeline(
             const std::string& shaderName,
             vk::PipelineCreateFlagBits flags = {}
@@ -39,10 +62,11 @@ public:
     PipelineFactory& operator=(PipelineFactory&&) = delete;
 
 private:
+    /// Key of a built layout, the set layouts are shared by every set with the same bindings
     struct PipelineLayoutInfo {
-        std::array<bool, 4> sets{};
+        std::array<vk::DescriptorSetLayout, 4> sets{};
         vk::Flags<vk::PipelineLayoutCreateFlagBits> flags;
-        std::vector<vk::PushConstantRange, FrameAllocator<vk::PushConstantRange>> pushConstants;
+        std::vector<vk::PushConstantRange> pushConstants;
         bool operator==(const PipelineLayoutInfo& other) const;
 
         struct Hash {
@@ -52,9 +76,25 @@ private:
 
     std::shared_ptr<spdlog::logger> logger;
     vk::Device device;
+    vk::PhysicalDeviceProperties deviceProperties;
+    /// Only written by merging the thread caches into it, pipelines are compiled with the caller's thread cache
     vk::PipelineCache cache;
-    ankerl::unordered_dense::map<std::string, std::pair<vk::ShaderModule, SpvReflectShaderModule>> shaders;
-    ankerl::unordered_dense::map<USize, vk::PipelineLayout> builtLayouts;
+    /// One file per vendor and device, so switching gpus keeps the cache of each
+    std::string cachePath;
+    /// Loaded cache data, every thread cache starts out with it
+    std::vector<UInt8> cacheData;
+    USize savedCacheSize = 0;
+    /// Pipelines are compiled from several threads, each uses its own cache so they don't contend on one
+    ankerl::unordered_dense::map<std::thread::id, vk::PipelineCache> threadCaches;
+    std::mutex cacheMutex;
+    std::jthread saveThread;
+    std::condition_variable_any saveCondVar;
+    ankerl::unordered_dense::map<std::string, std::pair<vk::ShaderModule, ShaderReflection>> shaders;
+    /// Write time of each shader when it was last loaded, hot reloading looks for shaders written since
+    ankerl::unordered_dense::map<std::string, Int64> shaderWriteTimes;
+    /// Shared while creating pipelines, hot reloading replaces modules while holding it exclusively
+    std::shared_mutex shaderMutex;
+    ankerl::unordered_dense::map<PipelineLayoutInfo, vk::PipelineLayout, PipelineLayoutInfo::Hash> builtLayouts;
     DescriptorLayoutManager* layoutManager = nullptr;
     vk::SampleCountFlagBits multisamplingSamples = vk::SampleCountFlagBits::e1;
     std::vector<vk::RenderPass> renderPasses;
@@ -63,10 +103,17 @@ private:
     std::shared_mutex mutex;
 
     void loadShaders();
+    /// Loads the shader and its reflection sidecar, replacing the module if the shader was already loaded
+    void loadShader(const std::string& name);
+    /// Whether the cache data was written by this device and driver, according to its header
+    [[nodiscard]] bool isCacheCompatible(const std::vector<UInt8>& data) const;
+    vk::PipelineCache getThreadCache();
+    void saveCachePeriodically(const std::stop_token& stopToken, std::chrono::seconds interval);
     UInt getShaderStages(std::array<vk::PipelineShaderStageCreateInfo, 5>& infos, const Material::ShaderEffect& effect);
     vk::PipelineLayout getCreateLayout(const Material::ShaderEffect& effect);
+    /// Fills in the set layouts of the info, so shaders whose bindings changed get a layout of their own
     vk::PipelineLayout getCreateLayout(
-            const PipelineLayoutInfo& layoutInfo,
+            PipelineLayoutInfo& layoutInfo,
             std::array<DescriptorLayoutManager::LayoutInfo, 4>& setLayoutInfos
     );
     void loadLayoutReflectionData(
@@ -88,16 +135,57 @@ public:
     class PipelineLibrary {
     public:
         PipelineLibrary() = default;
-        Pipeline getPipeline(const std::string& name);
-        void loadMaterialFiles(const char* dir, Renderer* renderer, PipelineFactory& pipelineFactory);
-
+        /**
+         * @brief Gets the material's pipeline, compiling it on a pool thread the first time it is asked for
+         * Until it is ready the fallback material's pipeline is returned, draws with a null pipeline are skipped.
+         */
+        Pipeline getPipeline(const std::string& name, Model::VertexFormat format = Model::VertexFormat::FULL);
+        /**
+         * @brief Reads the material files, only the fallback material named by graphics.fallbackMaterial is
+         * compiled here and the rest are compiled once they are drawn
+         */
+        void loadMaterialFiles(const char* dir, Renderer* renderer, PipelineFactory* pipelineFactory);
+        /**
+         * @brief Swaps in the pipelines recreated since the last frame because their shaders were hot reloaded
+         * Shaders are only watched when graphics.shaderHotReload is enabled. Must be called at a frame boundary.
+         */
+        void applyReloadedPipelines(DeletionQueue& deletionQueue);
+        /// Shaders reloaded since the last call, the renderer rebuilds the compute pipelines it owns from them
+        std::vector<std::string> takeReloadedShaders();
+
+        /// Waits for compilations still running before destroying the pipelines
         void destroy();
 
     private:
+        struct MaterialPipeline {
+            std::string name;
+            Material::ShaderEffect effect;
+            Model::VertexFormat vertexFormat = Model::VertexFormat::FULL;
+            /// Only read once ready is set, which is never unset
+            Pipeline pipeline;
+            std::atomic<bool> ready = false, requested = false;
+        };
+
         vk::Device device;
-        ankerl::unordered_dense::map<std::string, Pipeline> pipelines;
-        ankerl::unordered_dense::set<vk::Pipeline> createdPipelines;
-        ankerl::unordered_dense::set<vk::PipelineLayout> createdLayouts;
+        PipelineFactory* factory = nullptr;
+        /// Only filled by loadMaterialFiles, so draws look pipelines up without a lock
+        ankerl::unordered_dense::map<std::string, std::unique_ptr<MaterialPipeline>> pipelines, compactPipelines;
+        MaterialPipeline *fallback = nullptr, *compactFallback = nullptr;
+        std::atomic<UInt32> compileJobs = 0;
+        std::mutex compileMutex;
+        std::condition_variable compileDone;
+        std::jthread reloadThread;
+        std::condition_variable_any reloadCondVar;
+        std::mutex reloadMutex;
+        /// Recreated by the reload thread, swapped in by applyReloadedPipelines
+        std::vector<std::pair<MaterialPipeline*, Pipeline>> reloadedPipelines;
+        std::vector<std::string> reloadedShaders;
+        /// Layouts replaced by reloads, a shader's bindings may have changed
+        ankerl::unordered_dense::set<vk::PipelineLayout> replacedLayouts;
+
+        void compile(MaterialPipeline& material);
+        /// Polls the shaders for changes and recreates the compiled pipelines using the changed ones
+        void watchShaders(const std::stop_token& stopToken);
     };
 
     [[nodiscard]] vk::Pipeline getPipeline() const { return pipeline; }
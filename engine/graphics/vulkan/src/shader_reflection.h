@@ -0,0 +1,109 @@
+//
+// Created by josh on 10/19/26.
+//
+
+#pragma once
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <types.h>
+#include <vector>
+
+namespace dragonfire {
+
+/**
+ * @brief Descriptor bindings, push constants and stage of a shader module, as needed to build pipeline layouts
+ * Written next to each compiled shader by the ShaderReflect build tool, so the engine doesn't reflect SPIR-V itself.
+ * The file is the header followed by the bindings and then the push constant ranges.
+ */
+struct ShaderReflection {
+    static constexpr UInt32 MAGIC = 0x52534644;   // "DFSR"
+    static constexpr UInt32 VERSION = 2;
+
+    struct Header {
+        UInt32 magic = MAGIC, version = VERSION;
+        /// Hash and size of the SPIR-V code the reflection was made from, a mismatch means the sidecar is stale
+        UInt64 codeHash = 0;
+        UInt32 codeSize = 0;
+        /// VkShaderStageFlagBits
+        UInt32 stage = 0;
+        UInt32 bindingCount = 0, pushConstantCount = 0;
+    };
+
+    struct Binding {
+        UInt32 set = 0, binding = 0;
+        /// VkDescriptorType
+        UInt32 descriptorType = 0;
+        UInt32 count = 0;
+        /// Bindings named "bindless" something are arrays sized by the renderer
+        UInt32 bindless = 0;
+    };
+
+    struct PushConstantRange {
+        UInt32 offset = 0, size = 0;
+    };
+
+    UInt32 stage = 0;
+    std::vector<Binding> bindings;
+    std::vector<PushConstantRange> pushConstants;
+
+    /// Throws std::runtime_error when the data is not reflection of the given SPIR-V code
+    static ShaderReflection read(std::span<const UInt8> data, std::span<const UInt8> code);
+    [[nodiscard]] std::vector<UInt8> write(std::span<const UInt8> code) const;
+    /// FNV-1a, which is stable across builds and platforms unlike std::hash
+    static UInt64 hashCode(std::span<const UInt8> code);
+};
+
+inline UInt64 ShaderReflection::hashCode(std::span<const UInt8> code)
+{
+    UInt64 hash = 0xcbf29ce484222325;
+    for (UInt8 byte : code) {
+        hash ^= byte;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+inline ShaderReflection ShaderReflection::read(std::span<const UInt8> data, std::span<const UInt8> code)
+{
+    Header header;
+    if (data.size() < sizeof(header))
+        throw std::runtime_error("Shader reflection is truncated");
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != MAGIC || header.version != VERSION)
+        throw std::runtime_error("Shader reflection has an unsupported format");
+    if (header.codeSize != code.size() || header.codeHash != hashCode(code))
+        throw std::runtime_error("Shader reflection is out of date with its shader");
+    const USize bindingBytes = header.bindingCount * sizeof(Binding);
+    const USize pushConstantBytes = header.pushConstantCount * sizeof(PushConstantRange);
+    if (data.size() < sizeof(header) + bindingBytes + pushConstantBytes)
+        throw std::runtime_error("Shader reflection is truncated");
+
+    ShaderReflection reflection;
+    reflection.stage = header.stage;
+    reflection.bindings.resize(header.bindingCount);
+    reflection.pushConstants.resize(header.pushConstantCount);
+    memcpy(reflection.bindings.data(), data.data() + sizeof(header), bindingBytes);
+    memcpy(reflection.pushConstants.data(), data.data() + sizeof(header) + bindingBytes, pushConstantBytes);
+    return reflection;
+}
+
+inline std::vector<UInt8> ShaderReflection::write(std::span<const UInt8> code) const
+{
+    Header header;
+    header.codeHash = hashCode(code);
+    header.codeSize = UInt32(code.size());
+    header.stage = stage;
+    header.bindingCount = UInt32(bindings.size());
+    header.pushConstantCount = UInt32(pushConstants.size());
+    const USize bindingBytes = bindings.size() * sizeof(Binding);
+    std::vector<UInt8> data(sizeof(header) + bindingBytes + pushConstants.size() * sizeof(PushConstantRange));
+    memcpy(data.data(), &header, sizeof(header));
+    memcpy(data.data() + sizeof(header), bindings.data(), bindingBytes);
+    memcpy(data.data() + sizeof(header) + bindingBytes,
+           pushConstants.data(),
+           pushConstants.size() * sizeof(PushConstantRange));
+    return data;
+}
+
+}   // namespace dragonfire
@@ -0,0 +1,216 @@
+//
+// Created by josh on 10/19/26.
+//
+
+#include "staging.h"
+#include <algorithm>
+#include <thread>
+
+namespace dragonfire {
+
+StagingRing::StagingRing(vk::Device device, VmaAllocator allocator, vk::DeviceSize size)
+    : device(device), allocator(allocator), capacity(size)
+{
+    buffer = createBuffer(size);
+    spdlog::get("Rendering")->info("Created staging ring of {} MiB", size >> 20);
+}
+
+Buffer StagingRing::createBuffer(vk::DeviceSize size) const
+{
+    return Buffer::Builder()
+            .withAllocator(allocator)
+            .withSize(size)
+            .withSharingMode(vk::SharingMode::eExclusive)
+            .withBufferUsage(vk::BufferUsageFlagBits::eTransferSrc)
+            .withUsage(VMA_MEMORY_USAGE_CPU_TO_GPU)
+            .withAllocationFlags(VMA_ALLOCATION_CREATE_MAPPED_BIT)
+            .withRequiredFlags(vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent)
+            .build();
+}
+
+StagingRing::Allocation StagingRing::allocate(vk::DeviceSize size, vk::DeviceSize alignment)
+{
+    if (size > capacity)
+        return allocateDedicated(size);
+    Allocation allocation;
+    while (true) {
+        std::unique_lock lock(mutex);
+        reclaim();
+        if (tryAllocate(size, alignment, allocation))
+            return allocation;
+        // The ring is full, so there is at least one region. Waiting happens without the lock so other
+        // threads can keep releasing their allocations
+        const Region& oldest = regions.front();
+        if (oldest.released) {
+            const vk::Semaphore semaphore = oldest.semaphore;
+            const UInt64 value = oldest.value;
+            lock.unlock();
+            vk::SemaphoreWaitInfo waitInfo{};
+            waitInfo.semaphoreCount = 1;
+            waitInfo.pSemaphores = &semaphore;
+            waitInfo.pValues = &value;
+            vk::resultCheck(device.waitSemaphores(waitInfo, UINT64_MAX), "Failed to wait for staging ring semaphore");
+        }
+        else {
+            std::vector<std::function<void()>> callbacks = flushCallbacks;
+            lock.unlock();
+            for (auto& callback : callbacks)
+                callback();
+            std::this_thread::yield();
+        }
+    }
+}
+
+StagingRing::Allocation StagingRing::allocateDedicated(vk::DeviceSize size)
+{
+    // Created without the lock, the ring keeps serving other uploads meanwhile
+    Buffer dedicated = createBuffer(size);
+    spdlog::get("Rendering")->debug("Upload of {} bytes exceeds the staging ring, it gets a buffer of its own", size);
+    Allocation allocation;
+    allocation.ptr = dedicated.getInfo().pMappedData;
+    allocation.buffer = dedicated;
+    allocation.offset = 0;
+
+    std::unique_lock lock(mutex);
+    allocation.id = nextDedicatedId++;
+    DedicatedBuffer& entry = dedicatedBuffers.emplace_back();
+    entry.id = allocation.id;
+    entry.buffer = std::move(dedicated);
+    entry.size = size;
+    return allocation;
+}
+
+bool StagingRing::tryAllocate(vk::DeviceSize size, vk::DeviceSize alignment, Allocation& out)
+{
+    vk::DeviceSize offset = 0;
+    if (!regions.empty()) {
+        // Free space is after the newest region up to the end of the buffer and before the oldest one,
+        // unless the newest region already wrapped around in which case only the gap between them is free
+        const vk::DeviceSize head = regions.front().begin;
+        const vk::DeviceSize tail = (regions.back().end + alignment - 1) / alignment * alignment;
+        const bool wrapped = regions.back().begin < head;
+        if (!wrapped && tail + size <= capacity)
+            offset = tail;
+        else if (!wrapped && size <= head)
+            offset = 0;
+        else if (wrapped && tail + size <= head)
+            offset = tail;
+        else
+            return false;
+    }
+    Region& region = regions.emplace_back();
+    region.id = nextId++;
+    region.begin = offset;
+    region.end = offset + size;
+
+    out.ptr = static_cast<char*>(buffer.getInfo().pMappedData) + offset;
+    out.buffer = buffer;
+    out.offset = offset;
+    out.id = region.id;
+    return true;
+}
+
+void StagingRing::release(UInt64 id, vk::Semaphore semaphore, UInt64 value)
+{
+    std::unique_lock lock(mutex);
+    if (id & DEDICATED_ID) {
+        auto it = std::ranges::find(dedicatedBuffers, id, &DedicatedBuffer::id);
+        it->semaphore = semaphore;
+        it->value = value;
+        it->released = true;
+        return;
+    }
+    // Ids are handed out in order and regions are only removed from the front
+    Region& region = regions.at(id - regions.front().id);
+    region.semaphore = semaphore;
+    region.value = value;
+    region.released = true;
+}
+
+void StagingRing::reclaim()
+{
+    while (!regions.empty()) {
+        const Region& region = regions.front();
+        if (!region.released)
+            break;
+        if (region.value != 0 && device.getSemaphoreCounterValue(region.semaphore) < region.value)
+            break;
+        if (region.value != 0)
+            uploadedBytes += region.end - region.begin;
+        regions.pop_front();
+    }
+    // Dedicated buffers don't block the ring, so each is destroyed as soon as its own upload finished
+    std::erase_if(dedicatedBuffers, [&](DedicatedBuffer& dedicated) {
+        if (!dedicated.released
+            || (dedicated.value != 0 && device.getSemaphoreCounterValue(dedicated.semaphore) < dedicated.value))
+            return false;
+        if (dedicated.value != 0)
+            uploadedBytes += dedicated.size;
+        dedicated.buffer.destroy();
+        return true;
+    });
+}
+
+UInt64 StagingRing::getUploadedBytes()
+{
+    std::unique_lock lock(mutex);
+    reclaim();
+    return uploadedBytes;
+}
+
+void StagingRing::addFlushCallback(std::function<void()>&& callback)
+{
+    std::unique_lock lock(mutex);
+    flushCallbacks.push_back(std::move(callback));
+}
+
+void StagingRing::destroy() noexcept
+{
+    if (device) {
+        regions.clear();
+        dedicatedBuffers.clear();
+        flushCallbacks.clear();
+        buffer.destroy();
+        device = nullptr;
+    }
+}
+
+StagingRing::StagingRing(StagingRing&& other) noexcept
+{
+    if (this != &other) {
+        std::unique_lock l1(mutex), l2(other.mutex);
+        device = other.device;
+        other.device = nullptr;
+        allocator = other.allocator;
+        buffer = std::move(other.buffer);
+        capacity = other.capacity;
+        regions = std::move(other.regions);
+        dedicatedBuffers = std::move(other.dedicatedBuffers);
+        nextDedicatedId = other.nextDedicatedId;
+        flushCallbacks = std::move(other.flushCallbacks);
+        nextId = other.nextId;
+        uploadedBytes = other.uploadedBytes;
+    }
+}
+
+StagingRing& StagingRing::operator=(StagingRing&& other) noexcept
+{
+    if (this != &other) {
+        std::unique_lock l1(mutex), l2(other.mutex);
+        destroy();
+        device = other.device;
+        other.device = nullptr;
+        allocator = other.allocator;
+        buffer = std::move(other.buffer);
+        capacity = other.capacity;
+        regions = std::move(other.regions);
+        dedicatedBuffers = std::move(other.dedicatedBuffers);
+        nextDedicatedId = other.nextDedicatedId;
+        flushCallbacks = std::move(other.flushCallbacks);
+        nextId = other.nextId;
+        uploadedBytes = other.uploadedBytes;
+    }
+    return *this;
+}
+
+}   // namespace dragonfire
@@ -0,0 +1,100 @@
+//
+// Created by josh on 10/19/26.
+//
+
+#pragma once
+#include "allocation.h"
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace dragonfire {
+
+/**
+ * @brief Persistently mapped staging buffer shared by every gpu upload
+ * Space is handed out in allocation order and reclaimed once the submission that read it
+ * signals its semaphore, so uploads from any number of threads can be in flight at once.
+ * Uploads larger than the ring get a buffer of their own, which is destroyed the same way.
+ */
+class StagingRing {
+public:
+    struct Allocation {
+        void* ptr = nullptr;
+        /// Copies read from this buffer, the ring's own buffer unless the upload didn't fit in it
+        vk::Buffer buffer;
+        vk::DeviceSize offset = 0;
+        UInt64 id = 0;
+    };
+
+    StagingRing() = default;
+    StagingRing(vk::Device device, VmaAllocator allocator, vk::DeviceSize size);
+
+    /**
+     * @brief Reserves a range of the ring, waiting for earlier uploads to finish if it is full
+     * The memory can be written from any thread, it stays reserved until it is released.
+     */
+    Allocation allocate(vk::DeviceSize size, vk::DeviceSize alignment = 16);
+    /// Allows the allocation to be reused once the semaphore reaches the value
+    void release(UInt64 id, vk::Semaphore semaphore, UInt64 value);
+    /// Called when the ring is full of allocations that were never released, so they can be submitted
+    void addFlushCallback(std::function<void()>&& callback);
+
+    /**
+     * @brief Total number of bytes whose upload finished since the ring was created
+     * Counted once the semaphore of their release reached its value, allocations released without an upload
+     * don't count. Reclaims finished regions first, so the count doesn't depend on how often the ring allocates.
+     */
+    [[nodiscard]] UInt64 getUploadedBytes();
+
+    [[nodiscard]] vk::DeviceSize getCapacity() const { return capacity; }
+
+    void destroy() noexcept;
+
+    ~StagingRing() noexcept { destroy(); }
+
+    StagingRing(StagingRing&) = delete;
+    StagingRing& operator=(StagingRing&) = delete;
+    StagingRing(StagingRing&& other) noexcept;
+    StagingRing& operator=(StagingRing&& other) noexcept;
+
+private:
+    struct Region {
+        UInt64 id = 0;
+        vk::DeviceSize begin = 0, end = 0;
+        vk::Semaphore semaphore;
+        UInt64 value = 0;
+        bool released = false;
+    };
+
+    /// Staging of an upload larger than the ring
+    struct DedicatedBuffer {
+        UInt64 id = 0;
+        Buffer buffer;
+        vk::DeviceSize size = 0;
+        vk::Semaphore semaphore;
+        UInt64 value = 0;
+        bool released = false;
+    };
+
+    /// Set in the ids of dedicated buffers, which are kept apart from the ring's regions
+    static constexpr UInt64 DEDICATED_ID = 1ull << 63;
+
+    vk::Device device;
+    VmaAllocator allocator = nullptr;
+    Buffer buffer;
+    vk::DeviceSize capacity = 0;
+    std::deque<Region> regions;
+    std::vector<DedicatedBuffer> dedicatedBuffers;
+    UInt64 nextDedicatedId = DEDICATED_ID;
+    std::vector<std::function<void()>> flushCallbacks;
+    UInt64 nextId = 1;
+    UInt64 uploadedBytes = 0;
+    std::mutex mutex;
+
+    [[nodiscard]] Buffer createBuffer(vk::DeviceSize size) const;
+    Allocation allocateDedicated(vk::DeviceSize size);
+    bool tryAllocate(vk::DeviceSize size, vk::DeviceSize alignment, Allocation& out);
+    void reclaim();
+};
+
+}   // namespace dragonfire
@@ -3,6 +3,10 @@
 //
 
 #include "texture.h"
+#include <algorithm>
+#include <bit>
+#include <config.h>
+#include <utility.h>
 #if defined(_MSC_VER) || defined(__MINGW32__)
     #include <malloc.h>
 #else
@@ -15,10 +19,27 @@ static vk::Filter getFilter(Material::TextureFilterMode mode)
 {
     switch (mode) {
         default: return vk::Filter::eLinear;
-        case Material::TextureFilterMode::NEAREST: return vk::Filter::eNearest;
+        case Material::TextureFilterMode::NEAREST:
+        case Material::TextureFilterMode::NEAREST_MIPMAP_NEAREST:
+        case Material::TextureFilterMode::NEAREST_MIPMAP_LINEAR: return vk::Filter::eNearest;
     }
 }
 
+static vk::SamplerMipmapMode getMipmapMode(Material::TextureFilterMode mode)
+{
+    switch (mode) {
+        default: return vk::SamplerMipmapMode::eLinear;
+        case Material::TextureFilterMode::NEAREST_MIPMAP_NEAREST:
+        case Material::TextureFilterMode::LINEAR_MIPMAP_NEAREST: return vk::SamplerMipmapMode::eNearest;
+    }
+}
+
+/// Minification filters that explicitly ask for the base level only
+static bool usesMipmaps(Material::TextureFilterMode mode)
+{
+    return mode != Material::TextureFilterMode::NEAREST && mode != Material::TextureFilterMode::LINEAR;
+}
+
 static vk::SamplerAddressMode getAddressMode(Material::TextureWrapMode mode)
 {
     switch (mode) {
@@ -29,104 +50,250 @@ static vk::SamplerAddressMode getAddressMode(Material::TextureWrapMode mode)
     }
 }
 
-UInt32 Texture::TextureRegistry::loadTexture(
-        const std::string& name,
-        const void* data,
-        UInt32 width,
-        UInt32 height,
-        UInt bitDepth,
-        UInt pixelSize,
-        Material::TextureWrapMode wrapS,
-        Material::TextureWrapMode wrapT,
-        Material::TextureFilterMode minFilter,
-        Material::TextureFilterMode magFilter
-)
+std::vector<UInt32> Texture::TextureRegistry::loadTextures(std::span<Renderer::TextureUpload> uploads)
 {
-    const USize size = width * height * pixelSize * 4;
+    std::vector<UInt32> ids(uploads.size());
+    std::vector<USize> stagedIndices;
+    // Batches are kept well below the staging ring's size, their staging is only released once they are submitted
+    const vk::DeviceSize maxBatchBytes = stagingRing->getCapacity() / 4;
+    for (USize i = 0; i < uploads.size(); i++) {
+        {
+            std::unique_lock lock(mutex);
+            auto it = textureIds.find(uploads[i].name);
+            if (it != textureIds.end()) {
+                ids[i] = it->second;
+                continue;
+            }
+        }
+        // Reserved before allocating, so the textures staged by every thread together stay within a batch
+        const vk::DeviceSize size = getStagingSize(uploads[i]);
+        {
+            std::unique_lock lock(pendingMutex);
+            while (reservedBytes != 0 && reservedBytes + size > maxBatchBytes) {
+                if (!pendingTextures.empty())
+                    submitPendingLocked();
+                else
+                    pendingStaged.wait(lock);
+            }
+            reservedBytes += size;
+        }
+        // Filled outside the lock so textures loaded on different threads are staged in parallel
+        StagedTexture staged;
+        try {
+            staged = stageTexture(uploads[i]);
+        }
+        catch (...) {
+            std::unique_lock lock(pendingMutex);
+            reservedBytes -= size;
+            pendingStaged.notify_all();
+            throw;
+        }
+        {
+            std::unique_lock lock(pendingMutex);
+            pendingTextures.push_back(std::move(staged));
+        }
+        pendingStaged.notify_all();
+        stagedIndices.push_back(i);
+    }
+    if (stagedIndices.empty())
+        return ids;
+
+    // Whichever thread submitted the textures staged here did so holding the pending lock, so they exist now
+    submitPending();
     std::unique_lock lock(mutex);
-    if (textures.contains(name))
-        return textures[name].id;
-    Image imageTexture =
-            Image::Builder()
-                    .withAllocator(allocator)
-                    .withSharingMode(vk::SharingMode::eExclusive)
-                    .withExtent(vk::Extent2D{width, height})
-                    .withImageType(vk::ImageType::e2D)
-                    .withImageUsage(vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled)
-                    .withMipLevels(1)
-                    .withArrayLayers(1)
-                    .withFormat(vk::Format::eR8G8B8A8Srgb)
-                    .withTiling(vk::ImageTiling::eOptimal)
-                    .withInitialLayout(vk::ImageLayout::eUndefined)
-                    .withSamples(vk::SampleCountFlagBits::e1)
-                    .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
-                    .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
-                    .build();
-    void* ptr = getStagingPtr(size);
-    memcpy(ptr, data, size);
-
-    device.resetCommandPool(pool);
-    vk::CommandBufferBeginInfo beginInfo{};
-    beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
-    cmd.begin(beginInfo);
+    for (USize i : stagedIndices) {
+        auto it = textureIds.find(uploads[i].name);
+        ids[i] = it != textureIds.end() ? it->second : 0;
+    }
+    return ids;
+}
+
+void Texture::TextureRegistry::submitPending()
+{
+    std::unique_lock lock(pendingMutex);
+    submitPendingLocked();
+}
 
-    vk::ImageMemoryBarrier barrier{};
-    barrier.image = imageTexture;
-    barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
-    barrier.dstQueueFamilyIndex = barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.oldLayout = vk::ImageLayout::eUndefined;
-    barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
-    barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-
-    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, barrier);
-
-    vk::BufferImageCopy cpy;
-    cpy.bufferOffset = 0;
-    cpy.bufferRowLength = 0;
-    cpy.bufferImageHeight = 0;
-    cpy.imageSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
-    cpy.imageSubresource.mipLevel = 0;
-    cpy.imageSubresource.baseArrayLayer = 0;
-    cpy.imageSubresource.layerCount = 1;
-    cpy.imageOffset = vk::Offset3D{0, 0, 0};
-    cpy.imageExtent = vk::Extent3D{width, height, 1};
-
-    cmd.copyBufferToImage(stagingBuffer, imageTexture, vk::ImageLayout::eTransferDstOptimal, cpy);
-
-    barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
-    barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
-    barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
-    barrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+void Texture::TextureRegistry::submitPendingLocked()
+{
+    if (pendingTextures.empty())
+        return;
+    std::vector<StagedTexture> batch = std::move(pendingTextures);
+    pendingTextures.clear();
+    for (const StagedTexture& staged : batch)
+        reservedBytes -= staged.size;
+    submitTextures(batch);
+    pendingStaged.notify_all();
+}
 
-    cmd.pipelineBarrier(
-            vk::PipelineStageFlagBits::eTransfer,
-            vk::PipelineStageFlagBits::eFragmentShader,
-            {},
-            {},
-            {},
-            barrier
-    );
+void Texture::TextureRegistry::setDescriptorTargets(std::vector<DescriptorTarget> targets)
+{
+    std::unique_lock lock(mutex);
+    descriptorTargets = std::move(targets);
+}
 
-    cmd.end();
+static vk::Format getCompressedFormat(CompressedTexture::Format format)
+{
+    switch (format) {
+        case CompressedTexture::Format::BC1_SRGB: return vk::Format::eBc1RgbSrgbBlock;
+        case CompressedTexture::Format::BC5_UNORM: return vk::Format::eBc5UnormBlock;
+        case CompressedTexture::Format::BC7_SRGB: return vk::Format::eBc7SrgbBlock;
+    }
+    crash("Unreachable");
+}
 
-    vk::SubmitInfo submitInfo{};
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &cmd;
-    graphicsQueue.submit(submitInfo, fence);
+/// Copies of the levels of a compressed texture from the given one on, staged contiguously from the buffer offset
+static std::vector<vk::BufferImageCopy>
+getLevelCopies(const CompressedTexture& texture, UInt32 first, vk::DeviceSize offset)
+{
+    std::vector<vk::BufferImageCopy> copies(texture.levels.size() - first);
+    for (USize i = 0; i < copies.size(); i++) {
+        const CompressedTexture::Level& level = texture.levels[first + i];
+        vk::BufferImageCopy& cpy = copies[i];
+        cpy.bufferOffset = offset + level.offset - texture.levels[first].offset;
+        cpy.bufferRowLength = 0;
+        cpy.bufferImageHeight = 0;
+        cpy.imageSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
+        cpy.imageSubresource.mipLevel = i;
+        cpy.imageSubresource.baseArrayLayer = 0;
+        cpy.imageSubresource.layerCount = 1;
+        cpy.imageOffset = vk::Offset3D{0, 0, 0};
+        cpy.imageExtent = vk::Extent3D{level.width, level.height, 1};
+    }
+    return copies;
+}
+
+UInt32 Texture::TextureRegistry::getBaseLevel(const CompressedTexture& texture) const
+{
+    // Levels are stored largest first, so the ones up to the streaming base size are the tail of the data
+    UInt32 baseLevel = 0;
+    while (textureBudget > 0 && baseLevel + 1 < texture.levels.size()
+           && std::max(texture.levels[baseLevel].width, texture.levels[baseLevel].height) > streamingBaseSize)
+        baseLevel++;
+    return baseLevel;
+}
+
+vk::DeviceSize Texture::TextureRegistry::getStagingSize(const Renderer::TextureUpload& upload) const
+{
+    if (!upload.compressed)
+        return vk::DeviceSize(upload.width) * upload.height * upload.pixelSize * 4;
+    const CompressedTexture& texture = *upload.compressed;
+    return texture.data.size() - texture.levels[getBaseLevel(texture)].offset;
+}
+
+Texture::TextureRegistry::StagedTexture Texture::TextureRegistry::stageTexture(Renderer::TextureUpload& upload)
+{
+    StagedTexture staged;
+    staged.name = upload.name;
+    staged.sampler = SamplerKey{upload.wrapS, upload.wrapT, upload.minFilter, upload.magFilter};
+    ImageUpload& image = staged.upload;
+    if (!upload.compressed) {
+        staged.size = getStagingSize(upload);
+        StagingRing::Allocation staging = stagingRing->allocate(staged.size);
+        memcpy(staging.ptr, upload.pixels, staged.size);
+        staged.stagingId = staging.id;
+        image.staging = staging.buffer;
+
+        vk::BufferImageCopy& cpy = image.copies.emplace_back();
+        cpy.bufferOffset = staging.offset;
+        cpy.bufferRowLength = 0;
+        cpy.bufferImageHeight = 0;
+        cpy.imageSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
+        cpy.imageSubresource.mipLevel = 0;
+        cpy.imageSubresource.baseArrayLayer = 0;
+        cpy.imageSubresource.layerCount = 1;
+        cpy.imageOffset = vk::Offset3D{0, 0, 0};
+        cpy.imageExtent = vk::Extent3D{upload.width, upload.height, 1};
+
+        // Every level down to 1x1 is generated by blitting each level from the previous one
+        image.format = vk::Format::eR8G8B8A8Srgb;
+        image.extent = vk::Extent2D{upload.width, upload.height};
+        image.mipLevels = generateMipmaps ? UInt32(std::bit_width(std::max(upload.width, upload.height))) : 1;
+        return staged;
+    }
+
+    CompressedTexture& texture = *upload.compressed;
+    const UInt32 baseLevel = getBaseLevel(texture);
+    const CompressedTexture::Level& base = texture.levels[baseLevel];
+
+    // Staging is 16 byte aligned and level offsets are multiples of the block size, so every copy starts on a block
+    staged.size = getStagingSize(upload);
+    StagingRing::Allocation staging = stagingRing->allocate(staged.size);
+    memcpy(staging.ptr, texture.data.data() + base.offset, staged.size);
+    staged.stagingId = staging.id;
+    image.staging = staging.buffer;
+    image.copies = getLevelCopies(texture, baseLevel, staging.offset);
+    image.format = getCompressedFormat(texture.format);
+    image.extent = vk::Extent2D{base.width, base.height};
+    image.mipLevels = UInt32(image.copies.size());
+
+    if (baseLevel > 0) {
+        staged.streamed.residentLevel = staged.streamed.targetLevel = staged.streamed.baseLevel = baseLevel;
+        staged.streamed.source = std::make_shared<const CompressedTexture>(std::move(texture));
+        upload.compressed.reset();
+    }
+    return staged;
+}
+
+void Texture::TextureRegistry::submitTextures(std::span<StagedTexture> batch)
+{
+    std::unique_lock lock(mutex);
+    std::vector<ImageUpload> images;
+    std::vector<StagedTexture*> uploaded;
+    for (StagedTexture& staged : batch) {
+        // Textures loaded meanwhile, or twice in the batch, keep the first upload
+        if (textureIds.contains(staged.name)
+            || std::ranges::any_of(uploaded, [&](const StagedTexture* t) { return t->name == staged.name; }))
+            continue;
+        images.push_back(std::move(staged.upload));
+        uploaded.push_back(&staged);
+    }
+    // Batches can be submitted by a staging ring flush on any thread, so this can't throw at the thread loading them
+    if (textures.size() + uploaded.size() > maxTextureCount) {
+        spdlog::get("Rendering")->error(
+                "Loading {} textures exceeds the limit of {} textures, they are left untextured",
+                uploaded.size(),
+                maxTextureCount
+        );
+        images.clear();
+        uploaded.clear();
+    }
+
+    const UInt64 value = images.empty() ? 0 : uploadImages(images);
+    for (const StagedTexture& staged : batch)
+        stagingRing->release(staged.stagingId, images.empty() ? nullptr : uploadTimeline, value);
 
-    vk::resultCheck(device.waitForFences(fence, true, UINT64_MAX), "Fence wait failed");
-    device.resetFences(fence);
-    UInt32 imageId = imageIndex++;
+    std::vector<UInt32> created;
+    created.reserve(uploaded.size());
+    for (USize i = 0; i < uploaded.size(); i++) {
+        StagedTexture& staged = *uploaded[i];
+        const UInt32 imageId = UInt32(textures.size());
+        const UInt32 samplerIndex = getSampler(staged.sampler);
+        static_cast<UInt32*>(samplerIndices.getInfo().pMappedData)[imageId] = samplerIndex;
+        textures.emplace_back(imageId, std::move(images[i].image), images[i].mipLevels, samplerIndex, device);
+        textureIds[staged.name] = imageId;
+        if (staged.streamed.source)
+            streamedTextures[imageId] = std::move(staged.streamed);
+        created.push_back(imageId);
+    }
+    // Written before the loading thread gets the ids back, whichever thread submitted the batch
+    for (const DescriptorTarget& target : descriptorTargets)
+        writeTextureDescriptors(created, target);
+}
 
+UInt32 Texture::TextureRegistry::getSampler(const SamplerKey& key)
+{
+    if (auto it = samplerCache.find(key); it != samplerCache.end())
+        return it->second;
+    if (samplers.size() >= MAX_SAMPLERS) {
+        spdlog::get("Rendering")->warn("Sampler cache is full, the texture uses the first sampler instead");
+        return 0;
+    }
     vk::SamplerCreateInfo samplerInfo{};
-    samplerInfo.magFilter = getFilter(magFilter);
-    samplerInfo.minFilter = getFilter(minFilter);
-    samplerInfo.addressModeU = getAddressMode(wrapS);
-    samplerInfo.addressModeV = getAddressMode(wrapT);
+    samplerInfo.magFilter = getFilter(key.magFilter);
+    samplerInfo.minFilter = getFilter(key.minFilter);
+    samplerInfo.addressModeU = getAddressMode(key.wrapS);
+    samplerInfo.addressModeV = getAddressMode(key.wrapT);
     samplerInfo.addressModeW = vk::SamplerAddressMode::eRepeat;
     samplerInfo.anisotropyEnable = true;
     samplerInfo.maxAnisotropy = maxSamplerAnisotropy;
@@ -134,25 +301,181 @@ UInt32 Texture::TextureRegistry::loadTexture(
     samplerInfo.unnormalizedCoordinates = false;
     samplerInfo.compareEnable = false;
     samplerInfo.compareOp = vk::CompareOp::eAlways;
-    samplerInfo.mipmapMode = vk::SamplerMipmapMode::eLinear;
-    samplerInfo.mipLodBias = 0;
+    samplerInfo.mipmapMode = getMipmapMode(key.minFilter);
+    samplerInfo.mipLodBias = mipLodBias;
     samplerInfo.minLod = 0;
-    samplerInfo.maxLod = 0;
+    // Not clamped to a level count, the sampler is shared by textures with different mip chains
+    samplerInfo.maxLod = usesMipmaps(key.minFilter) ? VK_LOD_CLAMP_NONE : 0.0f;
+
+    const UInt32 index = samplers.size();
+    samplers.push_back(device.createSampler(samplerInfo));
+    samplerCache[key] = index;
+    spdlog::get("Rendering")->debug("Created sampler {} of the sampler cache", index);
+    return index;
+}
+
+USize Texture::TextureRegistry::SamplerKey::Hash::operator()(const SamplerKey& key) const
+{
+    return hashAll(key.wrapS, key.wrapT, key.minFilter, key.magFilter);
+}
 
-    vk::Sampler s = device.createSampler(samplerInfo);
+UInt64 Texture::TextureRegistry::uploadImages(std::span<ImageUpload> images)
+{
+    // Every image goes through the same barriers, which are issued once for the whole batch
+    std::vector<vk::ImageMemoryBarrier> barriers(images.size());
+    for (USize i = 0; i < images.size(); i++) {
+        ImageUpload& upload = images[i];
+        vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled;
+        if (upload.copies.size() < upload.mipLevels)
+            usage |= vk::ImageUsageFlagBits::eTransferSrc;
+        upload.image = Image::Builder()
+                               .withAllocator(allocator)
+                               .withSharingMode(vk::SharingMode::eExclusive)
+                               .withExtent(upload.extent)
+                               .withImageType(vk::ImageType::e2D)
+                               .withImageUsage(usage)
+                               .withMipLevels(upload.mipLevels)
+                               .withArrayLayers(1)
+                               .withFormat(upload.format)
+                               .withTiling(vk::ImageTiling::eOptimal)
+                               .withInitialLayout(vk::ImageLayout::eUndefined)
+                               .withSamples(vk::SampleCountFlagBits::e1)
+                               .withRequiredFlags(vk::MemoryPropertyFlagBits::eDeviceLocal)
+                               .withUsage(VMA_MEMORY_USAGE_GPU_ONLY)
+                               .build();
+        vk::ImageMemoryBarrier& barrier = barriers[i];
+        barrier.image = upload.image;
+        barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+        barrier.dstQueueFamilyIndex = barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.oldLayout = vk::ImageLayout::eUndefined;
+        barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
+        barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = upload.mipLevels;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+    }
+    vk::CommandBuffer cmd = getCommandBuffer();
+    vk::CommandBufferBeginInfo beginInfo{};
+    beginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+    cmd.begin(beginInfo);
 
-    textures[name] = Texture(imageId, std::move(imageTexture), s, device);
+    cmd.pipelineBarrier(
+            vk::PipelineStageFlagBits::eTopOfPipe,
+            vk::PipelineStageFlagBits::eTransfer,
+            {},
+            {},
+            {},
+            barriers
+    );
 
-    return imageId;
+    for (USize i = 0; i < images.size(); i++) {
+        const ImageUpload& upload = images[i];
+        const UInt32 stagedLevels = upload.copies.size();
+        const Image& image = upload.image;
+        cmd.copyBufferToImage(upload.staging, image, vk::ImageLayout::eTransferDstOptimal, upload.copies);
+
+        // Levels that weren't staged are blitted from the previous level, which then is final
+        Int32 levelWidth = std::max(Int32(upload.extent.width >> (stagedLevels - 1)), 1);
+        Int32 levelHeight = std::max(Int32(upload.extent.height >> (stagedLevels - 1)), 1);
+        vk::ImageMemoryBarrier barrier = barriers[i];
+        barrier.subresourceRange.levelCount = 1;
+        for (UInt32 level = stagedLevels; level < upload.mipLevels; level++) {
+            barrier.subresourceRange.baseMipLevel = level - 1;
+            barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+            barrier.dstAccessMask = vk::AccessFlagBits::eTransferRead;
+            barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+            barrier.newLayout = vk::ImageLayout::eTransferSrcOptimal;
+            cmd.pipelineBarrier(
+                    vk::PipelineStageFlagBits::eTransfer,
+                    vk::PipelineStageFlagBits::eTransfer,
+                    {},
+                    {},
+                    {},
+                    barrier
+            );
+
+            vk::ImageBlit blit{};
+            blit.srcSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
+            blit.srcSubresource.mipLevel = level - 1;
+            blit.srcSubresource.layerCount = 1;
+            blit.srcOffsets[1] = vk::Offset3D{levelWidth, levelHeight, 1};
+            levelWidth = std::max(levelWidth / 2, 1);
+            levelHeight = std::max(levelHeight / 2, 1);
+            blit.dstSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
+            blit.dstSubresource.mipLevel = level;
+            blit.dstSubresource.layerCount = 1;
+            blit.dstOffsets[1] = vk::Offset3D{levelWidth, levelHeight, 1};
+            cmd.blitImage(
+                    image,
+                    vk::ImageLayout::eTransferSrcOptimal,
+                    image,
+                    vk::ImageLayout::eTransferDstOptimal,
+                    blit,
+                    vk::Filter::eLinear
+            );
+
+            barrier.srcAccessMask = vk::AccessFlagBits::eTransferRead;
+            barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+            barrier.oldLayout = vk::ImageLayout::eTransferSrcOptimal;
+            barrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+            cmd.pipelineBarrier(
+                    vk::PipelineStageFlagBits::eTransfer,
+                    vk::PipelineStageFlagBits::eFragmentShader,
+                    {},
+                    {},
+                    {},
+                    barrier
+            );
+        }
+
+        // Either every level was staged or only the first one was, so the rest are still transfer destinations
+        vk::ImageMemoryBarrier& finalBarrier = barriers[i];
+        finalBarrier.subresourceRange.baseMipLevel = stagedLevels < upload.mipLevels ? upload.mipLevels - 1 : 0;
+        finalBarrier.subresourceRange.levelCount = upload.mipLevels - finalBarrier.subresourceRange.baseMipLevel;
+        finalBarrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        finalBarrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+        finalBarrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+        finalBarrier.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+    }
+
+    cmd.pipelineBarrier(
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eFragmentShader,
+            {},
+            {},
+            {},
+            barriers
+    );
+
+    cmd.end();
+
+    // Frames that sample the textures are submitted to the same queue after this, the barrier above orders them
+    const UInt64 value = nextUploadValue++;
+    vk::TimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &value;
+    vk::SubmitInfo submitInfo{};
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cmd;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &uploadTimeline;
+    submitInfo.pNext = &timelineInfo;
+    {
+        std::unique_lock queueLock(*queueMutex);
+        graphicsQueue.submit(submitInfo);
+    }
+    submittedCommands.emplace_back(value, cmd);
+    return value;
 }
 
-Texture::Texture(UInt32 id, Image&& image, vk::Sampler sampler, vk::Device device)
-    : id(id), sampler(sampler), image(std::move(image))
+Texture::Texture(UInt32 id, Image&& image, UInt32 mipLevels, UInt32 samplerIndex, vk::Device device)
+    : id(id), samplerIndex(samplerIndex), image(std::move(image))
 {
     vk::ImageSubresourceRange subRange{};
     subRange.aspectMask = vk::ImageAspectFlagBits::eColor;
     subRange.baseMipLevel = 0;
-    subRange.levelCount = 1;
+    subRange.levelCount = mipLevels;
     subRange.baseArrayLayer = 0;
     subRange.layerCount = 1;
     view = this->image.createView(device, subRange);
@@ -163,63 +486,155 @@ Texture::TextureRegistry::TextureRegistry(
         VmaAllocator allocator,
         vk::Queue graphicsQueue,
         UInt32 graphicsFamily,
-        float maxSamplerAnisotropy
+        float maxSamplerAnisotropy,
+        bool generateMipmaps,
+        UInt32 maxTextureCount,
+        std::mutex* queueMutex,
+        StagingRing* stagingRing
 )
-    : allocator(allocator), device(device), graphicsQueue(graphicsQueue), maxSamplerAnisotropy(maxSamplerAnisotropy)
-{
-    stagingBuffer = Buffer::Builder()
-                            .withAllocator(allocator)
-                            .withSize(1 << 12)
-                            .withSharingMode(vk::SharingMode::eExclusive)
-                            .withBufferUsage(vk::BufferUsageFlagBits::eTransferSrc)
-                            .withUsage(VMA_MEMORY_USAGE_CPU_TO_GPU)
-                            .withAllocationFlags(VMA_ALLOCATION_CREATE_MAPPED_BIT)
-                            .withRequiredFlags(
-                                    vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent
-                            )
-                            .build();
+    : allocator(allocator),
+      stagingRing(stagingRing),
+      device(device),
+      graphicsQueue(graphicsQueue),
+      queueMutex(queueMutex),
+      maxSamplerAnisotropy(maxSamplerAnisotropy),
+      generateMipmaps(generateMipmaps),
+      maxTextureCount(maxTextureCount)
+{
+    try {
+        mipLodBias = float(Config::INSTANCE.get<double>("graphics.textureLodBias"));
+    }
+    catch (...) {
+        mipLodBias = 0.0f;
+    }
+    try {
+        textureBudget = vk::DeviceSize(Config::INSTANCE.get<Int64>("graphics.textureBudget")) * 1024 * 1024;
+    }
+    catch (...) {
+        textureBudget = 512ull * 1024 * 1024;
+    }
+    try {
+        streamingBaseSize = UInt32(Config::INSTANCE.get<Int64>("graphics.textureStreamingBaseSize"));
+    }
+    catch (...) {
+        streamingBaseSize = 128;
+    }
+    // Streamed textures are budgeted against the largest device local heap, which is where they are allocated
+    const VkPhysicalDeviceMemoryProperties* memoryProperties;
+    vmaGetMemoryProperties(allocator, &memoryProperties);
+    for (UInt32 i = 0; i < memoryProperties->memoryHeapCount; i++) {
+        const VkMemoryHeap& heap = memoryProperties->memoryHeaps[i];
+        if (heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT
+            && heap.size > memoryProperties->memoryHeaps[deviceLocalHeap].size)
+            deviceLocalHeap = i;
+    }
+    if (!generateMipmaps)
+        spdlog::get("Rendering")->warn("Texture format can't be blitted with linear filtering, mipmaps are disabled");
     vk::CommandPoolCreateInfo poolCreateInfo{};
     poolCreateInfo.queueFamilyIndex = graphicsFamily;
+    poolCreateInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
     pool = device.createCommandPool(poolCreateInfo);
+
+    vk::SemaphoreTypeCreateInfo timelineInfo{};
+    timelineInfo.semaphoreType = vk::SemaphoreType::eTimeline;
+    timelineInfo.initialValue = 0;
+    vk::SemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.pNext = &timelineInfo;
+    uploadTimeline = device.createSemaphore(semaphoreInfo);
+
+    samplerIndices = Buffer::Builder()
+                             .withAllocator(allocator)
+                             .withBufferUsage(vk::BufferUsageFlagBits::eStorageBuffer)
+                             .withSize(maxTextureCount * sizeof(UInt32))
+                             .withSharingMode(vk::SharingMode::eExclusive)
+                             .withUsage(VMA_MEMORY_USAGE_CPU_TO_GPU)
+                             .withRequiredFlags(
+                                     vk::MemoryPropertyFlagBits::eHostVisible
+                                     | vk::MemoryPropertyFlagBits::eHostCoherent
+                             )
+                             .withAllocationFlags(VMA_ALLOCATION_CREATE_MAPPED_BIT)
+                             .build();
+    // Slot 0 is never handed out, reserved up front so references into the table survive loads
+    textures.reserve(maxTextureCount);
+    textures.emplace_back();
+}
+
+vk::CommandBuffer Texture::TextureRegistry::getCommandBuffer()
+{
+    vk::CommandBuffer cmd;
+    if (!submittedCommands.empty()
+        && submittedCommands.front().first <= device.getSemaphoreCounterValue(uploadTimeline)) {
+        cmd = submittedCommands.front().second;
+        submittedCommands.pop_front();
+        cmd.reset();
+        return cmd;
+    }
     vk::CommandBufferAllocateInfo allocateInfo{};
     allocateInfo.commandBufferCount = 1;
     allocateInfo.level = vk::CommandBufferLevel::ePrimary;
     allocateInfo.commandPool = pool;
     vk::resultCheck(device.allocateCommandBuffers(&allocateInfo, &cmd), "Failed to allocate command buffer");
-    fence = device.createFence(vk::FenceCreateInfo());
+    return cmd;
 }
 
-void* Texture::TextureRegistry::getStagingPtr(USize size)
+std::optional<UInt32> Texture::TextureRegistry::findTexture(const std::string& name)
 {
-    if (stagingBuffer.getInfo().size <= size) {
-        stagingBuffer =
-                Buffer::Builder()
-                        .withSize(std::max(size + 1, stagingBuffer.getInfo().size * 2))
-                        .withSharingMode(vk::SharingMode::eExclusive)
-                        .withBufferUsage(vk::BufferUsageFlagBits::eTransferSrc)
-                        .withAllocator(allocator)
-                        .withUsage(VMA_MEMORY_USAGE_CPU_TO_GPU)
-                        .withAllocationFlags(VMA_ALLOCATION_CREATE_MAPPED_BIT)
-                        .withRequiredFlags(
-                                vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent
-                        )
-                        .build();
-    }
-    return stagingBuffer.getInfo().pMappedData;
+    std::unique_lock lock(mutex);
+    auto it = textureIds.find(name);
+    if (it == textureIds.end())
+        return std::nullopt;
+    return it->second;
+}
+
+void Texture::TextureRegistry::freeTexture(const std::string& name, DeletionQueue& deletionQueue)
+{
+    std::unique_lock lock(mutex);
+    auto it = textureIds.find(name);
+    if (it == textureIds.end())
+        return;
+    // The descriptor slot is left as is, ids are never reused and the bindless array is partially bound
+    Texture& texture = textures[it->second];
+    deletionQueue.push(texture.view);
+    deletionQueue.push(std::move(texture.image));
+    // A streaming job still running for it finds the texture gone and throws its image away
+    streamedTextures.erase(it->second);
+    texture = Texture();
+    textureIds.erase(it);
 }
 
 void Texture::TextureRegistry::destroy() noexcept
 {
     if (device) {
-        for (auto& [name, texture] : textures) {
-            device.destroy(texture.sampler);
+        {
+            std::unique_lock lock(pendingMutex);
+            for (const StagedTexture& staged : pendingTextures)
+                stagingRing->release(staged.stagingId, nullptr, 0);
+            pendingTextures.clear();
+            reservedBytes = 0;
+        }
+        {
+            std::unique_lock lock(streamingMutex);
+            streamingDone.wait(lock, [&] { return streamingJobs == 0; });
+        }
+        for (StreamedImage& streamed : streamedImages)
+            streamed.image.destroy();
+        streamedImages.clear();
+        streamedTextures.clear();
+        for (Texture& texture : textures) {
             device.destroy(texture.view);
             texture.image.destroy();
         }
         textures.clear();
+        textureIds.clear();
+        for (vk::Sampler sampler : samplers)
+            device.destroy(sampler);
+        samplers.clear();
+        samplerCache.clear();
+        writtenSamplers.clear();
+        samplerIndices.destroy();
+        submittedCommands.clear();
         device.destroy(pool);
-        device.destroy(fence);
-        stagingBuffer.destroy();
+        device.destroy(uploadTimeline);
         device = nullptr;
     }
 }
@@ -233,13 +648,28 @@ Texture::TextureRegistry::TextureRegistry(Texture::TextureRegistry&& other) noex
         other.device = nullptr;
         allocator = other.allocator;
         textures = std::move(other.textures);
-        stagingBuffer = std::move(other.stagingBuffer);
+        textureIds = std::move(other.textureIds);
+        stagingRing = other.stagingRing;
         pool = other.pool;
-        cmd = other.cmd;
         graphicsQueue = other.graphicsQueue;
-        fence = other.fence;
-        imageIndex = other.imageIndex;
+        queueMutex = other.queueMutex;
+        uploadTimeline = other.uploadTimeline;
+        nextUploadValue = other.nextUploadValue;
+        submittedCommands = std::move(other.submittedCommands);
         maxSamplerAnisotropy = other.maxSamplerAnisotropy;
+        generateMipmaps = other.generateMipmaps;
+        mipLodBias = other.mipLodBias;
+        streamedTextures = std::move(other.streamedTextures);
+        streamedImages = std::move(other.streamedImages);
+        textureBudget = other.textureBudget;
+        streamingBaseSize = other.streamingBaseSize;
+        deviceLocalHeap = other.deviceLocalHeap;
+        samplerCache = std::move(other.samplerCache);
+        samplers = std::move(other.samplers);
+        writtenSamplers = std::move(other.writtenSamplers);
+        samplerIndices = std::move(other.samplerIndices);
+        maxTextureCount = other.maxTextureCount;
+        descriptorTargets = std::move(other.descriptorTargets);
     }
 }
 
@@ -252,33 +682,231 @@ Texture::TextureRegistry& Texture::TextureRegistry::operator=(Texture::TextureRe
         other.device = nullptr;
         allocator = other.allocator;
         textures = std::move(other.textures);
-        stagingBuffer = std::move(other.stagingBuffer);
+        textureIds = std::move(other.textureIds);
+        stagingRing = other.stagingRing;
         pool = other.pool;
-        cmd = other.cmd;
         graphicsQueue = other.graphicsQueue;
-        fence = other.fence;
-        imageIndex = other.imageIndex;
+        queueMutex = other.queueMutex;
+        uploadTimeline = other.uploadTimeline;
+        nextUploadValue = other.nextUploadValue;
+        submittedCommands = std::move(other.submittedCommands);
         maxSamplerAnisotropy = other.maxSamplerAnisotropy;
+        generateMipmaps = other.generateMipmaps;
+        mipLodBias = other.mipLodBias;
+        streamedTextures = std::move(other.streamedTextures);
+        streamedImages = std::move(other.streamedImages);
+        textureBudget = other.textureBudget;
+        streamingBaseSize = other.streamingBaseSize;
+        deviceLocalHeap = other.deviceLocalHeap;
+        samplerCache = std::move(other.samplerCache);
+        samplers = std::move(other.samplers);
+        writtenSamplers = std::move(other.writtenSamplers);
+        samplerIndices = std::move(other.samplerIndices);
+        maxTextureCount = other.maxTextureCount;
+        descriptorTargets = std::move(other.descriptorTargets);
     }
     return *this;
 }
 
-void Texture::TextureRegistry::writeDescriptor(const std::string& textureId, vk::DescriptorSet set, UInt32 binding)
+void Texture::TextureRegistry::writeDescriptors(
+        std::span<const UInt32> ids,
+        vk::DescriptorSet set,
+        UInt32 binding,
+        UInt32 samplerBinding
+)
 {
-    Texture& texture = textures.at(textureId);
-    vk::DescriptorImageInfo imageInfo{};
-    imageInfo.sampler = texture.sampler;
-    imageInfo.imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
-    imageInfo.imageView = texture.view;
-    vk::WriteDescriptorSet write{};
-    write.descriptorCount = 1;
-    write.dstArrayElement = texture.id;
-    write.dstSet = set;
-    write.dstBinding = binding;
-    write.pImageInfo = &imageInfo;
-    write.descriptorType = vk::DescriptorType::eCombinedImageSampler;
+    // Textures are loaded from several threads at once, which also serializes the descriptor set updates
+    std::unique_lock lock(mutex);
+    writeTextureDescriptors(ids, DescriptorTarget{set, binding, samplerBinding});
+}
+
+void Texture::TextureRegistry::writeTextureDescriptors(std::span<const UInt32> ids, const DescriptorTarget& target)
+{
+    const vk::DescriptorSet set = target.set;
+    std::vector<vk::WriteDescriptorSet> writes;
+    writes.reserve(ids.size() + 1);
+
+    // Written along with the images, so the samplers are there by the time a draw uses the textures
+    UInt32& writtenCount = writtenSamplers[set];
+    std::vector<vk::DescriptorImageInfo> samplerInfos(samplers.size() - writtenCount);
+    if (!samplerInfos.empty()) {
+        for (USize i = 0; i < samplerInfos.size(); i++)
+            samplerInfos[i].sampler = samplers[writtenCount + i];
+        vk::WriteDescriptorSet& write = writes.emplace_back();
+        write.descriptorCount = samplerInfos.size();
+        write.dstArrayElement = writtenCount;
+        write.dstSet = set;
+        write.dstBinding = target.samplerBinding;
+        write.pImageInfo = samplerInfos.data();
+        write.descriptorType = vk::DescriptorType::eSampler;
+        writtenCount = samplers.size();
+    }
+
+    std::vector<vk::DescriptorImageInfo> imageInfos(ids.size());
+    for (USize i = 0; i < ids.size(); i++) {
+        const Texture& texture = textures[ids[i]];
+        // Streamed textures can be freed before every frame caught up with their last swap
+        if (!texture.view)
+            continue;
+        imageInfos[i].imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+        imageInfos[i].imageView = texture.view;
+        vk::WriteDescriptorSet& write = writes.emplace_back();
+        write.descriptorCount = 1;
+        write.dstArrayElement = texture.id;
+        write.dstSet = set;
+        write.dstBinding = target.binding;
+        write.pImageInfo = &imageInfos[i];
+        write.descriptorType = vk::DescriptorType::eSampledImage;
+    }
+    if (!writes.empty())
+        device.updateDescriptorSets(writes, {});
+}
+
+vk::DeviceSize Texture::TextureRegistry::getResidentSize(const StreamedTexture& texture, UInt32 level)
+{
+    // Levels are stored largest first, so a level and every smaller one are the tail of the data
+    return texture.source->data.size() - texture.source->levels[level].offset;
+}
+
+vk::DeviceSize Texture::TextureRegistry::getStreamingBudget(vk::DeviceSize residentBytes) const
+{
+    VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+    vmaGetHeapBudgets(allocator, budgets);
+    const VmaBudget& heap = budgets[deviceLocalHeap];
+    // What streamed textures already use is part of the heap's usage, so it stays available to them
+    const vk::DeviceSize available = heap.budget > heap.usage ? heap.budget - heap.usage : 0;
+    return std::min(textureBudget, available + residentBytes);
+}
 
-    device.updateDescriptorSets(write, {});
+void Texture::TextureRegistry::updateResidency(std::span<const UInt32> feedback, UInt64 frame)
+{
+    std::unique_lock lock(mutex);
+    if (streamedTextures.empty())
+        return;
+    std::vector<StreamedTexture*> candidates;
+    candidates.reserve(streamedTextures.size());
+    vk::DeviceSize wantedBytes = 0, residentBytes = 0;
+    for (auto& [id, texture] : streamedTextures) {
+        const UInt32 sampledWidth = id < feedback.size() ? feedback[id] : 0;
+        if (sampledWidth > 0) {
+            // The coarsest level still at least as wide as what was sampled
+            UInt32 level = 0;
+            while (level < texture.baseLevel && texture.source->levels[level + 1].width >= sampledWidth)
+                level++;
+            if (level <= texture.targetLevel) {
+                texture.targetLevel = level;
+                texture.lastRefinedFrame = frame;
+            }
+            else if (frame - texture.lastRefinedFrame > STREAM_OUT_DELAY)
+                texture.targetLevel = level;
+            texture.lastSampledFrame = frame;
+        }
+        else if (frame - texture.lastSampledFrame > STREAM_OUT_DELAY)
+            texture.targetLevel = texture.baseLevel;
+        wantedBytes += getResidentSize(texture, texture.targetLevel);
+        residentBytes += getResidentSize(texture, texture.residentLevel);
+        candidates.push_back(&texture);
+    }
+
+    const vk::DeviceSize budget = getStreamingBudget(residentBytes);
+    if (wantedBytes > budget) {
+        std::sort(candidates.begin(), candidates.end(), [](const StreamedTexture* a, const StreamedTexture* b) {
+            return a->lastSampledFrame < b->lastSampledFrame;
+        });
+        for (StreamedTexture* texture : candidates) {
+            while (wantedBytes > budget && texture->targetLevel < texture->baseLevel) {
+                wantedBytes -= texture->source->levels[texture->targetLevel].size;
+                texture->targetLevel++;
+            }
+        }
+    }
+
+    // Only a few textures are streamed at once so the staging ring stays available to regular uploads
+    for (auto& [id, texture] : streamedTextures) {
+        if (streamingJobs >= MAX_STREAMING_JOBS)
+            break;
+        if (texture.streaming || texture.targetLevel == texture.residentLevel)
+            continue;
+        texture.streaming = true;
+        {
+            std::unique_lock jobsLock(streamingMutex);
+            streamingJobs++;
+        }
+        GLOBAL_THREAD_POOL.push_task([this, id, level = texture.targetLevel, source = texture.source] {
+            streamTexture(id, level, source);
+        });
+    }
+}
+
+void Texture::TextureRegistry::streamTexture(UInt32 id, UInt32 level, std::shared_ptr<const CompressedTexture> source)
+{
+    bool uploaded = false;
+    try {
+        const USize size = source->data.size() - source->levels[level].offset;
+        StagingRing::Allocation staging = stagingRing->allocate(size);
+        memcpy(staging.ptr, source->data.data() + source->levels[level].offset, size);
+        ImageUpload upload;
+        upload.copies = getLevelCopies(*source, level, staging.offset);
+        upload.staging = staging.buffer;
+        upload.format = getCompressedFormat(source->format);
+        upload.extent = vk::Extent2D{source->levels[level].width, source->levels[level].height};
+        upload.mipLevels = UInt32(upload.copies.size());
+
+        std::unique_lock lock(mutex);
+        const UInt64 value = uploadImages(std::span(&upload, 1));
+        stagingRing->release(staging.id, uploadTimeline, value);
+        streamedImages.push_back(StreamedImage{id, level, std::move(upload.image)});
+        uploaded = true;
+    }
+    catch (const std::exception& e) {
+        spdlog::get("Rendering")->error("Failed to stream level {} of texture {}: {}", level, id, e.what());
+    }
+    if (!uploaded) {
+        // The texture keeps its current levels and is retried by a later residency update
+        std::unique_lock lock(mutex);
+        if (auto it = streamedTextures.find(id); it != streamedTextures.end())
+            it->second.streaming = false;
+    }
+    {
+        std::unique_lock lock(streamingMutex);
+        streamingJobs--;
+    }
+    streamingDone.notify_all();
+}
+
+std::vector<UInt32> Texture::TextureRegistry::applyStreamedTextures(DeletionQueue& deletionQueue)
+{
+    std::unique_lock lock(mutex);
+    std::vector<UInt32> swapped;
+    for (StreamedImage& streamed : streamedImages) {
+        auto it = streamedTextures.find(streamed.id);
+        if (it == streamedTextures.end()) {
+            deletionQueue.push(std::move(streamed.image));
+            continue;
+        }
+        // Frames still in flight sample the old image, so it is destroyed once they are done
+        StreamedTexture& streamedTexture = it->second;
+        Texture& texture = textures[streamed.id];
+        deletionQueue.push(texture.view);
+        deletionQueue.push(std::move(texture.image));
+        const UInt32 mipLevels = streamedTexture.source->levels.size() - streamed.level;
+        texture = Texture(texture.id, std::move(streamed.image), mipLevels, texture.samplerIndex, device);
+        streamedTexture.residentLevel = streamed.level;
+        streamedTexture.streaming = false;
+        swapped.push_back(streamed.id);
+    }
+    streamedImages.clear();
+    return swapped;
+}
+
+Texture::TextureRegistry::StreamingStats Texture::TextureRegistry::getStreamingStats()
+{
+    std::unique_lock lock(mutex);
+    StreamingStats stats{};
+    for (const auto& [id, texture] : streamedTextures)
+        stats.residentBytes += getResidentSize(texture, texture.residentLevel);
+    stats.budgetBytes = streamedTextures.empty() ? textureBudget : getStreamingBudget(stats.residentBytes);
+    return stats;
 }
 
-}   // namespace dragonfire
\ No newline at end of file
+}   // namespace dragonfire
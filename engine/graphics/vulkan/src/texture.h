@@ -4,19 +4,30 @@
 
 #pragma once
 #include "allocation.h"
+#include "compressed_texture.h"
+#include "deletion_queue.h"
 #include "material.h"
-#include <map>
+#include "staging.h"
+#include <ankerl/unordered_dense.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <renderer.h>
+#include <span>
 
 namespace dragonfire {
 
 class Texture {
     UInt32 id = 0;
-    vk::Sampler sampler;
+    /// Index of the texture's sampler in the registry's sampler cache
+    UInt32 samplerIndex = 0;
     vk::ImageView view;
     Image image;
 
 public:
-    Texture(UInt32 id, Image&& image, vk::Sampler sampler, vk::Device device);
+    Texture(UInt32 id, Image&& image, UInt32 mipLevels, UInt32 samplerIndex, vk::Device device);
     Texture() = default;
 
     class TextureRegistry {
@@ -27,23 +38,49 @@ public:
                 VmaAllocator allocator,
                 vk::Queue graphicsQueue,
                 UInt32 graphicsFamily,
-                float maxSamplerAnisotropy
+                float maxSamplerAnisotropy,
+                bool generateMipmaps,
+                UInt32 maxTextureCount,
+                std::mutex* queueMutex,
+                StagingRing* stagingRing
         );
 
-        UInt32 loadTexture(
-                const std::string& name,
-                const void* data,
-                UInt32 width,
-                UInt32 height,
-                UInt bitDepth,
-                UInt pixelSize,
-                Material::TextureWrapMode wrapS,
-                Material::TextureWrapMode wrapT,
-                Material::TextureFilterMode minFilter,
-                Material::TextureFilterMode magFilter
-        );
+        /**
+         * @brief Uploads the textures with one submission per batch of them, textures already loaded are skipped
+         * Compressed textures only have the levels up to graphics.textureStreamingBaseSize resident until they are
+         * sampled finer, those are moved from to keep their levels for streaming. Streaming is disabled when
+         * graphics.textureBudget is 0. Batches are shared by every loading thread and written to the descriptor
+         * targets as soon as they are submitted.
+         * @return the id of every texture, 0 for textures over the texture limit
+         */
+        std::vector<UInt32> loadTextures(std::span<Renderer::TextureUpload> uploads);
+        /// Submits the textures every thread has staged so far, registered as a staging ring flush callback
+        void submitPending();
+        /// Names are only looked up when importing, everything else addresses textures by their id
+        std::optional<UInt32> findTexture(const std::string& name);
+        /// The texture's gpu resources are destroyed through the deletion queue once no frame uses them
+        void freeTexture(const std::string& name, DeletionQueue& deletionQueue);
         void destroy() noexcept;
 
+        /**
+         * @brief Picks the levels streamed textures should have resident and starts uploading the missing ones
+         * Textures the feedback doesn't mention for a while drop back to their base level, and when the levels
+         * wanted don't fit the budget the textures sampled longest ago give up their finest levels first.
+         * @param feedback Widest level sampled per texture id, as written by the fragment shader
+         */
+        void updateResidency(std::span<const UInt32> feedback, UInt64 frame);
+        /**
+         * @brief Swaps in the images streaming finished, the replaced ones are destroyed through the deletion queue
+         * @return Ids of the textures whose descriptors have to be rewritten
+         */
+        std::vector<UInt32> applyStreamedTextures(DeletionQueue& deletionQueue);
+
+        struct StreamingStats {
+            vk::DeviceSize residentBytes = 0, budgetBytes = 0;
+        };
+
+        StreamingStats getStreamingStats();
+
         ~TextureRegistry() noexcept { destroy(); };
 
         TextureRegistry(TextureRegistry&) = delete;
@@ -51,24 +88,159 @@ public:
         TextureRegistry(TextureRegistry&& other) noexcept;
         TextureRegistry& operator=(TextureRegistry&& other) noexcept;
 
-        void writeDescriptor(const std::string& textureId, vk::DescriptorSet set, UInt32 binding);
+        struct DescriptorTarget {
+            vk::DescriptorSet set;
+            UInt32 binding = 0, samplerBinding = 0;
+        };
+
+        /// Sets whose bindless arrays get every texture written when it is created
+        void setDescriptorTargets(std::vector<DescriptorTarget> targets);
+
+        /**
+         * @brief Writes the images of the textures into the bindless image array of the set with a single update
+         * Samplers created since the set was last written are written to the sampler array along with them,
+         * textures that were freed are skipped.
+         */
+        void writeDescriptors(
+                std::span<const UInt32> ids,
+                vk::DescriptorSet set,
+                UInt32 binding,
+                UInt32 samplerBinding
+        );
+
+        /// Sampler index of every texture id, the fragment shader pairs each image with its sampler through it
+        [[nodiscard]] const Buffer& getSamplerIndexBuffer() const { return samplerIndices; }
+
+        /// Size of the sampler array, textures only use a handful of distinct sampler states
+        static constexpr UInt32 MAX_SAMPLERS = 64;
 
-        [[nodiscard]] const Texture& getTexture(const std::string& textureId) const { return textures.at(textureId); }
+        [[nodiscard]] const Texture& getTexture(UInt32 textureId) const { return textures.at(textureId); }
 
     private:
+        /// A compressed texture whose levels finer than its base level are only resident while they are sampled
+        struct StreamedTexture {
+            /// Shared with streaming jobs, so freeing the texture doesn't pull the levels from under them
+            std::shared_ptr<const CompressedTexture> source;
+            /// Finest level on the gpu, the finest one that should be and the coarsest one that always is
+            UInt32 residentLevel = 0, targetLevel = 0, baseLevel = 0;
+            UInt64 lastSampledFrame = 0, lastRefinedFrame = 0;
+            bool streaming = false;
+        };
+
+        /// Image holding the levels from a streamed texture's new resident level on
+        struct StreamedImage {
+            UInt32 id = 0, level = 0;
+            Image image;
+        };
+
+        struct SamplerKey {
+            Material::TextureWrapMode wrapS{}, wrapT{};
+            Material::TextureFilterMode minFilter{}, magFilter{};
+
+            bool operator==(const SamplerKey& other) const = default;
+
+            struct Hash {
+                USize operator()(const SamplerKey& key) const;
+            };
+        };
+
+        /// An image created and filled from staged levels by uploadImages
+        struct ImageUpload {
+            vk::Format format{};
+            vk::Extent2D extent;
+            UInt32 mipLevels = 1;
+            /// Either every level is staged or only the first one is, the rest are blitted
+            std::vector<vk::BufferImageCopy> copies;
+            vk::Buffer staging;
+            Image image;
+        };
+
+        /// A texture whose levels are staged, created when the batch it belongs to is submitted
+        struct StagedTexture {
+            std::string name;
+            ImageUpload upload;
+            SamplerKey sampler;
+            UInt64 stagingId = 0;
+            vk::DeviceSize size = 0;
+            /// Registered for streaming once created if it has a source
+            StreamedTexture streamed;
+        };
+
+        /// Frames a texture keeps levels the feedback no longer asks for, so they don't bounce in and out
+        static constexpr UInt64 STREAM_OUT_DELAY = 120;
+        static constexpr UInt32 MAX_STREAMING_JOBS = 4;
+
         VmaAllocator allocator = nullptr;
-        std::map<std::string, Texture> textures;
-        Buffer stagingBuffer;
+        /// Indexed by texture id, the same index as the texture's slot in the bindless array. Freed slots are left
+        /// default constructed since ids are never reused
+        std::vector<Texture> textures;
+        ankerl::unordered_dense::map<std::string, UInt32> textureIds;
+        StagingRing* stagingRing = nullptr;
         vk::Device device = nullptr;
         vk::CommandPool pool;
-        vk::CommandBuffer cmd;
         vk::Queue graphicsQueue;
-        vk::Fence fence;
+        std::mutex* queueMutex = nullptr;
+        /// Signaled by each upload submission, command buffers are reused once their value is reached
+        vk::Semaphore uploadTimeline;
+        UInt64 nextUploadValue = 1;
+        std::deque<std::pair<UInt64, vk::CommandBuffer>> submittedCommands;
         std::mutex mutex;
-        UInt32 imageIndex = 1;
         float maxSamplerAnisotropy = 0.0f;
+        /// Whether textures get a full mip chain, which needs linear blits of the texture format
+        bool generateMipmaps = false;
+        /// Added to the level of detail every texture is sampled at, read from graphics.textureLodBias
+        float mipLodBias = 0.0f;
+        /// Streamed textures by texture id
+        ankerl::unordered_dense::map<UInt32, StreamedTexture> streamedTextures;
+        std::vector<StreamedImage> streamedImages;
+        /// Jobs started by updateResidency that haven't finished, the registry is only destroyed once there are none
+        std::atomic<UInt32> streamingJobs = 0;
+        std::mutex streamingMutex;
+        std::condition_variable streamingDone;
+        /// Read from graphics.textureBudget in MiB and capped by what the device local heap has left
+        vk::DeviceSize textureBudget = 0;
+        UInt32 streamingBaseSize = 0;
+        UInt32 deviceLocalHeap = 0;
+        /// Samplers are shared by every texture with the same sampler state and live as long as the registry
+        ankerl::unordered_dense::map<SamplerKey, UInt32, SamplerKey::Hash> samplerCache;
+        std::vector<vk::Sampler> samplers;
+        /// Number of samplers already written to each descriptor set
+        ankerl::unordered_dense::map<VkDescriptorSet, UInt32> writtenSamplers;
+        Buffer samplerIndices;
+        UInt32 maxTextureCount = 0;
+        std::vector<DescriptorTarget> descriptorTargets;
+        /// Staged textures waiting for a submission, their staging can't be reclaimed until then
+        std::vector<StagedTexture> pendingTextures;
+        /// Staging reserved by loadTextures calls, both pending and still being copied in
+        vk::DeviceSize reservedBytes = 0;
+        std::mutex pendingMutex;
+        std::condition_variable pendingStaged;
 
-        void* getStagingPtr(USize size);
+        vk::CommandBuffer getCommandBuffer();
+        /// Index of the cached sampler for the state, which is created the first time the state is used
+        UInt32 getSampler(const SamplerKey& key);
+        /// Coarsest level of a compressed texture that is always resident
+        [[nodiscard]] UInt32 getBaseLevel(const CompressedTexture& texture) const;
+        [[nodiscard]] vk::DeviceSize getStagingSize(const Renderer::TextureUpload& upload) const;
+        /// Copies the texture's levels into the staging ring, the staging is released by submitTextures
+        StagedTexture stageTexture(Renderer::TextureUpload& upload);
+        /// The pending mutex must be held
+        void submitPendingLocked();
+        /// Uploads the staged textures with a single submission and registers them with a cached sampler
+        void submitTextures(std::span<StagedTexture> batch);
+        /// The registry's mutex must be held
+        void writeTextureDescriptors(std::span<const UInt32> ids, const DescriptorTarget& target);
+        /**
+         * @brief Creates the images and records all of their uploads into one command buffer and submission
+         * The copies of every image and their layout transitions are merged, only blitted levels need barriers
+         * of their own. The registry's mutex must be held.
+         * @return upload timeline value signaled once the images are ready
+         */
+        UInt64 uploadImages(std::span<ImageUpload> images);
+        /// Streaming job uploading the levels of a texture from the given one on
+        void streamTexture(UInt32 id, UInt32 level, std::shared_ptr<const CompressedTexture> source);
+        [[nodiscard]] static vk::DeviceSize getResidentSize(const StreamedTexture& texture, UInt32 level);
+        [[nodiscard]] vk::DeviceSize getStreamingBudget(vk::DeviceSize residentBytes) const;
     };
 };
 
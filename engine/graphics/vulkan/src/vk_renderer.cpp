@@ -5,26 +5,37 @@
 #include "vk_renderer.h"
 #include "mesh.h"
 #include "renderer.h"
+#include <algorithm>
 #include <imgui_impl_sdl2.h>
 #include <imgui_impl_vulkan.h>
 #include <transform.h>
+#include <utility.h>
 #include <vulkan/vulkan_hash.hpp>
 #include <world.h>
 
 namespace dragonfire {
 
-void VkRenderer::render(World& world, const Camera& camera, bool enableCulling)
+void VkRenderer::render(World& world, const Camera& camera, const RenderOptions& options)
 {
     startFrame();
     beginRenderingCommands(world, camera);
     Frame& frame = getCurrentFrame();
     DrawData* drawData = static_cast<DrawData*>(frame.drawData.getInfo().pMappedData);
+    // Meshes become drawable once their upload is acquired here, anything loaded since is sent off right after
+    frame.uploadWaitValue = meshRegistry.acquireUploads(frame.cmd);
+    meshRegistry.submitUploads();
+    // Mesh offsets may change here, so it has to happen before any of them are read below
+    frameStats.defragmentedBytes =
+            options.enableDefragmentation ? meshRegistry.defragment(frame.cmd, deletionQueue, defragmentBudget) : 0;
 
     pipelineMap.clear();
+    batchMap.clear();
+    batches.clear();
+    batchSizes.clear();
     entt::registry& registry = world.getRegistry();
     using namespace entt::literals;
 
-    UInt32 pipelineCount = 0, drawCount = 0;
+    UInt32 pipelineCount = 0, drawCount = 0, clusterCount = 0, clusterDrawCount = 0;
     auto group = registry.group<Model, Transform>({}, entt::exclude<entt::tag<"invisible"_hs>>);
     for (auto&& [entity, model, transform] : group.each()) {
         for (auto& primitive : model.getPrimitives()) {
@@ -32,34 +43,113 @@ void VkRenderer::render(World& world, const Camera& camera, bool enableCulling)
                 logger->error("Max draw count exceeded, some models may not be drawn");
                 break;
             }
+            Mesh* mesh = reinterpret_cast<Mesh*>(primitive.mesh);
+            if (!meshRegistry.isResident(*mesh))
+                continue;
             const Material& material = primitive.material;
-            auto [pipeline, layout] = pipelineLibrary.getPipeline(material.getPipelineId());
-            if (pipelineMap.contains(pipeline)) {
-                auto& info = pipelineMap[pipeline];
+            auto [pipeline, layout] = pipelineLibrary.getPipeline(material.getPipelineId(), mesh->vertexFormat);
+            // Neither the material's pipeline nor the fallback is ready
+            if (!pipeline)
+                continue;
+            const PipelineKey pipelineKey{pipeline, mesh->indexType};
+            if (pipelineMap.contains(pipelineKey)) {
+                auto& info = pipelineMap[pipelineKey];
                 info.drawCount++;
             }
             else {
-                auto& info = pipelineMap[pipeline];
+                auto& info = pipelineMap[pipelineKey];
                 info.index = pipelineCount++;
                 info.layout = layout;
                 info.drawCount = 1;
             }
+            BatchKey key{pipeline, mesh, options.enableInstancing ? 0 : drawCount};
+            if (!batchMap.contains(key)) {
+                // Every level of detail gets its own batch since each one is a separate indirect draw
+                auto& info = pipelineMap[pipelineKey];
+                batchMap[key] = UInt32(batches.size());
+                for (UInt32 lod = 0; lod < mesh->lodCount; lod++) {
+                    BatchData& batch = batches.emplace_back();
+                    batch.indexCount = mesh->lods[lod].indexCount;
+                    batch.firstIndex = mesh->getIndexOffset() + mesh->lods[lod].indexOffset;
+                    batch.vertexOffset = Int32(mesh->getVertexOffset());
+                    batch.pipelineIndex = info.index;
+                    batch.lodError = mesh->lods[lod].error;
+                    batch.meshletOffset = mesh->getMeshletOffset() + mesh->lods[lod].meshletOffset;
+                    batch.meshletCount = mesh->lods[lod].meshletCount;
+                    batchSizes.push_back(0);
+                }
+                info.batchCount += mesh->lodCount;
+            }
+            // Any level may be picked by the gpu, so each needs room for every instance
+            const UInt32 batchIndex = batchMap[key];
+            for (UInt32 lod = 0; lod < mesh->lodCount; lod++)
+                batchSizes[batchIndex + lod]++;
+
             glm::mat4 m = transform.toMatrix() * primitive.transform;
+            const float scale = getMatrixScaleFactor(m);
             drawData[drawCount].transform = m;
             drawData[drawCount].boundingSphere = primitive.bounds;
-            drawData[drawCount].boundingSphere.w *= getMatrixScaleFactor(m);
-            Mesh* mesh = reinterpret_cast<Mesh*>(primitive.mesh);
-            drawData[drawCount].vertexOffset = mesh->getVertexOffset();
-            drawData[drawCount].vertexCount = mesh->vertexCount;
-            drawData[drawCount].indexOffset = mesh->getIndexOffset();
-            drawData[drawCount].indexCount = mesh->indexCount;
+            drawData[drawCount].boundingSphere.w *= scale;
             drawData[drawCount].textureIndices = material.getTextureIds();
+            drawData[drawCount].batchIndex = batchIndex;
+            drawData[drawCount].lodCount = mesh->lodCount;
+            drawData[drawCount].lodScale = scale;
+            drawData[drawCount].positionOffset = glm::vec4(mesh->quantization.offset, 0.0f);
+            drawData[drawCount].positionScale = glm::vec4(mesh->quantization.scale, 0.0f);
+
+            // Meshes made of a single meshlet gain nothing over whole draw culling and stay instanced,
+            // the rest get a command for every meshlet of their most detailed level when there is room
+            const UInt32 meshletCount = mesh->lods[0].meshletCount;
+            drawData[drawCount].clusterCulling = options.enableClusterCulling && meshletCount > 1
+                                                 && clusterCount + meshletCount <= maxClusterCount
+                                                 && clusterDrawCount < limits.maxComputeWorkGroupCount[0];
+            if (drawData[drawCount].clusterCulling) {
+                pipelineMap[pipelineKey].clusterCount += meshletCount;
+                clusterCount += meshletCount;
+                clusterDrawCount++;
+            }
             drawCount++;
         }
     }
 
-    computePrePass(drawCount, enableCulling);
-    renderMainPass();
+    // Each pipeline owns a contiguous range of indirect commands with one slot per batch and one per meshlet
+    // of its cluster culled draws, each batch owns a range of the instance buffer large enough for all of its draws
+    std::vector<UInt32, FrameAllocator<UInt32>> commandBases(pipelineCount);
+    UInt32 commandBase = 0;
+    for (auto& [key, info] : pipelineMap) {
+        info.commandBase = commandBase;
+        commandBases[info.index] = commandBase;
+        commandBase += info.batchCount + info.clusterCount;
+    }
+    BatchData* batchData = static_cast<BatchData*>(frame.batchData.getInfo().pMappedData);
+    UInt32 instanceBase = 0;
+    for (USize i = 0; i < batches.size(); i++) {
+        batches[i].instanceBase = instanceBase;
+        batches[i].commandBase = commandBases[batches[i].pipelineIndex];
+        instanceBase += batchSizes[i];
+    }
+    memcpy(batchData, batches.data(), batches.size() * sizeof(BatchData));
+    frame.drawCount = drawCount;
+    frame.batchCount = UInt32(batches.size());
+    frame.pipelineCount = pipelineCount;
+    frame.clusterDrawCount = clusterDrawCount;
+
+    computePrePass(drawCount, options);
+    // Draw what was visible last frame, then use its depth to find what became visible this frame
+    if (options.enableOcclusionCulling) {
+        renderMainPass(mainRenderPass, false);
+        frame.cmd.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, frame.queryPool, 2);
+        lateCullPass(options);
+        frame.cmd.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, frame.queryPool, 3);
+        renderMainPass(lateRenderPass, true);
+    }
+    else {
+        frame.cmd.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, frame.queryPool, 2);
+        frame.cmd.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, frame.queryPool, 3);
+        renderMainPass(mainRenderPass, true);
+    }
+    frame.cmd.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, frame.queryPool, 4);
+    copyTextureFeedback();
 
     endFrame();
 }
@@ -93,48 +183,306 @@ void VkRenderer::beginRenderingCommands(const World& world, const Camera& camera
     frame.cmd.begin(beginInfo);
 }
 
-void VkRenderer::computePrePass(UInt32 drawCount, bool cull)
+void VkRenderer::computePrePass(UInt32 drawCount, const RenderOptions& options)
 {
     Frame& frame = getCurrentFrame();
     vk::CommandBuffer cmd = frame.cmd;
+    cmd.resetQueryPool(frame.queryPool, 0, TIMESTAMP_COUNT);
+    cmd.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, frame.queryPool, 0);
+    if (!visibilityCleared) {
+        cmd.fillBuffer(visibilityBuffer, 0, VK_WHOLE_SIZE, 0);
+        visibilityCleared = true;
+    }
+    // The main passes record the widest level each texture is sampled at
+    cmd.fillBuffer(frame.textureFeedback, 0, VK_WHOLE_SIZE, 0);
+    vk::BufferMemoryBarrier feedbackBarrier{};
+    feedbackBarrier.buffer = frame.textureFeedback;
+    feedbackBarrier.size = VK_WHOLE_SIZE;
+    feedbackBarrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+    feedbackBarrier.dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite;
+    feedbackBarrier.srcQueueFamilyIndex = feedbackBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    cmd.pipelineBarrier(
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eFragmentShader,
+            {},
+            {},
+            feedbackBarrier,
+            {}
+    );
+
     cmd.bindDescriptorSets(vk::PipelineBindPoint::eCompute, cullComputeLayout, 0, frame.computeSet, {});
+    cullDraws(CULL_EARLY_PHASE, getCullFlags(options));
+    cmd.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, frame.queryPool, 1);
+    frame.lateCulled = false;
+}
+
+UInt32 VkRenderer::getCullFlags(const RenderOptions& options)
+{
+    UInt32 flags = 0;
+    if (options.enableCulling)
+        flags |= FRUSTUM_CULLING_BIT;
+    if (options.enableOcclusionCulling)
+        flags |= OCCLUSION_CULLING_BIT;
+    if (options.enableLod)
+        flags |= LOD_SELECTION_BIT;
+    return flags;
+}
+
+void VkRenderer::cullDraws(UInt32 phase, UInt32 flags)
+{
+    Frame& frame = getCurrentFrame();
+    vk::CommandBuffer cmd = frame.cmd;
+    cmd.fillBuffer(frame.countBuffer, 0, VK_WHOLE_SIZE, 0);
+    cmd.fillBuffer(frame.batchCounts, 0, VK_WHOLE_SIZE, 0);
+    const UInt32 clusterDispatch[] = {0, 1, 1};
+    cmd.updateBuffer(frame.clusterBuffer, 0, sizeof(clusterDispatch), clusterDispatch);
+    // Also orders the visibility writes of the previous cull pass before this one
+    vk::MemoryBarrier clearBarrier{};
+    clearBarrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite | vk::AccessFlagBits::eShaderWrite;
+    clearBarrier.dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite;
+    cmd.pipelineBarrier(
+            vk::PipelineStageFlagBits::eTransfer | vk::PipelineStageFlagBits::eComputeShader,
+            vk::PipelineStageFlagBits::eComputeShader,
+            {},
+            clearBarrier,
+            {},
+            {}
+    );
+
+    // Every draw is culled exactly once regardless of how many pipelines are in use, survivors are
+    // binned into their pipeline's command range by the batch they belong to
     cmd.bindPipeline(vk::PipelineBindPoint::eCompute, cullComputePipeline);
-    UInt32 baseIndex = 0;
-    for (auto& [pipeline, info] : pipelineMap) {
-        if (info.drawCount == 0)
-            continue;
-        UInt32 pushConstants[] = {baseIndex, info.index, drawCount, cull ? 1u : 0};
-        cmd.pushConstants(cullComputeLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(UInt32) * 4, pushConstants);
-        cmd.dispatch(std::max(drawCount / 256u, 1u), 1, 1);
-        baseIndex += info.drawCount;
+    CullPushConstants pushConstants{};
+    pushConstants.drawCount = frame.drawCount;
+    pushConstants.batchCount = frame.batchCount;
+    pushConstants.flags = flags;
+    pushConstants.phase = phase;
+    pushConstants.pyramidSize = glm::vec2(depthPyramidExtent.width, depthPyramidExtent.height);
+    pushConstants.lodPixelError = lodPixelError;
+    pushConstants.clusterInstanceBase = maxBatchCount;
+    cmd.pushConstants(
+            cullComputeLayout,
+            vk::ShaderStageFlagBits::eCompute,
+            0,
+            sizeof(CullPushConstants),
+            &pushConstants
+    );
+    if (frame.drawCount > 0)
+        cmd.dispatch((frame.drawCount + 255) / 256, 1, 1);
+
+    // Batch instance counts must be final before they are compacted into draw commands,
+    // and the cluster draw count before it is used as the cluster phase's dispatch size
+    vk::MemoryBarrier cullBarrier{};
+    cullBarrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
+    cullBarrier.dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite
+                                | vk::AccessFlagBits::eIndirectCommandRead;
+    cmd.pipelineBarrier(
+            vk::PipelineStageFlagBits::eComputeShader,
+            vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eDrawIndirect,
+            {},
+            cullBarrier,
+            {},
+            {}
+    );
+
+    pushConstants.phase = COMPACT_PHASE;
+    cmd.pushConstants(
+            cullComputeLayout,
+            vk::ShaderStageFlagBits::eCompute,
+            0,
+            sizeof(CullPushConstants),
+            &pushConstants
+    );
+    if (frame.batchCount > 0)
+        cmd.dispatch((frame.batchCount + 255) / 256, 1, 1);
+
+    // One workgroup per draw appended by the cull phase, its meshlets are tested individually and appended
+    // to the same command ranges as the batches. The depth pyramid is only current in the late phase
+    if (frame.clusterDrawCount > 0) {
+        pushConstants.phase = CLUSTER_PHASE;
+        if (phase != CULL_LATE_PHASE)
+            pushConstants.flags &= ~OCCLUSION_CULLING_BIT;
+        cmd.pushConstants(
+                cullComputeLayout,
+                vk::ShaderStageFlagBits::eCompute,
+                0,
+                sizeof(CullPushConstants),
+                &pushConstants
+        );
+        cmd.dispatchIndirect(frame.clusterBuffer, 0);
     }
 
-    vk::BufferMemoryBarrier commands{}, count{};
-    commands.buffer = frame.commandBuffer;
-    commands.size = frame.commandBuffer.getInfo().size;
-    count.buffer = frame.countBuffer;
-    count.size = frame.countBuffer.getInfo().size;
-    commands.offset = count.offset = 0;
-    commands.srcAccessMask = count.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
-    commands.dstAccessMask = count.dstAccessMask = vk::AccessFlagBits::eIndirectCommandRead;
+    vk::MemoryBarrier barrier{};
+    barrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
+    barrier.dstAccessMask = vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eShaderRead
+                            | vk::AccessFlagBits::eTransferRead;
     cmd.pipelineBarrier(
             vk::PipelineStageFlagBits::eComputeShader,
-            vk::PipelineStageFlagBits::eDrawIndirect,
+            vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexShader
+                    | vk::PipelineStageFlagBits::eFragmentShader | vk::PipelineStageFlagBits::eTransfer,
             {},
+            barrier,
             {},
-            {commands, count},
             {}
     );
+
+    if (frame.pipelineCount > 0) {
+        // Counts of each phase are stored separately so the frame stats can sum both
+        vk::BufferCopy copy{};
+        copy.size = frame.pipelineCount * sizeof(UInt32);
+        copy.dstOffset = phase == CULL_LATE_PHASE ? copy.size : 0;
+        cmd.copyBuffer(frame.countBuffer, frame.statsBuffer, copy);
+        vk::MemoryBarrier hostBarrier{};
+        hostBarrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        hostBarrier.dstAccessMask = vk::AccessFlagBits::eHostRead;
+        cmd.pipelineBarrier(
+                vk::PipelineStageFlagBits::eTransfer,
+                vk::PipelineStageFlagBits::eHost,
+                {},
+                hostBarrier,
+                {},
+                {}
+        );
+    }
 }
 
-void VkRenderer::renderMainPass()
+void VkRenderer::copyTextureFeedback()
+{
+    Frame& frame = getCurrentFrame();
+    vk::CommandBuffer cmd = frame.cmd;
+    vk::BufferMemoryBarrier barrier{};
+    barrier.buffer = frame.textureFeedback;
+    barrier.size = VK_WHOLE_SIZE;
+    barrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
+    barrier.dstAccessMask = vk::AccessFlagBits::eTransferRead;
+    barrier.srcQueueFamilyIndex = barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    cmd.pipelineBarrier(
+            vk::PipelineStageFlagBits::eFragmentShader,
+            vk::PipelineStageFlagBits::eTransfer,
+            {},
+            {},
+            barrier,
+            {}
+    );
+    vk::BufferCopy copy{};
+    copy.size = maxDrawCount * sizeof(UInt32);
+    cmd.copyBuffer(frame.textureFeedback, frame.feedbackReadback, copy);
+    vk::MemoryBarrier hostBarrier{};
+    hostBarrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+    hostBarrier.dstAccessMask = vk::AccessFlagBits::eHostRead;
+    cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost, {}, hostBarrier, {}, {});
+}
+
+void VkRenderer::buildDepthPyramid()
+{
+    vk::CommandBuffer cmd = getCurrentFrame().cmd;
+    vk::ImageSubresourceRange range{};
+    range.aspectMask = vk::ImageAspectFlagBits::eColor;
+    range.baseMipLevel = 0;
+    range.levelCount = depthPyramidLevels;
+    range.baseArrayLayer = 0;
+    range.layerCount = 1;
+
+    // Every level is fully rewritten, so the previous contents can be discarded
+    vk::ImageMemoryBarrier discard{};
+    discard.image = depthPyramid;
+    discard.subresourceRange = range;
+    discard.oldLayout = vk::ImageLayout::eUndefined;
+    discard.newLayout = vk::ImageLayout::eGeneral;
+    discard.srcAccessMask = vk::AccessFlagBits::eShaderRead;
+    discard.dstAccessMask = vk::AccessFlagBits::eShaderWrite;
+    discard.srcQueueFamilyIndex = discard.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    cmd.pipelineBarrier(
+            vk::PipelineStageFlagBits::eComputeShader,
+            vk::PipelineStageFlagBits::eComputeShader,
+            {},
+            {},
+            {},
+            discard
+    );
+
+    const bool multisampled = msaaSamples != vk::SampleCountFlagBits::e1;
+    vk::Extent2D inputExtent = swapchain.getExtent();
+    for (UInt32 level = 0; level < depthPyramidLevels; level++) {
+        vk::Extent2D outputExtent(
+                std::max(depthPyramidExtent.width >> level, 1u),
+                std::max(depthPyramidExtent.height >> level, 1u)
+        );
+        UInt32 pushConstants[] = {
+                inputExtent.width,
+                inputExtent.height,
+                outputExtent.width,
+                outputExtent.height,
+                UInt32(msaaSamples),
+        };
+        const bool resolve = level == 0 && multisampled;
+        vk::PipelineLayout layout = resolve ? depthResolveLayout : depthReduceLayout;
+        cmd.bindPipeline(vk::PipelineBindPoint::eCompute, resolve ? depthResolvePipeline : depthReducePipeline);
+        cmd.bindDescriptorSets(vk::PipelineBindPoint::eCompute, layout, 0, depthReduceSets[level], {});
+        cmd.pushConstants(
+                layout,
+                vk::ShaderStageFlagBits::eCompute,
+                0,
+                sizeof(UInt32) * (resolve ? 5 : 4),
+                pushConstants
+        );
+        cmd.dispatch((outputExtent.width + 15) / 16, (outputExtent.height + 15) / 16, 1);
+
+        vk::ImageMemoryBarrier levelBarrier{};
+        levelBarrier.image = depthPyramid;
+        levelBarrier.subresourceRange = range;
+        levelBarrier.subresourceRange.baseMipLevel = level;
+        levelBarrier.subresourceRange.levelCount = 1;
+        levelBarrier.oldLayout = levelBarrier.newLayout = vk::ImageLayout::eGeneral;
+        levelBarrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
+        levelBarrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+        levelBarrier.srcQueueFamilyIndex = levelBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        cmd.pipelineBarrier(
+                vk::PipelineStageFlagBits::eComputeShader,
+                vk::PipelineStageFlagBits::eComputeShader,
+                {},
+                {},
+                {},
+                levelBarrier
+        );
+        inputExtent = outputExtent;
+    }
+}
+
+void VkRenderer::lateCullPass(const RenderOptions& options)
+{
+    Frame& frame = getCurrentFrame();
+    vk::CommandBuffer cmd = frame.cmd;
+    buildDepthPyramid();
+
+    // The early draws must be done reading the commands and instances before they are overwritten
+    vk::MemoryBarrier reuseBarrier{};
+    reuseBarrier.srcAccessMask = vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eShaderRead
+                                 | vk::AccessFlagBits::eTransferRead;
+    reuseBarrier.dstAccessMask = vk::AccessFlagBits::eShaderWrite | vk::AccessFlagBits::eTransferWrite;
+    cmd.pipelineBarrier(
+            vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexShader
+                    | vk::PipelineStageFlagBits::eFragmentShader | vk::PipelineStageFlagBits::eTransfer,
+            vk::PipelineStageFlagBits::eComputeShader | vk::PipelineStageFlagBits::eTransfer,
+            {},
+            reuseBarrier,
+            {},
+            {}
+    );
+
+    cmd.bindDescriptorSets(vk::PipelineBindPoint::eCompute, cullComputeLayout, 0, frame.computeSet, {});
+    cullDraws(CULL_LATE_PHASE, getCullFlags(options));
+    frame.lateCulled = true;
+}
+
+void VkRenderer::renderMainPass(vk::RenderPass pass, bool finalPass)
 {
     Frame& frame = getCurrentFrame();
     vk::ClearValue clearValues[2];
     clearValues[0].color = {std::array<float, 4>{0.0f, 0.0f, 0.0f, 1.0f}};
     clearValues[1].depthStencil = vk::ClearDepthStencilValue(1.0f, 0);
-    startRenderPass(mainRenderPass, clearValues);
     vk::CommandBuffer cmd = frame.cmd;
+    startRenderPass(pass, clearValues);
 
     vk::Viewport viewport{};
     viewport.x = viewport.y = 0.0f;
@@ -149,9 +497,13 @@ void VkRenderer::renderMainPass()
     cmd.setScissor(0, scissor);
 
     meshRegistry.bindBuffers(cmd);
-    vk::DeviceSize drawOffset = 0;
-    for (auto& [pipeline, info] : pipelineMap) {
-        cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
+    vk::IndexType boundIndexType = vk::IndexType::eUint32;
+    for (auto& [key, info] : pipelineMap) {
+        if (key.indexType != boundIndexType) {
+            meshRegistry.bindIndexBuffer(cmd, key.indexType);
+            boundIndexType = key.indexType;
+        }
+        cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, key.pipeline);
         cmd.bindDescriptorSets(
                 vk::PipelineBindPoint::eGraphics,
                 info.layout,
@@ -161,16 +513,16 @@ void VkRenderer::renderMainPass()
         );
         cmd.drawIndexedIndirectCount(
                 frame.commandBuffer,
-                drawOffset,
+                info.commandBase * sizeof(vk::DrawIndexedIndirectCommand),
                 frame.countBuffer,
                 info.index * sizeof(UInt32),
-                maxDrawCount,
+                info.batchCount + info.clusterCount,
                 sizeof(vk::DrawIndexedIndirectCommand)
         );
-        drawOffset += info.drawCount * sizeof(vk::DrawIndexedIndirectCommand);
     }
 
-    renderImGui();
+    if (finalPass)
+        renderImGui();
     cmd.endRenderPass();
 }
 
@@ -201,6 +553,13 @@ void VkRenderer::startFrame()
     Frame& frame = getCurrentFrame();
     if (device.waitForFences(frame.fence, true, UINT64_MAX) != vk::Result::eSuccess)
         logger->error("Fence wait failed, attempting to continue, but things may break");
+    readFrameStats(frame);
+    // The fence wait means the last frame to use this frame slot is done, along with everything before it
+    deletionQueue.nextFrame(frameCount);
+    updateTextureResidency(frame);
+    pipelineLibrary.applyReloadedPipelines(deletionQueue);
+    if (std::vector<std::string> reloaded = pipelineLibrary.takeReloadedShaders(); !reloaded.empty())
+        reloadComputePipelines(reloaded);
 
     UInt retries = 0;
     do {
@@ -222,8 +581,13 @@ void VkRenderer::startFrame()
                 );
                 device.destroy(msaaView);
                 device.destroy(depthView);
+                device.destroy(depthPyramidView);
+                for (UInt32 i = 0; i < depthPyramidLevels; i++)
+                    device.destroy(depthPyramidMips[i]);
                 createMsaaImage();
                 createDepthImage();
+                createDepthPyramid();
+                writeDepthPyramidDescriptors();
                 swapchain.initFramebuffers(mainRenderPass, msaaView, depthView);
                 break;
             default: crash("Failed to acquire next swapchain image");
@@ -235,9 +599,112 @@ void VkRenderer::startFrame()
     device.resetFences(frame.fence);
 }
 
+void VkRenderer::readFrameStats(Frame& frame)
+{
+    if (!frame.submitted)
+        return;
+    UInt64 timestamps[TIMESTAMP_COUNT];
+    vk::Result result = device.getQueryPoolResults(
+            frame.queryPool,
+            0,
+            TIMESTAMP_COUNT,
+            sizeof(timestamps),
+            timestamps,
+            sizeof(UInt64),
+            vk::QueryResultFlagBits::e64
+    );
+    if (result == vk::Result::eSuccess) {
+        // timestamp period is in nanoseconds per tick
+        const double period = double(limits.timestampPeriod) / 1e6;
+        frameStats.cullTime = double(timestamps[1] - timestamps[0] + timestamps[3] - timestamps[2]) * period;
+        frameStats.renderTime = double(timestamps[2] - timestamps[1] + timestamps[4] - timestamps[3]) * period;
+    }
+    const UInt32* counts = static_cast<const UInt32*>(frame.statsBuffer.getInfo().pMappedData);
+    const UInt32 countEntries = frame.lateCulled ? frame.pipelineCount * 2 : frame.pipelineCount;
+    frameStats.commandCount = 0;
+    for (UInt32 i = 0; i < countEntries; i++)
+        frameStats.commandCount += counts[i];
+    frameStats.drawCount = frame.drawCount;
+    frameStats.batchCount = frame.batchCount;
+    frameStats.meshHeapFragmentation = 0.0f;
+    frameStats.meshMemory = 0;
+    for (const Mesh::MeshRegistry::HeapStats& heap : meshRegistry.getHeapStats()) {
+        frameStats.meshHeapFragmentation = std::max(frameStats.meshHeapFragmentation, heap.fragmentation);
+        frameStats.meshMemory += heap.committedBytes;
+    }
+    const Texture::TextureRegistry::StreamingStats streaming = textureRegistry.getStreamingStats();
+    frameStats.textureMemory = streaming.residentBytes;
+    frameStats.textureBudget = streaming.budgetBytes;
+
+    const auto now = std::chrono::steady_clock::now();
+    const double elapsed = std::chrono::duration<double>(now - uploadSampleTime).count();
+    if (elapsed >= 1.0) {
+        const UInt64 bytes = stagingRing.getUploadedBytes();
+        frameStats.uploadRate = double(bytes - uploadSampleBytes) / (1024.0 * 1024.0) / elapsed;
+        uploadSampleBytes = bytes;
+        uploadSampleTime = now;
+    }
+}
+
+void VkRenderer::reloadComputePipelines(std::span<const std::string> shaders)
+{
+    const std::tuple<std::string_view, vk::Pipeline*, vk::PipelineLayout> computePipelines[] = {
+            {"cull.comp", &cullComputePipeline, cullComputeLayout},
+            {"depth_reduce.comp", &depthReducePipeline, depthReduceLayout},
+            {"depth_resolve.comp", &depthResolvePipeline, depthResolveLayout},
+    };
+    for (const auto& [name, pipeline, layout] : computePipelines) {
+        if (std::ranges::none_of(shaders, [&](const std::string& shader) { return shader == name; }))
+            continue;
+        try {
+            auto [reloaded, reloadedLayout] = pipelineFactory->createComputePipeline(std::string(name));
+            // The descriptor sets were allocated for the old bindings, so a changed interface can't be swapped in
+            if (reloadedLayout != layout) {
+                device.destroy(reloaded);
+                logger->error(
+                        "Compute shader \"{}\" changed its bindings or push constants, restart to apply it",
+                        name
+                );
+                continue;
+            }
+            // Frames in flight may still be dispatching the old pipeline
+            deletionQueue.push(*pipeline);
+            *pipeline = reloaded;
+            logger->info("Recreated compute pipeline of \"{}\"", name);
+        }
+        catch (const std::exception& e) {
+            logger->error("Failed to recreate compute pipeline of \"{}\", error: {}", name, e.what());
+        }
+    }
+}
+
+void VkRenderer::updateTextureResidency(Frame& frame)
+{
+    if (frame.submitted) {
+        const UInt32* feedback = static_cast<const UInt32*>(frame.feedbackReadback.getInfo().pMappedData);
+        textureRegistry.updateResidency(std::span(feedback, maxDrawCount), frameCount);
+    }
+    // Other frames may still be sampling the replaced images, so each rewrites its set after its own fence wait
+    std::vector<UInt32> swapped = textureRegistry.applyStreamedTextures(deletionQueue);
+    if (!swapped.empty()) {
+        for (Frame& f : frames)
+            f.pendingTextureWrites.insert(f.pendingTextureWrites.end(), swapped.begin(), swapped.end());
+    }
+    if (!frame.pendingTextureWrites.empty()) {
+        textureRegistry.writeDescriptors(
+                frame.pendingTextureWrites,
+                frame.frameSet,
+                frame.textureBinding,
+                frame.samplerBinding
+        );
+        frame.pendingTextureWrites.clear();
+    }
+}
+
 void VkRenderer::endFrame()
 {
     getCurrentFrame().cmd.end();
+    getCurrentFrame().submitted = true;
     std::unique_lock lock(presentData.mutex);
     presentingFrame = &getCurrentFrame();
     lock.unlock();
@@ -252,16 +719,28 @@ void VkRenderer::present(const std::stop_token& stopToken)
         presentData.condVar.wait(lock, stopToken, [&] { return presentingFrame != nullptr; });
         if (stopToken.stop_requested())
             break;
-        vk::PipelineStageFlags mask = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+        // The upload timeline value was already reached when the frame acquired it, the wait only orders
+        // the transfer queue's writes before this submission
+        const vk::Semaphore waitSemaphores[] = {presentingFrame->renderSemaphore, meshRegistry.getUploadTimeline()};
+        const vk::PipelineStageFlags masks[] = {
+                vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                vk::PipelineStageFlagBits::eAllCommands};
+        const UInt64 waitValues[] = {0, presentingFrame->uploadWaitValue};
+        vk::TimelineSemaphoreSubmitInfo timelineInfo{};
+        timelineInfo.waitSemaphoreValueCount = 2;
+        timelineInfo.pWaitSemaphoreValues = waitValues;
         vk::SubmitInfo submitInfo{};
         submitInfo.pCommandBuffers = &presentingFrame->cmd;
         submitInfo.commandBufferCount = 1;
-        submitInfo.pWaitSemaphores = &presentingFrame->renderSemaphore;
-        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.pWaitSemaphores = waitSemaphores;
+        submitInfo.waitSemaphoreCount = presentingFrame->uploadWaitValue != 0 ? 2 : 1;
         submitInfo.pSignalSemaphores = &presentingFrame->presentSemaphore;
         submitInfo.signalSemaphoreCount = 1;
-        submitInfo.pWaitDstStageMask = &mask;
+        submitInfo.pWaitDstStageMask = masks;
+        if (presentingFrame->uploadWaitValue != 0)
+            submitInfo.pNext = &timelineInfo;
 
+        std::unique_lock queueLock(queues.mutex);
         queues.graphics.submit(submitInfo, presentingFrame->fence);
 
         UInt32 index = swapchain.getCurrentImageIndex();
@@ -274,6 +753,7 @@ void VkRenderer::present(const std::stop_token& stopToken)
         presentInfo.pImageIndices = &index;
 
         presentData.result = queues.present.presentKHR(&presentInfo);
+        queueLock.unlock();
         presentingFrame = nullptr;
         lock.unlock();
         presentData.condVar.notify_one();
@@ -282,15 +762,45 @@ void VkRenderer::present(const std::stop_token& stopToken)
     logger->info("Presentation thread destroyed");
 }
 
-MeshHandle VkRenderer::createMesh(std::span<Model::Vertex> vertices, std::span<UInt32> indices)
+MeshHandle VkRenderer::createMesh(
+        std::span<Model::Vertex> vertices,
+        std::span<UInt32> indices,
+        std::span<const Model::Lod> lods,
+        std::span<const Model::Meshlet> meshlets
+)
+{
+    return meshRegistry.createMesh(vertices, indices, lods, meshlets);
+}
+
+MeshHandle VkRenderer::createCompactMesh(
+        std::span<Model::CompactVertex> vertices,
+        std::span<UInt32> indices,
+        const Model::Quantization& quantization,
+        std::span<const Model::Lod> lods,
+        std::span<const Model::Meshlet> meshlets
+)
+{
+    return meshRegistry.createCompactMesh(vertices, indices, quantization, lods, meshlets);
+}
+
+MeshHandle VkRenderer::createEncodedMesh(const Model::EncodedMesh& mesh)
+{
+    return meshRegistry.createEncodedMesh(mesh);
+}
+
+std::optional<UInt32> VkRenderer::findTexture(const std::string& name)
 {
-    return meshRegistry.createMesh(vertices, indices);
+    return textureRegistry.findTexture(name);
 }
 
 void VkRenderer::freeMesh(MeshHandle mesh)
 {
-    // TODO buffer freeing it to ensure the mesh is not still in use by the gpu
-    meshRegistry.freeMesh(mesh);
+    meshRegistry.freeMesh(mesh, deletionQueue);
+}
+
+void VkRenderer::freeTexture(const std::string& name)
+{
+    textureRegistry.freeTexture(name, deletionQueue);
 }
 
 void VkRenderer::startImGuiFrame()
@@ -315,6 +825,14 @@ void VkRenderer::shutdown()
         frame.commandBuffer.destroy();
         frame.countBuffer.destroy();
         frame.textureIndexBuffer.destroy();
+        frame.batchData.destroy();
+        frame.batchCounts.destroy();
+        frame.instanceBuffer.destroy();
+        frame.statsBuffer.destroy();
+        frame.clusterBuffer.destroy();
+        frame.textureFeedback.destroy();
+        frame.feedbackReadback.destroy();
+        device.destroy(frame.queryPool);
         device.destroy(frame.pool);
         device.destroy(frame.fence);
         device.destroy(frame.renderSemaphore);
@@ -323,14 +841,28 @@ void VkRenderer::shutdown()
 
     device.destroy(descriptorPool);
     pipelineLibrary.destroy();
+    pipelineFactory.reset();
     layoutManager.destroy();
+    deletionQueue.destroy();
     meshRegistry.destroy();
     textureRegistry.destroy();
+    stagingRing.destroy();
 
     globalUBO.destroy();
+    visibilityBuffer.destroy();
     device.destroy(cullComputePipeline);
     device.destroy(cullComputeLayout);
+    device.destroy(depthReducePipeline);
+    device.destroy(depthReduceLayout);
+    device.destroy(depthResolvePipeline);
+    device.destroy(depthResolveLayout);
+    device.destroy(depthSampler);
+    device.destroy(depthPyramidView);
+    for (UInt32 i = 0; i < depthPyramidLevels; i++)
+        device.destroy(depthPyramidMips[i]);
+    depthPyramid.destroy();
     device.destroy(mainRenderPass);
+    device.destroy(lateRenderPass);
     device.destroy(msaaView);
     msaaImage.destroy();
     device.destroy(depthView);
@@ -358,12 +890,52 @@ UInt32 VkRenderer::loadTexture(
         Material::TextureFilterMode magFilter
 )
 {
-    UInt32 id =
-            textureRegistry
-                    .loadTexture(name, data, width, height, bitDepth, pixelSize, wrapS, wrapT, minFilter, magFilter);
-    for (Frame& frame : frames)
-        textureRegistry.writeDescriptor(name, frame.frameSet, frame.textureBinding);
-    return id;
+    TextureUpload upload;
+    upload.name = name;
+    upload.pixels = data;
+    upload.width = width;
+    upload.height = height;
+    upload.bitDepth = bitDepth;
+    upload.pixelSize = pixelSize;
+    upload.wrapS = wrapS;
+    upload.wrapT = wrapT;
+    upload.minFilter = minFilter;
+    upload.magFilter = magFilter;
+    return loadTextures(std::span(&upload, 1))[0];
+}
+
+UInt32 VkRenderer::loadCompressedTexture(
+        const std::string& name,
+        CompressedTexture texture,
+        Material::TextureWrapMode wrapS,
+        Material::TextureWrapMode wrapT,
+        Material::TextureFilterMode minFilter,
+        Material::TextureFilterMode magFilter
+)
+{
+    TextureUpload upload;
+    upload.name = name;
+    upload.compressed = std::move(texture);
+    upload.wrapS = wrapS;
+    upload.wrapT = wrapT;
+    upload.minFilter = minFilter;
+    upload.magFilter = magFilter;
+    return loadTextures(std::span(&upload, 1))[0];
+}
+
+std::vector<UInt32> VkRenderer::loadTextures(std::span<TextureUpload> textures)
+{
+    return textureRegistry.loadTextures(textures);
+}
+
+USize VkRenderer::PipelineKey::Hash::operator()(const VkRenderer::PipelineKey& key) const
+{
+    return hashAll(key.pipeline, key.indexType);
+}
+
+USize VkRenderer::BatchKey::Hash::operator()(const VkRenderer::BatchKey& key) const
+{
+    return hashAll(key.pipeline, key.mesh, key.drawIndex);
 }
 
 VKAPI_ATTR VkBool32 VKAPI_CALL VkRenderer::debugCallback(
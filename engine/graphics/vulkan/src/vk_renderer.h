@@ -4,12 +4,15 @@
 
 #pragma once
 #include "allocation.h"
+#include "deletion_queue.h"
 #include "descriptor_set.h"
 #include "mesh.h"
 #include "pipeline.h"
+#include "staging.h"
 #include "swapchain.h"
 #include "texture.h"
 #include <glm/glm.hpp>
+#include <chrono>
 #include <renderer.h>
 #include <thread>
 
@@ -20,9 +23,24 @@ public:
     void init() override;
     void shutdown() override;
 
-    MeshHandle createMesh(std::span<Model::Vertex> vertices, std::span<UInt32> indices) override;
+    MeshHandle createMesh(
+            std::span<Model::Vertex> vertices,
+            std::span<UInt32> indices,
+            std::span<const Model::Lod> lods,
+            std::span<const Model::Meshlet> meshlets
+    ) override;
+    MeshHandle createCompactMesh(
+            std::span<Model::CompactVertex> vertices,
+            std::span<UInt32> indices,
+            const Model::Quantization& quantization,
+            std::span<const Model::Lod> lods,
+            std::span<const Model::Meshlet> meshlets
+    ) override;
+    MeshHandle createEncodedMesh(const Model::EncodedMesh& mesh) override;
+    std::optional<UInt32> findTexture(const std::string& name) override;
     void freeMesh(MeshHandle mesh) override;
-    void render(World& world, const Camera& camera, bool enableCulling) override;
+    void freeTexture(const std::string& name) override;
+    void render(World& world, const Camera& camera, const RenderOptions& options) override;
     void startImGuiFrame() override;
     UInt32 loadTexture(
             const std::string& name,
@@ -36,6 +54,17 @@ public:
             Material::TextureFilterMode minFilter,
             Material::TextureFilterMode magFilter
     ) override;
+    UInt32 loadCompressedTexture(
+            const std::string& name,
+            CompressedTexture texture,
+            Material::TextureWrapMode wrapS,
+            Material::TextureWrapMode wrapT,
+            Material::TextureFilterMode minFilter,
+            Material::TextureFilterMode magFilter
+    ) override;
+    std::vector<UInt32> loadTextures(std::span<TextureUpload> textures) override;
+
+    bool supportsCompressedTextures() override { return textureCompression; }
 
     static constexpr USize FRAMES_IN_FLIGHT = 2;
 
@@ -47,20 +76,51 @@ private:
     vk::PhysicalDeviceLimits limits;
     vk::Device device;
     vk::SampleCountFlagBits msaaSamples;
+    /// Whether the device supports BC texture compression
+    bool textureCompression = false;
     UInt32 maxDrawCount = 0;
+    /// Every draw may need one batch per level of detail of its mesh
+    UInt32 maxBatchCount = 0;
+    /// Indirect commands reserved for meshlets of cluster culled draws on top of the batch commands
+    UInt32 maxClusterCount = 0;
+    float lodPixelError = 1.0f;
+    /// Bytes of mesh data defragmentation may move each frame
+    vk::DeviceSize defragmentBudget = 0;
 
     struct Queues {
         UInt32 graphicsFamily = 0, presentFamily = 0, transferFamily = 0;
         vk::Queue graphics, present, transfer;
+        /// Guards every queue submission, the families may share a queue and submissions come from several threads
+        std::mutex mutex;
     } queues;
 
     Swapchain swapchain;
     VmaAllocator allocator;
     Image depthImage, msaaImage;
     vk::ImageView depthView, msaaView;
-    vk::RenderPass mainRenderPass;
+    /// The main pass is split in two for occlusion culling, the late pass loads what the main pass rendered
+    vk::RenderPass mainRenderPass, lateRenderPass;
+
+    static constexpr UInt32 MAX_PYRAMID_LEVELS = 16;
+    Image depthPyramid;
+    vk::ImageView depthPyramidView;
+    std::array<vk::ImageView, MAX_PYRAMID_LEVELS> depthPyramidMips;
+    std::array<vk::DescriptorSet, MAX_PYRAMID_LEVELS> depthReduceSets;
+    vk::Extent2D depthPyramidExtent;
+    UInt32 depthPyramidLevels = 0;
+    vk::Sampler depthSampler;
+    vk::Pipeline depthReducePipeline, depthResolvePipeline;
+    vk::PipelineLayout depthReduceLayout, depthResolveLayout;
+    /// Per draw visibility from the end of the last frame, shared by all frames in flight
+    Buffer visibilityBuffer;
+    bool visibilityCleared = false;
+
     DescriptorLayoutManager layoutManager;
+    /// Kept after initialization since material pipelines are compiled when first drawn
+    std::unique_ptr<PipelineFactory> pipelineFactory;
     Pipeline::PipelineLibrary pipelineLibrary;
+    StagingRing stagingRing;
+    DeletionQueue deletionQueue;
     Mesh::MeshRegistry meshRegistry;
     Texture::TextureRegistry textureRegistry;
     vk::Pipeline cullComputePipeline;
@@ -74,9 +134,21 @@ private:
         vk::CommandBuffer cmd;
         vk::DescriptorSet globalDescriptorSet, computeSet, frameSet;
         Buffer drawData, culledMatrices, commandBuffer, countBuffer, textureIndexBuffer;
+        Buffer batchData, batchCounts, instanceBuffer, statsBuffer;
+        /// Indirect dispatch arguments of the cluster culling phase followed by the draws it culls
+        Buffer clusterBuffer;
+        /// Widest texture level sampled per texture id, copied to the readback buffer after the main pass
+        Buffer textureFeedback, feedbackReadback;
+        /// Streamed textures swapped since the frame's descriptor set was last written
+        std::vector<UInt32> pendingTextureWrites;
+        vk::QueryPool queryPool;
         vk::Semaphore renderSemaphore, presentSemaphore;
         vk::Fence fence;
-        UInt32 textureBinding = 0;
+        UInt32 textureBinding = 0, samplerBinding = 0;
+        UInt32 drawCount = 0, batchCount = 0, pipelineCount = 0, clusterDrawCount = 0;
+        /// Mesh upload timeline value the frame's commands wait on, 0 when no upload was acquired
+        UInt64 uploadWaitValue = 0;
+        bool submitted = false, lateCulled = false;
     } frames[FRAMES_IN_FLIGHT], *presentingFrame = nullptr;
 
     struct {
@@ -88,30 +160,104 @@ private:
 
     struct alignas(16) DrawData {
         glm::mat4 transform{};
-        UInt32 vertexOffset = 0, vertexCount = 0, indexOffset = 0, indexCount = 0;
         TextureIds textureIndices;
         glm::vec4 boundingSphere;
+        /// Index of the batch of the first level of detail, the others follow it
+        UInt32 batchIndex = 0;
+        UInt32 lodCount = 1;
+        /// Converts the model space simplification error to world space
+        float lodScale = 1.0f;
+        /// Set when the draw's meshlets are culled individually, which needs room for a command per meshlet
+        UInt32 clusterCulling = 0;
+        /// Dequantization of compact vertex positions, folded into the model matrix by the culling pass
+        glm::vec4 positionOffset{0.0f}, positionScale{1.0f};
+    };
+
+    /// A single level of detail of a mesh drawn with a single pipeline, the culling pass turns every batch
+    /// with visible instances into one instanced indirect draw
+    struct BatchData {
+        UInt32 indexCount = 0, firstIndex = 0;
+        Int32 vertexOffset = 0;
+        UInt32 instanceBase = 0, commandBase = 0, pipelineIndex = 0;
+        float lodError = 0.0f;
+        /// Range of the level's meshlets in the mesh registry's meshlet buffer
+        UInt32 meshletOffset = 0, meshletCount = 0;
+    };
+
+    struct BatchKey {
+        vk::Pipeline pipeline;
+        const Mesh* mesh = nullptr;
+        /// Unique per draw when instancing is disabled, so every draw gets its own batch
+        UInt32 drawIndex = 0;
+
+        bool operator==(const BatchKey& other) const = default;
+
+        struct Hash {
+            USize operator()(const BatchKey& key) const;
+        };
+    };
+
+    /// Draws are grouped by pipeline and index type, every group is a single indirect draw call
+    struct PipelineKey {
+        vk::Pipeline pipeline;
+        vk::IndexType indexType = vk::IndexType::eUint32;
+
+        bool operator==(const PipelineKey& other) const = default;
+
+        struct Hash {
+            USize operator()(const PipelineKey& key) const;
+        };
     };
 
     struct PipelineDrawInfo {
-        UInt32 index = 0, drawCount = 0;
+        UInt32 index = 0, drawCount = 0, batchCount = 0, clusterCount = 0, commandBase = 0;
         vk::PipelineLayout layout;
     };
 
-    ankerl::unordered_dense::map<vk::Pipeline, PipelineDrawInfo> pipelineMap;
+    ankerl::unordered_dense::map<PipelineKey, PipelineDrawInfo, PipelineKey::Hash> pipelineMap;
+    ankerl::unordered_dense::map<BatchKey, UInt32, BatchKey::Hash> batchMap;
+    std::vector<BatchData> batches;
+    std::vector<UInt32> batchSizes;
 
 private:
     void present(const std::stop_token& stopToken);
     void startFrame();
     void beginRenderingCommands(const World& world, const Camera& camera);
-    void computePrePass(UInt32 drawCount, bool cull);
-    void renderMainPass();
+    void computePrePass(UInt32 drawCount, const RenderOptions& options);
+    void cullDraws(UInt32 phase, UInt32 flags);
+    static UInt32 getCullFlags(const RenderOptions& options);
+    void buildDepthPyramid();
+    void lateCullPass(const RenderOptions& options);
+    void readFrameStats(Frame& frame);
+    /// Copies the texture feedback of the frame to the readback buffer once its passes are done
+    void copyTextureFeedback();
+    /// Feeds the frame's texture feedback to streaming and rewrites the descriptors of swapped textures
+    void updateTextureResidency(Frame& frame);
+    /// Recreates the culling and depth pyramid pipelines whose shaders were hot reloaded
+    void reloadComputePipelines(std::span<const std::string> shaders);
+    /// Bytes uploaded through the staging ring at the start of the current upload rate sample
+    UInt64 uploadSampleBytes = 0;
+    std::chrono::steady_clock::time_point uploadSampleTime;
+    void renderMainPass(vk::RenderPass pass, bool finalPass);
     void renderImGui();
     void startRenderPass(vk::RenderPass pass, std::span<vk::ClearValue> clearValues);
     void endFrame();
 
     Frame& getCurrentFrame() { return frames[frameCount % FRAMES_IN_FLIGHT]; }
 
+    static constexpr UInt32 CULL_EARLY_PHASE = 0, COMPACT_PHASE = 1, CULL_LATE_PHASE = 2, CLUSTER_PHASE = 3;
+    static constexpr UInt32 FRUSTUM_CULLING_BIT = 1, OCCLUSION_CULLING_BIT = 2, LOD_SELECTION_BIT = 4;
+    /// Timestamps around the early cull, main pass, late cull and late pass
+    static constexpr UInt32 TIMESTAMP_COUNT = 5;
+
+    struct CullPushConstants {
+        UInt32 drawCount, batchCount, flags, phase;
+        glm::vec2 pyramidSize;
+        float lodPixelError;
+        /// Instance buffer slots past the batch instances, one per meshlet command
+        UInt32 clusterInstanceBase;
+    };
+
     void createInstance(bool validation);
     void getPhysicalDevice();
     bool getQueueFamilies(vk::PhysicalDevice pDevice) noexcept;
@@ -120,6 +266,9 @@ private:
     void createDepthImage();
     void createMsaaImage();
     void createRenderPass();
+    void createDepthPyramid();
+    void createOcclusionResources();
+    void writeDepthPyramidDescriptors();
     void createGlobalUBO();
     void createDescriptorPool();
     void initFrame(Frame& frame, UInt32 frameIndex);
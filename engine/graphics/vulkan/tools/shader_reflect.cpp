@@ -0,0 +1,59 @@
+//
+// Created by josh on 10/19/26.
+//
+
+#include "shader_reflection.h"
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <spirv_reflect.h>
+
+using namespace dragonfire;
+
+/// Build tool writing the reflection sidecar of a compiled shader, usage: ShaderReflect <shader.spv> <output>
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        std::cerr << "Usage: " << (argc > 0 ? argv[0] : "ShaderReflect") << " <shader.spv> <output>\n";
+        return 1;
+    }
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "Failed to open shader \"" << argv[1] << "\"\n";
+        return 1;
+    }
+    const std::vector<char> spv((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    SpvReflectShaderModule module;
+    if (spvReflectCreateShaderModule(spv.size(), spv.data(), &module) != SPV_REFLECT_RESULT_SUCCESS) {
+        std::cerr << "Shader reflection of \"" << argv[1] << "\" failed\n";
+        return 1;
+    }
+    ShaderReflection reflection;
+    reflection.stage = module.shader_stage;
+    for (UInt32 i = 0; i < module.descriptor_binding_count; i++) {
+        const SpvReflectDescriptorBinding& bindingInfo = module.descriptor_bindings[i];
+        ShaderReflection::Binding& binding = reflection.bindings.emplace_back();
+        binding.set = bindingInfo.set;
+        binding.binding = bindingInfo.binding;
+        binding.descriptorType = bindingInfo.descriptor_type;
+        binding.count = bindingInfo.count;
+        const std::string_view name = bindingInfo.name ? bindingInfo.name : "";
+        binding.bindless = name.find("bindless") != std::string_view::npos;
+    }
+    for (UInt32 i = 0; i < module.push_constant_block_count; i++) {
+        const SpvReflectBlockVariable& block = module.push_constant_blocks[i];
+        reflection.pushConstants.push_back(ShaderReflection::PushConstantRange{block.offset, block.size});
+    }
+    const std::vector<UInt8> data =
+            reflection.write(std::span(reinterpret_cast<const UInt8*>(spv.data()), spv.size()));
+    spvReflectDestroyShaderModule(&module);
+
+    std::ofstream out(argv[2], std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+    if (!out) {
+        std::cerr << "Failed to write \"" << argv[2] << "\"\n";
+        return 1;
+    }
+    return 0;
+}
@@ -20,7 +20,32 @@ layout(std430, set=1, binding=1) buffer TextureData {
     TextureIndices indices[];
 }textureData;
 
-layout(set=1, binding=2) uniform sampler2D bindless_textures[];
+// Widest texture level sampled per texture id, the renderer streams in levels up to that width
+layout(std430, set=1, binding=3) buffer TextureFeedback {
+    uint requestedWidths[];
+}textureFeedback;
+
+// Index into texture_samplers of every texture id
+layout(std430, set=1, binding=4) readonly buffer TextureSamplers {
+    uint indices[];
+}textureSamplers;
+
+// Shared by every texture with the same sampler state, sized like Texture::TextureRegistry::MAX_SAMPLERS
+layout(set=1, binding=5) uniform sampler texture_samplers[64];
+layout(set=1, binding=6) uniform texture2D bindless_textures[];
+
+// Instanced draws share a mesh and pipeline but not their material, so texture ids vary within a draw
+#define BINDLESS_TEXTURE(id) sampler2D(bindless_textures[nonuniformEXT(id)], \
+                                       texture_samplers[nonuniformEXT(textureSamplers.indices[id])])
+
+void requestTextureWidth(uint id) {
+    // Queried by the whole quad, the lod comes from derivatives which are undefined in divergent control flow
+    float lod = textureQueryLod(BINDLESS_TEXTURE(id), uv).y;
+    float width = float(textureSize(BINDLESS_TEXTURE(id), 0).x) * exp2(-lod);
+    // Only a pixel out of every 4x4 block reports, which is plenty and keeps the atomics down
+    if (((uint(gl_FragCoord.x) | uint(gl_FragCoord.y)) & 3u) == 0u)
+        atomicMax(textureFeedback.requestedWidths[id], uint(clamp(width, 1.0, 65535.0)));
+}
 
 void main() {
     vec3 lightColor =  vec3(1.0, 1.0, 1.0);
@@ -39,7 +64,8 @@ void main() {
     vec3 objectColor = vec3(0.9, 0.7, 0.7);
     TextureIndices textureIndices = textureData.indices[instanceIndex];
     if (textureIndices.albedo != 0) {
-        objectColor = vec3(texture(bindless_textures[textureIndices.albedo], uv));
+        objectColor = vec3(texture(BINDLESS_TEXTURE(textureIndices.albedo), uv));
+        requestTextureWidth(textureIndices.albedo);
     }
     outColor = vec4((ambient + diffuse + specular) * objectColor, 1.0);
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 #version 460
 
+layout (constant_id=0) const bool compactVertices = false;
+
 layout (location=0) in vec3 position;
 layout (location=1) in vec3 normal;
 layout (location=2) in vec2 uv;
@@ -17,19 +19,33 @@ layout (std430, set=1, binding=0) readonly buffer Transforms {
     mat4 modelMatrices[];
 }transforms;
 
+layout (std430, set=1, binding=2) readonly buffer InstanceRemap {
+    uint drawIndices[];
+}instanceRemap;
+
 layout (location=0) out vec3 normalOut;
 layout (location=1) out vec2 uvOut;
 layout (location=2) out vec3 fragPos;
 layout (location=3) out uint instanceIndex;
 
+vec3 decodeOctahedral(vec2 e)
+{
+    vec3 n = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
 void main()
 {
-    mat4 model = transforms.modelMatrices[gl_InstanceIndex];
+    // instances of a batch are packed contiguously, remap them back to the draw they came from
+    uint drawIndex = instanceRemap.drawIndices[gl_InstanceIndex];
+    mat4 model = transforms.modelMatrices[drawIndex];
     mat4 transform = uboData.perspective * model;
     gl_Position = transform * vec4(position, 1.0);
     fragPos = vec3(model * vec4 (position, 1.0));
     // forward normals and uvs to fragment shader
-    normalOut = normal;
+    normalOut = compactVertices ? decodeOctahedral(normal.xy) : normal;
     uvOut = uv;
-    instanceIndex = gl_InstanceIndex;
+    instanceIndex = drawIndex;
 }
\ No newline at end of file